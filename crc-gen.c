@@ -0,0 +1,108 @@
+/*   Copyright (C) 2008 Robert Spanton, Tom Bennellick
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
+/* Generates crc-tables.h, which holds the tables and constants for the
+   CRC kernels in crc.c.  Run at build time.  The tables are defined
+   there, so only crc.c should include it. */
+#include <stdint.h>
+#include <stdio.h>
+
+/* The UIF uses the CCITT polynomial (x^16 + x^12 + x^5 + 1), bit-reflected */
+#define POLY 0x1021
+#define POLY_REFLECTED 0x8408
+
+/* Number of slicing tables */
+#define SLICES 8
+
+static uint16_t slice[SLICES][256];
+
+/* Returns x^n mod P, in normal (non-reflected) bit order */
+static uint16_t xpow_mod( uint32_t n )
+{
+	uint16_t r = 1;
+
+	while( n-- )
+		r = (r & 0x8000) ? (r << 1) ^ POLY : r << 1;
+
+	return r;
+}
+
+/* Returns the 64-bit clmul operand for the constant x^n mod P.
+   The CRC is reflected, so bit i of the operand holds the coefficient
+   of x^(63-i). */
+static uint64_t clmul_const( uint32_t n )
+{
+	uint16_t k = xpow_mod( n );
+	uint64_t r = 0;
+	uint8_t d;
+
+	for( d=0; d<16; d++ )
+		if( k & (1 << d) )
+			r |= (uint64_t)1 << (63 - d);
+
+	return r;
+}
+
+int main( void )
+{
+	uint32_t i, s;
+
+	/* Slice 0 is the ordinary byte-at-a-time table */
+	for( i=0; i<256; i++ ) {
+		uint16_t c = i;
+		uint8_t b;
+
+		for( b=0; b<8; b++ )
+			c = (c & 1) ? (c >> 1) ^ POLY_REFLECTED : c >> 1;
+
+		slice[0][i] = c;
+	}
+
+	/* Slice s gives the effect of a byte followed by s zero bytes */
+	for( s=1; s<SLICES; s++ )
+		for( i=0; i<256; i++ )
+			slice[s][i] = (slice[s-1][i] >> 8) ^ slice[0][ slice[s-1][i] & 0xff ];
+
+	printf( "/* Generated by crc-gen -- do not edit */\n" );
+	printf( "#ifndef __CRC_TABLES_H\n#define __CRC_TABLES_H\n" );
+	printf( "#include <stdint.h>\n\n" );
+
+	printf( "#define CRC_SLICES %u\n\n", SLICES );
+	printf( "const uint16_t crc_slice[CRC_SLICES][256] = {\n" );
+	for( s=0; s<SLICES; s++ ) {
+		printf( "\t{\n" );
+		for( i=0; i<256; i++ )
+			printf( "%s0x%4.4x,%s", (i % 8) == 0 ? "\t\t" : " ",
+				slice[s][i], (i % 8) == 7 ? "\n" : "" );
+		printf( "\t},\n" );
+	}
+	printf( "};\n\n" );
+
+	/* Folding constants for the carry-less multiply kernel.
+	   Folding a 128-bit block forward by n bits multiplies its first
+	   quadword (the high-order coefficients, as the CRC is reflected) by
+	   x^(n+64) and its second by x^n.  The extra factor of x that the
+	   reflected multiply introduces is taken off the exponent. */
+	printf( "/* Fold by 128 bits */\n" );
+	printf( "#define CRC_CLMUL_K128_Q0 0x%16.16llxULL\n", (unsigned long long)clmul_const( 128 + 64 - 1 ) );
+	printf( "#define CRC_CLMUL_K128_Q1 0x%16.16llxULL\n", (unsigned long long)clmul_const( 128 - 1 ) );
+	printf( "/* Fold by 512 bits */\n" );
+	printf( "#define CRC_CLMUL_K512_Q0 0x%16.16llxULL\n", (unsigned long long)clmul_const( 512 + 64 - 1 ) );
+	printf( "#define CRC_CLMUL_K512_Q1 0x%16.16llxULL\n", (unsigned long long)clmul_const( 512 - 1 ) );
+
+	printf( "\n#endif\t/* __CRC_TABLES_H */\n" );
+
+	return 0;
+}
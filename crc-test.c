@@ -0,0 +1,164 @@
+/* Checks and benchmarks the CRC kernels in crc.c
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* The kernels are static, so this builds crc.c in. */
+#include "crc.c"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct
+{
+	const char *name;
+	crc_kernel_t k;
+} crc_test_kernel_t;
+
+/* Size of the random buffer that the kernels are checked over */
+#define CHECK_LEN 1024
+/* Number of random checks of each kernel */
+#define CHECK_ROUNDS 512
+/* Size of the buffer that the kernels are timed over */
+#define BENCH_LEN (1024 * 1024)
+/* Number of passes over that buffer */
+#define BENCH_ROUNDS 64
+
+/* Byte at a time, as the reference for the others */
+static uint16_t crc_update_ref( uint16_t crc, const uint8_t* buf, int32_t len );
+
+/* Checks a kernel against the reference on random data, lengths and
+ * alignments.  Returns 1 if they always agree. */
+static int crc_test_check( const crc_test_kernel_t *t );
+
+/* Times a kernel over a large buffer, and prints its throughput */
+static void crc_test_bench( const crc_test_kernel_t *t );
+
+/* Returns the number of kernels that this machine can run, filling in
+ * the list of them */
+static int crc_test_kernels( crc_test_kernel_t *list );
+
+static uint16_t crc_update_ref( uint16_t crc, const uint8_t* buf, int32_t len )
+{
+	const uint8_t *end = buf + len;
+
+	while( buf < end )
+		crc = crc_update_byte( crc, *(buf++) );
+
+	return crc;
+}
+
+static int crc_test_check( const crc_test_kernel_t *t )
+{
+	uint8_t buf[CHECK_LEN + 16];
+	unsigned int seed = 0x7e7d;
+	uint16_t i;
+
+	for( i=0; i<sizeof(buf); i++ )
+		buf[i] = rand_r( &seed );
+
+	for( i=0; i<CHECK_ROUNDS; i++ )
+	{
+		/* Cover every short length, and then random ones */
+		int32_t len = i < 256 ? i : rand_r( &seed ) % CHECK_LEN;
+		uint8_t off = rand_r( &seed ) % 16;
+		uint16_t init = rand_r( &seed );
+
+		if( t->k( init, buf + off, len ) != crc_update_ref( init, buf + off, len ) ) {
+			printf( "%s: wrong CRC for %i bytes at offset %hhu\n", t->name, len, off );
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static void crc_test_bench( const crc_test_kernel_t *t )
+{
+	uint8_t *buf = malloc( BENCH_LEN );
+	struct timespec start, end;
+	uint16_t crc = crc_init();
+	double secs;
+	uint32_t i;
+
+	for( i=0; i<BENCH_LEN; i++ )
+		buf[i] = i * 7;
+
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	for( i=0; i<BENCH_ROUNDS; i++ )
+		crc = t->k( crc, buf, BENCH_LEN );
+	clock_gettime( CLOCK_MONOTONIC, &end );
+
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf( "%-8s %8.1f MB/s (crc %4.4hx)\n", t->name,
+		(double)BENCH_LEN * BENCH_ROUNDS / secs / 1e6, crc );
+
+	free( buf );
+}
+
+static int crc_test_kernels( crc_test_kernel_t *list )
+{
+	int n = 0;
+
+	list[n].name = "bytewise";
+	list[n++].k = crc_update_ref;
+	list[n].name = "slice";
+	list[n++].k = crc_update_slice;
+
+#ifdef CRC_HAVE_CLMUL
+	{
+		unsigned int eax, ebx, ecx, edx;
+
+		if( __get_cpuid( 1, &eax, &ebx, &ecx, &edx ) && (ecx & bit_PCLMUL) ) {
+			list[n].name = "clmul";
+			list[n++].k = crc_update_clmul;
+		}
+	}
+#endif
+
+	/* Whichever of the above crc_update() picks */
+	list[n].name = "selected";
+	list[n++].k = crc_update;
+
+	return n;
+}
+
+int main( int argc, char** argv )
+{
+	crc_test_kernel_t list[4];
+	int bench = argc > 1 && strcmp( argv[1], "-b" ) == 0;
+	int n, i, ret = 0;
+
+	/* The standard check value for this CRC */
+	if( crc_block( (const uint8_t*)"123456789", 9 ) != 0x906e ) {
+		printf( "crc_block: wrong check value\n" );
+		ret = 1;
+	}
+
+	n = crc_test_kernels( list );
+	for( i=0; i<n; i++ )
+		if( !crc_test_check( &list[i] ) )
+			ret = 1;
+
+	if( bench )
+		for( i=0; i<n; i++ )
+			crc_test_bench( &list[i] );
+
+	if( ret == 0 )
+		printf( "crc: %i kernels OK\n", n );
+
+	return ret;
+}
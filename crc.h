@@ -17,7 +17,34 @@
 #define __CRC_H
 #include <stdint.h>
 
-/* Returns the CRC */
+/* The CRC is calculated incrementally by:
+ *  - Getting the initial state from crc_init()
+ *  - Folding each piece of data into the state with crc_update() or
+ *    crc_update_byte()
+ *  - Retrieving the CRC from the state with crc_final() */
+
+/* The slicing tables that crc-gen generates.  The first is the ordinary
+ * byte-at-a-time table. */
+extern const uint16_t crc_slice[][256];
+
+/* Returns the initial CRC state */
+uint16_t crc_init( void );
+
+/* Folds the data into the CRC state, and returns the new state */
+uint16_t crc_update( uint16_t crc, /* CRC state */
+		     const uint8_t* buf, /* data */
+		     int32_t len ); /* Data length */
+
+/* Folds a single byte into the CRC state, and returns the new state */
+static inline uint16_t crc_update_byte( uint16_t crc, uint8_t b )
+{
+	return (crc >> 8) ^ crc_slice[0][ (crc ^ b) & 0xff ];
+}
+
+/* Returns the CRC from the given CRC state */
+uint16_t crc_final( uint16_t crc );
+
+/* Returns the CRC of a complete block of data */
 uint16_t crc_block( const uint8_t* buf, /* data */
 		    int32_t len ); /* Data length */
 
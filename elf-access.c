@@ -14,104 +14,231 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
 #include "elf-access.h"
-#include <libelf.h>
+#include <elf.h>
 #include <fcntl.h>
 #include <glib.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-/* Allocate memory for a section and copy it into memory.
-   Arguments:
-    - section: The section to copy from.
-    -  header: The section header for the section to copy from. */
-static elf_section_t* elf_access_load_section( Elf_Scn *section,
-					       Elf32_Shdr *header );
+/* Checks that the ELF header is one that we can load.
+ * Returns the header in host byte order, or FALSE if it's no good. */
+static gboolean elf_access_check_ehdr( const char* fname,
+				       const uint8_t *map,
+				       size_t len,
+				       Elf32_Ehdr *ehdr );
 
-void elf_access_load_sections( char* fname,
-			       elf_section_t **text,
-			       elf_section_t **vectors )
+/* Sorts extents by address */
+static gint elf_access_extent_cmp( gconstpointer a, gconstpointer b );
+
+/* Merges extents that abut both in the target and in the file.
+ * The extents must be sorted. */
+static void elf_access_coalesce( elf_image_t *img );
+
+#ifndef EM_MSP430
+#define EM_MSP430 105
+#endif
+
+/* MSP430 ELF files are always little endian */
+#define LE16(x) GUINT16_FROM_LE(x)
+#define LE32(x) GUINT32_FROM_LE(x)
+
+elf_image_t* elf_access_load( const char* fname )
 {
-	int efd;
-	Elf *elf;
-	size_t stable;
-	Elf32_Ehdr *ehdr;
-	Elf_Scn *section;
-	g_assert( fname != NULL && text != NULL && vectors != NULL );
-
-        if( elf_version(EV_CURRENT) == EV_NONE )
-		g_error( "ELF library initialization failed: %s", elf_errmsg(-1) );
-
-	efd = open( fname , O_RDONLY );
-	if( efd < 0 )
-		g_error( "Failed to open elf file 'motor': %m" );
-
-	elf = elf_begin( efd, ELF_C_READ, NULL );
-	if( elf == NULL )
-		g_error( "elf_begin failed: %s", elf_errmsg(-1) );
-	
-	if( elf_kind( elf ) != ELF_K_ELF )
-		g_error( "ELF file is of wrong type" );
-
-	/* Find the string table section index */
-	ehdr = elf32_getehdr( elf );
-	if( ehdr == NULL )
-		g_error( "Failed to get elf header: %s", elf_errmsg(-1) );
-	stable = ehdr->e_shstrndx;
-
-	/* Find the .text and .vectors sections */
-	section = NULL;
-	/* Loop through all the sections */
-	while( (section = elf_nextscn( elf, section )) != NULL ) {
-		Elf32_Shdr *hdr;
-		char *name;
-
-		/* Retrieve the section header */
-		hdr = elf32_getshdr( section );
-		if( hdr == NULL )
-			g_error( "Couldn't retrieve section header: %s", elf_errmsg(-1) );
-		
-		name = elf_strptr( elf, stable, hdr->sh_name );
-		if( name == NULL )
-			g_error( "Couldn't get section name: %s", elf_errmsg(-1) );
-
-		if( strcmp( name, ".text" ) == 0 ) {
-			*text = elf_access_load_section( section, hdr );
-			(*text)->name = ".text";
+	int fd;
+	struct stat st;
+	uint8_t *map;
+	Elf32_Ehdr ehdr;
+	elf_image_t *img;
+	uint16_t i;
+	g_assert( fname != NULL );
+
+	fd = open( fname, O_RDONLY );
+	if( fd < 0 ) {
+		g_warning( "Failed to open ELF file '%s': %m", fname );
+		return NULL;
+	}
+
+	if( fstat( fd, &st ) < 0 ) {
+		g_warning( "Failed to stat ELF file '%s': %m", fname );
+		close( fd );
+		return NULL;
+	}
+
+	if( st.st_size < (off_t)sizeof(Elf32_Ehdr) ) {
+		g_warning( "'%s' is too small to be an ELF file", fname );
+		close( fd );
+		return NULL;
+	}
+
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	/* The mapping holds its own reference to the file */
+	close( fd );
+
+	if( map == MAP_FAILED ) {
+		g_warning( "Failed to map ELF file '%s': %m", fname );
+		return NULL;
+	}
+
+	img = g_malloc( sizeof(elf_image_t) );
+	img->map = map;
+	img->map_len = st.st_size;
+	img->extents = NULL;
+	img->n_extents = 0;
+	img->len = 0;
+	img->refs = 1;
+
+	if( !elf_access_check_ehdr( fname, map, st.st_size, &ehdr ) ) {
+		elf_access_free( img );
+		return NULL;
+	}
+
+	img->entry = ehdr.e_entry;
+	img->extents = g_new( elf_extent_t, ehdr.e_phnum );
+
+	for( i=0; i<ehdr.e_phnum; i++ )
+	{
+		Elf32_Phdr phdr;
+		elf_extent_t *ext;
+
+		memcpy( &phdr, map + ehdr.e_phoff + i * ehdr.e_phentsize, sizeof(phdr) );
+
+		if( LE32(phdr.p_type) != PT_LOAD || phdr.p_filesz == 0 )
+			continue;
+
+		if( LE32(phdr.p_offset) > img->map_len
+		    || LE32(phdr.p_filesz) > img->map_len - LE32(phdr.p_offset) ) {
+			g_warning( "Segment %hu of '%s' runs off the end of the file", i, fname );
+			elf_access_free( img );
+			return NULL;
 		}
-		else if( strcmp( name, ".vectors" ) == 0 ) {
-			*vectors = elf_access_load_section( section, hdr );
-			(*vectors)->name = ".vectors";
+
+		/* Segments are loaded at their physical address: initialised
+		 * data lives in flash, not at the RAM address it's used from */
+		ext = img->extents + img->n_extents++;
+		ext->addr = LE32(phdr.p_paddr);
+		ext->data = map + LE32(phdr.p_offset);
+		ext->len = LE32(phdr.p_filesz);
+
+		img->len += ext->len;
+	}
+
+	if( img->n_extents == 0 ) {
+		g_warning( "'%s' has nothing to load", fname );
+		elf_access_free( img );
+		return NULL;
+	}
+
+	qsort( img->extents, img->n_extents, sizeof(elf_extent_t), elf_access_extent_cmp );
+
+	for( i=1; i<img->n_extents; i++ )
+		if( img->extents[i].addr < img->extents[i-1].addr + img->extents[i-1].len ) {
+			g_warning( "'%s' has overlapping segments at 0x%x", fname,
+				   img->extents[i].addr );
+			elf_access_free( img );
+			return NULL;
 		}
-	}	
 
-	if( text == NULL )
-		g_error( ".text section not found in ELF file" );
-	if( vectors == NULL )
-		g_error( ".vectors section not found in ELF file" );
+	elf_access_coalesce( img );
+
+	return img;
+}
+
+elf_image_t* elf_access_ref( elf_image_t *img )
+{
+	g_assert( img != NULL );
+
+	g_atomic_int_inc( &img->refs );
+	return img;
+}
+
+void elf_access_free( elf_image_t *img )
+{
+	g_assert( img != NULL );
+
+	if( !g_atomic_int_dec_and_test( &img->refs ) )
+		return;
+
+	munmap( img->map, img->map_len );
+	g_free( img->extents );
+	g_free( img );
+}
+
+static gboolean elf_access_check_ehdr( const char* fname,
+				       const uint8_t *map,
+				       size_t len,
+				       Elf32_Ehdr *ehdr )
+{
+	g_assert( map != NULL && ehdr != NULL );
+
+	memcpy( ehdr, map, sizeof(Elf32_Ehdr) );
+
+	if( memcmp( ehdr->e_ident, ELFMAG, SELFMAG ) != 0 ) {
+		g_warning( "'%s' isn't an ELF file", fname );
+		return FALSE;
+	}
+
+	if( ehdr->e_ident[EI_CLASS] != ELFCLASS32
+	    || ehdr->e_ident[EI_DATA] != ELFDATA2LSB ) {
+		g_warning( "'%s' isn't a 32-bit little endian ELF file", fname );
+		return FALSE;
+	}
+
+	ehdr->e_type = LE16( ehdr->e_type );
+	ehdr->e_machine = LE16( ehdr->e_machine );
+	ehdr->e_entry = LE32( ehdr->e_entry );
+	ehdr->e_phoff = LE32( ehdr->e_phoff );
+	ehdr->e_phentsize = LE16( ehdr->e_phentsize );
+	ehdr->e_phnum = LE16( ehdr->e_phnum );
+
+	if( ehdr->e_type != ET_EXEC ) {
+		g_warning( "'%s' isn't an executable", fname );
+		return FALSE;
+	}
+
+	if( ehdr->e_machine != EM_MSP430 )
+		g_warning( "'%s' isn't an MSP430 executable -- loading anyway", fname );
 
-	elf_end( elf );
-	close( efd );
+	if( ehdr->e_phentsize < sizeof(Elf32_Phdr)
+	    || ehdr->e_phoff > len
+	    || (size_t)ehdr->e_phnum * ehdr->e_phentsize > len - ehdr->e_phoff ) {
+		g_warning( "'%s' has a corrupt program header table", fname );
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
-static elf_section_t* elf_access_load_section( Elf_Scn *section, Elf32_Shdr *header )
+static gint elf_access_extent_cmp( gconstpointer a, gconstpointer b )
 {
-	Elf_Data *d = NULL;
-	elf_section_t *s = NULL;
-	uint8_t *tpos;
-	g_assert( section != NULL && header != NULL );
-
-	s = g_malloc( sizeof(elf_section_t) );
-	s->data = tpos = g_malloc( header->sh_size );
-	s->len = header->sh_size;
-	s->addr = header->sh_addr;
-
-	/* The ELF library returns data in multiple buffers, which we iterate through */
-	while ( (d = elf_rawdata( section, d )) != NULL )
+	const elf_extent_t *x = a, *y = b;
+
+	if( x->addr < y->addr )
+		return -1;
+	if( x->addr > y->addr )
+		return 1;
+	return 0;
+}
+
+static void elf_access_coalesce( elf_image_t *img )
+{
+	uint16_t i, n = 0;
+	g_assert( img != NULL && img->n_extents > 0 );
+
+	for( i=1; i<img->n_extents; i++ )
 	{
-		g_memmove( tpos, d->d_buf, d->d_size );
-		tpos += d->d_size;
+		elf_extent_t *prev = img->extents + n;
+		elf_extent_t *ext = img->extents + i;
+
+		if( ext->addr == prev->addr + prev->len
+		    && ext->data == prev->data + prev->len )
+			prev->len += ext->len;
+		else
+			img->extents[++n] = *ext;
 	}
 
-	return s;
+	img->n_extents = n + 1;
 }
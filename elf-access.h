@@ -17,17 +17,48 @@
 #ifndef __ELF_ACCESS
 #define __ELF_ACCESS
 #include <stdint.h>
+#include <stddef.h>
 
+/* A run of bytes to be loaded into the target */
 typedef struct {
-	uint8_t *data;
-	uint32_t len;
+	/* Where it's loaded (the LMA) */
 	uint32_t addr;
-	char* name;
-} elf_section_t;
+	/* Points into the file's mapping */
+	const uint8_t *data;
+	uint32_t len;
+} elf_extent_t;
+
+/* The loadable contents of an ELF file */
+typedef struct {
+	/* The mapping of the file */
+	void *map;
+	size_t map_len;
+
+	/* The extents to load, in address order.
+	 * Extents that abut both in the target and in the file are merged. */
+	elf_extent_t *extents;
+	uint16_t n_extents;
+
+	/* The total number of bytes in the extents */
+	uint32_t len;
+	uint32_t entry;
+
+	/* The number of holders of the image.  The image is read-only, so
+	 * it can be shared between threads. */
+	int refs;
+} elf_image_t;
+
+/* Map an ELF file, and find everything in its PT_LOAD segments.
+ * Nothing is copied: the extents point into the mapping.
+ * Returns NULL on failure, having given a warning. */
+elf_image_t* elf_access_load( const char* fname );
+
+/* Take another reference to an image.
+ * Returns img. */
+elf_image_t* elf_access_ref( elf_image_t *img );
 
-/* Load */
-void elf_access_load_sections( char* fname,
-			       elf_section_t **text,
-			       elf_section_t **vectors );
+/* Drop a reference to an image.
+ * The file's unmapped, and the image freed, once the last has gone. */
+void elf_access_free( elf_image_t *img );
 
 #endif	/* __ELF_ACCESS */
@@ -0,0 +1,180 @@
+/* Cache of the target's memory, for use while it's halted
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fet-cache.h"
+#include "fet-poll.h"
+#include <string.h>
+
+/* A range of addresses that's kept out of the cache */
+typedef struct {
+	uint32_t addr, len;
+} fet_cache_range_t;
+
+/* Pages are keyed by their address divided by the page size */
+#define PAGE_KEY(a) GUINT_TO_POINTER( (a) / FET_CACHE_PAGE_LEN )
+
+/* Free a page when it's removed from the hash table */
+static void fet_cache_page_free( gpointer page );
+
+void fet_cache_init( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	fet->cache = g_hash_table_new_full( g_direct_hash, g_direct_equal,
+					    NULL, fet_cache_page_free );
+	fet->cache_uncached = g_array_new( FALSE, FALSE, sizeof(fet_cache_range_t) );
+	fet->cache_gen = 0;
+	fet->cache_hits = fet->cache_misses = 0;
+	fet->target_state.reg_valid = 0;
+	fet->target_state.reg_dirty = 0;
+
+	fet_cache_add_uncached( fet, FET_CACHE_UNCACHED_DEFAULT_START,
+				FET_CACHE_UNCACHED_DEFAULT_LEN );
+}
+
+void fet_cache_free( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	g_hash_table_destroy( fet->cache );
+	g_array_free( fet->cache_uncached, TRUE );
+}
+
+static void fet_cache_page_free( gpointer page )
+{
+	g_slice_free1( FET_CACHE_PAGE_LEN, page );
+}
+
+void fet_cache_add_uncached( FetModule *fet, uint32_t addr, uint32_t len )
+{
+	fet_cache_range_t r = { addr, len };
+	g_assert( fet != NULL );
+
+	g_array_append_val( fet->cache_uncached, r );
+	fet_cache_invalidate( fet, addr, len );
+}
+
+gboolean fet_cache_is_uncached( FetModule *fet, uint32_t addr, uint32_t len )
+{
+	guint i;
+	g_assert( fet != NULL );
+
+	for( i=0; i<fet->cache_uncached->len; i++ ) {
+		fet_cache_range_t *r = &g_array_index( fet->cache_uncached,
+						       fet_cache_range_t, i );
+
+		if( addr < r->addr + r->len && r->addr < addr + len )
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+gboolean fet_cache_read( FetModule *fet, uint32_t addr, uint8_t *buf, uint32_t len )
+{
+	uint32_t pos = 0;
+	g_assert( fet != NULL && buf != NULL );
+
+	/* A running target can change anything at any time */
+	if( fet_poll_active( fet ) )
+		return FALSE;
+
+	while( pos < len )
+	{
+		uint32_t a = addr + pos;
+		uint32_t off = a - FET_CACHE_PAGE_FLOOR(a);
+		uint32_t n = MIN( FET_CACHE_PAGE_LEN - off, len - pos );
+		uint8_t *page = g_hash_table_lookup( fet->cache, PAGE_KEY(a) );
+
+		if( page == NULL ) {
+			fet->cache_misses++;
+			return FALSE;
+		}
+
+		memcpy( buf + pos, page + off, n );
+		pos += n;
+	}
+
+	fet->cache_hits++;
+	return TRUE;
+}
+
+void fet_cache_fill( FetModule *fet, uint32_t gen,
+		     uint32_t addr, const uint8_t *data, uint32_t len )
+{
+	uint32_t a;
+	g_assert( fet != NULL && data != NULL );
+
+	if( gen != fet->cache_gen || fet_poll_active( fet ) )
+		return;
+
+	for( a = FET_CACHE_PAGE_CEIL(addr);
+	     a + FET_CACHE_PAGE_LEN <= addr + len;
+	     a += FET_CACHE_PAGE_LEN )
+	{
+		uint8_t *page;
+
+		if( fet_cache_is_uncached( fet, a, FET_CACHE_PAGE_LEN ) )
+			continue;
+
+		page = g_hash_table_lookup( fet->cache, PAGE_KEY(a) );
+		if( page == NULL ) {
+			page = g_slice_alloc( FET_CACHE_PAGE_LEN );
+			g_hash_table_insert( fet->cache, PAGE_KEY(a), page );
+		}
+
+		memcpy( page, data + (a - addr), FET_CACHE_PAGE_LEN );
+	}
+}
+
+uint32_t fet_cache_gen( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	return fet->cache_gen;
+}
+
+void fet_cache_invalidate( FetModule *fet, uint32_t addr, uint32_t len )
+{
+	uint32_t a;
+	g_assert( fet != NULL );
+
+	/* Reads that are in flight may have seen the old contents */
+	fet->cache_gen++;
+
+	for( a = FET_CACHE_PAGE_FLOOR(addr); a < addr + len; a += FET_CACHE_PAGE_LEN )
+		g_hash_table_remove( fet->cache, PAGE_KEY(a) );
+}
+
+void fet_cache_flush( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	fet->cache_gen++;
+	g_hash_table_remove_all( fet->cache );
+}
+
+void fet_cache_regs_invalidate( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	if( fet->target_state.reg_dirty != 0 )
+		g_warning( "Discarding register changes that weren't written to the target" );
+
+	fet->target_state.reg_valid = 0;
+	fet->target_state.reg_dirty = 0;
+}
@@ -0,0 +1,76 @@
+/* Cache of the target's memory, for use while it's halted
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef __FET_CACHE_H
+#define __FET_CACHE_H
+#include <glib.h>
+#include <stdint.h>
+#include "fet-module.h"
+
+/* The cache holds whole pages of this size -- must be a power of two */
+#define FET_CACHE_PAGE_LEN 64
+
+/* The range that's left out of the cache by default: the special
+ * function registers and peripherals, which change under our feet */
+#define FET_CACHE_UNCACHED_DEFAULT_START 0x0000
+#define FET_CACHE_UNCACHED_DEFAULT_LEN 0x0200
+
+/* Round an address down, or up, to a page boundary */
+#define FET_CACHE_PAGE_FLOOR(a) ((a) & ~(uint32_t)(FET_CACHE_PAGE_LEN - 1))
+#define FET_CACHE_PAGE_CEIL(a) FET_CACHE_PAGE_FLOOR((a) + FET_CACHE_PAGE_LEN - 1)
+
+/* Set up the FET's cache, with the default uncached range */
+void fet_cache_init( FetModule *fet );
+
+/* Free the FET's cache */
+void fet_cache_free( FetModule *fet );
+
+/* Mark len bytes from addr as never to be cached */
+void fet_cache_add_uncached( FetModule *fet, uint32_t addr, uint32_t len );
+
+/* Returns TRUE if any of the len bytes at addr are uncacheable */
+gboolean fet_cache_is_uncached( FetModule *fet, uint32_t addr, uint32_t len );
+
+/* Copy len bytes at addr out of the cache into buf.
+ * Returns FALSE, leaving buf in an undefined state, unless all of them
+ * are in the cache.  Nothing's read from the cache while the target's
+ * running. */
+gboolean fet_cache_read( FetModule *fet, uint32_t addr, uint8_t *buf, uint32_t len );
+
+/* Store data that's been read from the target.
+ * Only the whole pages within the data are kept.
+ * gen is the value of fet_cache_gen() from when the read was sent.  If
+ * the cache has been invalidated since then, the data may be stale, and
+ * nothing is stored.  Nor is anything stored while the target's
+ * running. */
+void fet_cache_fill( FetModule *fet, uint32_t gen,
+		     uint32_t addr, const uint8_t *data, uint32_t len );
+
+/* Returns a value that changes whenever the cache is invalidated */
+uint32_t fet_cache_gen( FetModule *fet );
+
+/* Drop the pages that hold any of the len bytes at addr */
+void fet_cache_invalidate( FetModule *fet, uint32_t addr, uint32_t len );
+
+/* Drop everything */
+void fet_cache_flush( FetModule *fet );
+
+/* Forget the registers held in the FET's target_state, because the
+ * target's about to change them */
+void fet_cache_regs_invalidate( FetModule *fet );
+
+#endif	/* __FET_CACHE_H */
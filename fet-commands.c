@@ -14,25 +14,64 @@
     along with this program; if not, write to the Free Software
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA. */
 #include "fet-commands.h"
+#include "fet-cache.h"
+#include "fet-poll.h"
 #include <glib.h>
 #include <stdint.h>
 #include <string.h>
 
-void fet_cmd_poll( FetModule* fet )
+int fet_cmd_poll( FetModule* fet,
+		  fet_reply_cb_t cb, gpointer userdata )
 {
 	uint8_t d[] = { 0x12, 0x02, 0x01, 0x00,
 			0x00, 0x00, 0x00, 0x00 };
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ANY, cb, userdata );
 }
 
-void fet_cmd_write_mem( FetModule* fet,
-			uint16_t addr,
-			const uint8_t *buf,
-			uint16_t len )
+uint16_t fet_cmd_write_mem_max( FetModule* fet )
 {
-	uint8_t e[ 12 + len ];
+	return (fet_module_get_max_payload( fet ) - FET_WRITE_MEM_HDR) & ~1;
+}
+
+/* Tracks a memory write that's been split over several frames */
+typedef struct {
+	/* The number of frames still waiting for replies */
+	uint16_t pending;
+	/* The worst outcome so far */
+	fet_reply_status_t status;
+
+	fet_reply_cb_t cb;
+	gpointer userdata;
+} fet_cmd_split_t;
+
+/* Called with the reply to each frame of a split write */
+static void fet_cmd_write_mem_part( FetModule *fet,
+				    fet_reply_status_t status,
+				    const fet_reply_t *reply,
+				    gpointer _split )
+{
+	fet_cmd_split_t *split = (fet_cmd_split_t*)_split;
+	g_assert( split != NULL && split->pending > 0 );
+
+	if( status != FET_REPLY_OK && split->status == FET_REPLY_OK )
+		split->status = status;
+
+	if( --split->pending > 0 )
+		return;
 
+	if( split->cb != NULL )
+		split->cb( fet, split->status, reply, split->userdata );
+
+	g_slice_free( fet_cmd_split_t, split );
+}
+
+/* Build a single memory write into a frame */
+uint16_t fet_cmd_write_mem_payload( uint8_t *e,
+				   uint32_t addr,
+				   const uint8_t *buf,
+				   uint16_t len )
+{
 	e[0] = 0x0e;
 	e[1] = 0x04;
 	e[2] = 0x01;
@@ -41,72 +80,379 @@ void fet_cmd_write_mem( FetModule* fet,
 	e[4] = addr & 0xff;
 	e[5] = (addr>>8) & 0xff;
 
-	e[6] = e[7] = 0;
+	e[6] = (addr>>16) & 0xff;
+	e[7] = (addr>>24) & 0xff;
 
 	e[8] = len & 0xff;
 	e[9] = (len>>8) & 0xff;
 
 	e[10] = e[11] = 0;
 
-	g_memmove( e + 12, buf, len );
+	g_memmove( e + FET_WRITE_MEM_HDR, buf, len );
+	return len + FET_WRITE_MEM_HDR;
+}
 
-	fet_module_transmit( fet, e, len + 12 );
-	
+/* Fill in a frame from the pool with a write */
+static void fet_cmd_write_mem_build( fet_frame_t *f,
+				     uint32_t addr,
+				     const uint8_t *buf,
+				     uint16_t len )
+{
+	f->len = fet_cmd_write_mem_payload( f->data, addr, buf, len );
+	f->prio = FET_PRIO_BULK;
+}
+
+int fet_cmd_write_mem( FetModule* fet,
+		       uint32_t addr,
+		       const uint8_t *buf,
+		       uint32_t len,
+		       fet_reply_cb_t cb, gpointer userdata )
+{
+	uint16_t max = fet_cmd_write_mem_max( fet );
+	fet_frame_t *first = NULL, *last = NULL, *f;
+	fet_cmd_split_t *split = NULL;
+	uint32_t pos;
+	/* The MSP430X has a 20-bit address space */
+	g_assert( buf != NULL && len > 0 && addr + len <= 0x100000 );
+
+	/* Build the commands straight into frames from the pool.
+	 * Get all of the frames before sending any, so that the write
+	 * either goes out whole or not at all. */
+	for( pos = 0; pos < len; pos += max )
+	{
+		f = fet_module_frame_alloc( fet );
+
+		if( f == NULL ) {
+			while( first != NULL ) {
+				f = first;
+				first = first->next;
+				fet_module_frame_free( fet, f );
+			}
+			return -1;
+		}
+
+		fet_cmd_write_mem_build( f, addr + pos, buf + pos, MIN( max, len - pos ) );
+
+		if( last != NULL )
+			last->next = f;
+		else
+			first = f;
+		last = f;
+	}
+
+	fet_cache_invalidate( fet, addr, len );
+
+	if( first == last ) {
+		first->cb = cb;
+		first->userdata = userdata;
+	} else {
+		split = g_slice_new( fet_cmd_split_t );
+		split->pending = 0;
+		split->status = FET_REPLY_OK;
+		split->cb = cb;
+		split->userdata = userdata;
+	}
+
+	while( first != NULL ) {
+		f = first;
+		first = first->next;
+
+		if( split != NULL ) {
+			f->cb = fet_cmd_write_mem_part;
+			f->userdata = split;
+			split->pending++;
+		}
+
+		fet_module_frame_transmit( fet, f );
+	}
+
+	return 0;
+}
+
+int fet_cmd_write_mem_encoded( FetModule* fet,
+			       uint32_t addr,
+			       uint16_t len,
+			       const uint8_t *wire,
+			       uint16_t wire_len,
+			       fet_reply_cb_t cb, gpointer userdata )
+{
+	fet_frame_t *f;
+	g_assert( wire != NULL && len > 0 && addr + len <= 0x100000 );
+	g_assert( len <= fet_cmd_write_mem_max( fet ) );
+
+	f = fet_module_frame_alloc( fet );
+	if( f == NULL )
+		return -1;
+
+	/* Only the command's needed to match the reply */
+	f->data[0] = 0x0e;
+	f->len = len + FET_WRITE_MEM_HDR;
+	f->prio = FET_PRIO_BULK;
+	f->cb = cb;
+	f->userdata = userdata;
+
+	/* It goes out straight from wire, without being copied */
+	f->wire_ptr = wire;
+	f->wire_len = wire_len;
+
+	fet_cache_invalidate( fet, addr, len );
+	return fet_module_frame_transmit_encoded( fet, f );
+}
+
+uint16_t fet_cmd_read_mem_max( FetModule* fet )
+{
+	return (fet_module_get_max_payload( fet ) - FET_READ_MEM_HDR) & ~1;
+}
+
+/* Tracks a memory read, which may be split over several frames */
+typedef struct {
+	/* Where the data goes, how much there is of it, and how much
+	 * has arrived */
+	uint8_t *buf;
+	uint32_t len, pos;
+	/* The amount each frame reads */
+	uint16_t max;
+
+	/* The number of frames still waiting for replies */
+	uint16_t pending;
+	/* The worst outcome so far */
+	fet_reply_status_t status;
+
+	fet_reply_cb_t cb;
+	gpointer userdata;
+} fet_cmd_read_t;
+
+/* Called with the reply to each frame of a read */
+static void fet_cmd_read_mem_part( FetModule *fet,
+				   fet_reply_status_t status,
+				   const fet_reply_t *reply,
+				   gpointer _rd )
+{
+	fet_cmd_read_t *rd = (fet_cmd_read_t*)_rd;
+	uint16_t n;
+	g_assert( rd != NULL && rd->pending > 0 );
+
+	/* Replies come back in the order the reads were sent */
+	n = MIN( rd->max, rd->len - rd->pos );
+
+	if( status == FET_REPLY_OK
+	    && ( reply->kind != FET_REPLY_KIND_MEM || reply->u.mem.len < n ) )
+		status = FET_REPLY_ERROR;
+
+	if( status == FET_REPLY_OK )
+		memcpy( rd->buf + rd->pos, reply->u.mem.data, n );
+	else if( rd->status == FET_REPLY_OK )
+		rd->status = status;
+
+	rd->pos += n;
+
+	if( --rd->pending > 0 )
+		return;
+
+	if( rd->cb != NULL )
+		rd->cb( fet, rd->status, reply, rd->userdata );
+
+	g_slice_free( fet_cmd_read_t, rd );
 }
 
-void fet_cmd_read_mem( FetModule* fet, 
-		       uint16_t addr,
-		       uint16_t len )
+int fet_cmd_read_mem( FetModule* fet,
+		      uint32_t addr,
+		      uint8_t *buf,
+		      uint32_t len,
+		      fet_reply_cb_t cb, gpointer userdata )
 {
-	uint8_t e[12] = { 0x0D, 0x02, 0x02, 0x00,
-			  addr & 0xff, (addr>>8) & 0xff, 0x00, 0x00,
-			  len & 0xff, (len>>8) & 0xff, 0x00, 0x00 };
+	uint16_t max = fet_cmd_read_mem_max( fet );
+	fet_frame_t *first = NULL, *last = NULL, *f;
+	fet_cmd_read_t *rd;
+	uint32_t pos;
+	g_assert( buf != NULL && len > 0 && addr + len <= 0x100000 );
+
+	/* As with writes, get all the frames before sending any */
+	for( pos = 0; pos < len; pos += max )
+	{
+		uint16_t n = MIN( max, len - pos );
+		uint8_t *e;
+
+		f = fet_module_frame_alloc( fet );
+
+		if( f == NULL ) {
+			while( first != NULL ) {
+				f = first;
+				first = first->next;
+				fet_module_frame_free( fet, f );
+			}
+			return -1;
+		}
+
+		e = f->data;
+		e[0] = 0x0d;
+		e[1] = 0x02;
+		e[2] = 0x02;
+		e[3] = 0x00;
+
+		e[4] = (addr + pos) & 0xff;
+		e[5] = ((addr + pos) >> 8) & 0xff;
+		e[6] = ((addr + pos) >> 16) & 0xff;
+		e[7] = ((addr + pos) >> 24) & 0xff;
+
+		e[8] = n & 0xff;
+		e[9] = (n >> 8) & 0xff;
+		e[10] = e[11] = 0;
+
+		f->len = 12;
+		f->reply_type = FET_TYPE_DATA;
+		f->prio = FET_PRIO_BULK;
+
+		if( last != NULL )
+			last->next = f;
+		else
+			first = f;
+		last = f;
+	}
+
+	rd = g_slice_new( fet_cmd_read_t );
+	rd->buf = buf;
+	rd->len = len;
+	rd->pos = 0;
+	rd->max = max;
+	rd->pending = 0;
+	rd->status = FET_REPLY_OK;
+	rd->cb = cb;
+	rd->userdata = userdata;
+
+	/* Send them all back to back, rather than waiting for each reply */
+	while( first != NULL ) {
+		f = first;
+		first = first->next;
+
+		f->cb = fet_cmd_read_mem_part;
+		f->userdata = rd;
+		rd->pending++;
+
+		fet_module_frame_transmit( fet, f );
+	}
 
-	fet_module_transmit( fet, e, sizeof(e) );
+	return 0;
 }
 
-void fet_cmd_open( FetModule* fet )
+int fet_cmd_halt( FetModule* fet,
+		  fet_reply_cb_t cb, gpointer userdata )
+{
+	uint8_t d[] = { 0x12, 0x02, 0x01, 0x00,
+			0x01, 0x00, 0x00, 0x00 };
+	fet_frame_t *f;
+
+	f = fet_module_frame_alloc( fet );
+	if( f == NULL )
+		return -1;
+
+	memcpy( f->data, d, sizeof(d) );
+	f->len = sizeof(d);
+
+	/* Don't wait behind any bulk transfers */
+	f->prio = FET_PRIO_URGENT;
+	f->reply_type = FET_TYPE_ANY;
+	f->cb = cb;
+	f->userdata = userdata;
+
+	/* Reads in flight may have seen memory that's since changed */
+	fet_cache_flush( fet );
+	return fet_module_frame_transmit( fet, f );
+}
+
+int fet_cmd_open( FetModule* fet,
+		  fet_reply_cb_t cb, gpointer userdata )
 {
 	const uint8_t d[2] = {0x01, 0x01};
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
 
-void fet_cmd_init( FetModule *fet )
+int fet_cmd_init( FetModule *fet,
+		  fet_reply_cb_t cb, gpointer userdata )
 {
 	const uint8_t d[8] = {0x27, 0x02, 0x01, 0x00, 
 			      0x04, 0x00, 0x00, 0x00};
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
 
-void fet_cmd_conf( FetModule *fet, gboolean sbw )
+int fet_cmd_conf( FetModule *fet, gboolean sbw,
+		  fet_reply_cb_t cb, gpointer userdata )
 {
 	uint8_t d[12] = { 0x05, 0x02, 0x02, 0x00,
 			 0x08, 0x00, 0x00, 0x00,
 			 sbw?0x01:0x00, 0x00, 0x00, 0x00 };
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	/* Remembered for when the FET's reconnected */
+	fet->setup_conf = TRUE;
+	fet->setup_sbw = sbw;
+
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
 
-void fet_cmd_set_vcc( FetModule *fet, uint16_t mv )
+int fet_cmd_set_vcc( FetModule *fet, uint16_t mv,
+		     fet_reply_cb_t cb, gpointer userdata )
 {
 	uint8_t d[8] = { 0x06, 0x02, 0x01, 0x00,
 			 mv & 0xff, (mv>>8) & 0xff, 0x00, 0x00 };
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	/* Remembered for when the FET's reconnected */
+	fet->setup_vcc = TRUE;
+	fet->setup_vcc_mv = mv;
+
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
 
-void fet_cmd_identify( FetModule *fet )
+/* The caller's callback for an identify command */
+typedef struct {
+	fet_reply_cb_t cb;
+	gpointer userdata;
+} fet_cmd_identify_t;
+
+/* Called with the reply to an identify command */
+static void fet_cmd_identified( FetModule *fet,
+				fet_reply_status_t status,
+				const fet_reply_t *reply,
+				gpointer _id )
+{
+	fet_cmd_identify_t *id = (fet_cmd_identify_t*)_id;
+	g_assert( id != NULL );
+
+	if( status == FET_REPLY_OK && reply->kind == FET_REPLY_KIND_IDENTIFY ) {
+		fet->identity = reply->u.identify;
+		fet->identified = TRUE;
+	}
+
+	if( id->cb != NULL )
+		id->cb( fet, status, reply, id->userdata );
+
+	g_slice_free( fet_cmd_identify_t, id );
+}
+
+int fet_cmd_identify( FetModule *fet,
+		      fet_reply_cb_t cb, gpointer userdata )
 {
 	uint8_t d[12] = { 0x03, 0x02, 0x02, 0x00,
 			 0x50, 0x00, 0x00, 0x00,
 			 0x00, 0x00, 0x00, 0x00 };
+	fet_cmd_identify_t *id;
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	id = g_slice_new( fet_cmd_identify_t );
+	id->cb = cb;
+	id->userdata = userdata;
+
+	if( fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ANY,
+				 fet_cmd_identified, id ) != 0 ) {
+		g_slice_free( fet_cmd_identify_t, id );
+		return -1;
+	}
+
+	return 0;
 }
 
-void fet_cmd_write_context( FetModule *fet, uint16_t *regs )
+int fet_cmd_write_context( FetModule *fet, uint16_t *regs,
+			   fet_reply_cb_t cb, gpointer userdata )
 {
 	const uint8_t cmd[] = { 0x09, 0x04, 0x01, 0x00,
 				0xff, 0xff, 0x00, 0x00, 
@@ -127,25 +473,28 @@ void fet_cmd_write_context( FetModule *fet, uint16_t *regs )
 	
 	d[12+64] = 0;
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	fet_cache_flush( fet );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
 
-void fet_cmd_read_context( gpointer _fet )
+int fet_cmd_read_context( FetModule *fet,
+			  fet_reply_cb_t cb, gpointer userdata )
 {
-	FetModule *fet = FET_MODULE(_fet);
 	uint8_t d[4] = { 0x08, 0x01 };
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_DATA, cb, userdata );
 }
 
-void fet_cmd_erase( FetModule *fet, 
-		    fet_cmd_erase_t s,
-		    uint16_t addr )
+int fet_cmd_erase( FetModule *fet, 
+		   fet_cmd_erase_t s,
+		   uint16_t addr,
+		   fet_reply_cb_t cb, gpointer userdata )
 {
 	uint8_t d[16] = { 0x0C, 0x02, 0x03, 0x00,
 			  0x00, 0x00, 0x00, 0x00,
 			  0x00, 0x00, 0x00, 0x00,
 			  0x00, 0x00, 0x00, 0x00 };
+	fet_frame_t *f;
 	uint8_t t;
 	uint16_t m;
 
@@ -180,33 +529,73 @@ void fet_cmd_erase( FetModule *fet,
 	d[12] = m & 0xff;
 	d[13] = (m>>8) & 0xff;
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	f = fet_module_frame_alloc( fet );
+	if( f == NULL )
+		return -1;
+
+	memcpy( f->data, d, sizeof(d) );
+	f->len = sizeof(d);
+
+	/* Erasing flash takes a while */
+	f->timeout = FET_ERASE_TIMEOUT_MS;
+	f->cb = cb;
+	f->userdata = userdata;
+
+	fet_cache_flush( fet );
+	return fet_module_frame_transmit( fet, f );
 }
 
-void fet_cmd_reset( FetModule *fet, uint8_t rtype, gboolean dirty )
+int fet_cmd_reset( FetModule *fet, uint8_t rtype, gboolean dirty,
+		   fet_reply_cb_t cb, gpointer userdata )
 {
 	uint8_t d[16] = { 0x07, 0x02, 0x03, 0x00,
 			  rtype, 0x00, 0x00, 0x00,
 			  dirty?0x00:0x01, 0x00, 0x00, 0x00,
 			  dirty?0x00:0x01, 0x00, 0x00, 0x00 };
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	fet_poll_stop( fet );
+	fet_cache_flush( fet );
+	fet_cache_regs_invalidate( fet );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
 
-void fet_cmd_close( FetModule *fet )
+int fet_cmd_close( FetModule *fet,
+		   fet_reply_cb_t cb, gpointer userdata )
 {
 	uint8_t d[4] = { 0x02, 0x02, 0x01, 0x00 };
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
 
-void fet_cmd_run( gpointer _fet )
+int fet_cmd_run( FetModule *fet,
+		 fet_reply_cb_t cb, gpointer userdata )
 {
-	FetModule *fet = FET_MODULE(_fet);
-
 	uint8_t d[12] = { 0x11, 0x02, 0x02, 0x00,
 			  0x03, 0x00, 0x00, 0x00,
 			  0x00, 0x00, 0x00, 0x00 };
+	int r;
+
+	/* Once it's running, the target can change anything */
+	fet_cache_flush( fet );
+	fet_cache_regs_invalidate( fet );
+
+	r = fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
+
+	/* Watch for it halting */
+	if( r == 0 )
+		fet_poll_start( fet );
+	return r;
+}
+
+int fet_cmd_step( FetModule *fet,
+		  fet_reply_cb_t cb, gpointer userdata )
+{
+	uint8_t d[12] = { 0x11, 0x02, 0x02, 0x00,
+			  0x02, 0x00, 0x00, 0x00,
+			  0x00, 0x00, 0x00, 0x00 };
 
-	fet_module_transmit( fet, d, sizeof(d) );
+	fet_poll_stop( fet );
+	fet_cache_flush( fet );
+	fet_cache_regs_invalidate( fet );
+	return fet_module_transmit( fet, d, sizeof(d), FET_TYPE_ACK, cb, userdata );
 }
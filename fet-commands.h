@@ -18,39 +18,126 @@
 #include <stdint.h>
 #include "fet-module.h"
 
-void fet_cmd_write_mem( FetModule* fet,
-			uint16_t addr,
-			const uint8_t *buf,
-			uint16_t len );
-
-void fet_cmd_read_mem( FetModule* fet, 
-		       uint16_t addr,
-		       uint16_t len );
-
-void fet_cmd_poll( FetModule* fet );
-
-void fet_cmd_open( FetModule* fet );
-
-void fet_cmd_init( FetModule *fet );
-
-/* sbw is TRUE for spy-bi-wire */
-void fet_cmd_conf( FetModule *fet, gboolean sbw );
+/* The number of bytes of a memory write frame taken by the command */
+#define FET_WRITE_MEM_HDR 12
+
+/* The number of bytes of a memory read reply taken by the header */
+#define FET_READ_MEM_HDR 8
+
+/* How long to wait for an erase to complete, in ms */
+#define FET_ERASE_TIMEOUT_MS 5000
+
+/* All of the commands below queue the command for transmission and return
+ * straight away.  cb is called with the FET's reply once it arrives, or
+ * when the command times out.  cb may be NULL.
+ * They return 0 on success, or -1 if the command couldn't be queued.
+ * Commands that change the target's memory or registers, or set it
+ * running, invalidate the FET's memory cache (see fet-cache.h). */
+
+/* Returns the largest number of bytes that a single memory write frame
+ * can carry on this FET.  This is kept even so that writes stay word
+ * aligned. */
+uint16_t fet_cmd_write_mem_max( FetModule* fet );
+
+/* Write memory.
+ * The frames are sent with bulk priority.
+ * Writes longer than fet_cmd_write_mem_max() are split over several
+ * frames, which all go out together.  cb is called once, when the last
+ * of them has been answered, with the worst of their outcomes.
+ * Returns -1 without sending anything if there aren't enough free frames
+ * for the whole write. */
+int fet_cmd_write_mem( FetModule* fet,
+		       uint32_t addr,
+		       const uint8_t *buf,
+		       uint32_t len,
+		       fet_reply_cb_t cb, gpointer userdata );
+
+/* Build the payload of a memory write frame into e, which must have
+ * room for len + FET_WRITE_MEM_HDR bytes.
+ * Returns the length of the payload. */
+uint16_t fet_cmd_write_mem_payload( uint8_t *e,
+				   uint32_t addr,
+				   const uint8_t *buf,
+				   uint16_t len );
+
+/* Write memory with a single frame that's already been encoded.
+ * Args:
+ *  -     addr: The address that the frame writes to.
+ *  -      len: The number of bytes that the frame writes.  This must
+ *              be no more than fet_cmd_write_mem_max().
+ *  -     wire: The frame's wire image, as made by fet_module_frame_encode()
+ *              from the payload that fet_cmd_write_mem_payload() built.
+ *  - wire_len: The length of the wire image.
+ * The frame's written out straight from wire, which must remain valid
+ * until cb has been called.  It's sent with bulk priority. */
+int fet_cmd_write_mem_encoded( FetModule* fet,
+			       uint32_t addr,
+			       uint16_t len,
+			       const uint8_t *wire,
+			       uint16_t wire_len,
+			       fet_reply_cb_t cb, gpointer userdata );
+
+/* Returns the largest number of bytes that a single memory read reply
+ * can carry on this FET. */
+uint16_t fet_cmd_read_mem_max( FetModule* fet );
+
+/* Read memory into buf.
+ * The frames are sent with bulk priority.
+ * Reads longer than fet_cmd_read_mem_max() are split over several
+ * frames, which all go out together.  The data from each reply is
+ * copied into buf as it arrives, so buf must remain valid until cb is
+ * called.  cb is called once, when the last frame has been answered,
+ * with the worst of their outcomes.
+ * Returns -1 without sending anything if there aren't enough free frames
+ * for the whole read. */
+int fet_cmd_read_mem( FetModule* fet,
+		      uint32_t addr,
+		      uint8_t *buf,
+		      uint32_t len,
+		      fet_reply_cb_t cb, gpointer userdata );
+
+int fet_cmd_poll( FetModule* fet,
+		  fet_reply_cb_t cb, gpointer userdata );
+
+/* Stop the running target.
+ * This is sent with urgent priority, ahead of anything else queued. */
+int fet_cmd_halt( FetModule* fet,
+		  fet_reply_cb_t cb, gpointer userdata );
+
+int fet_cmd_open( FetModule* fet,
+		  fet_reply_cb_t cb, gpointer userdata );
+
+int fet_cmd_init( FetModule *fet,
+		  fet_reply_cb_t cb, gpointer userdata );
+
+/* sbw is TRUE for spy-bi-wire.
+ * This, and set_vcc, are repeated if the FET has to be reconnected. */
+int fet_cmd_conf( FetModule *fet, gboolean sbw,
+		  fet_reply_cb_t cb, gpointer userdata );
 
 /* mv is millivolts */
-void fet_cmd_set_vcc( FetModule *fet, uint16_t mv );
+int fet_cmd_set_vcc( FetModule *fet, uint16_t mv,
+		     fet_reply_cb_t cb, gpointer userdata );
 
-void fet_cmd_identify( FetModule *fet );
+/* Find out what the target is.
+ * The result is kept -- see fet_module_get_identity(). */
+int fet_cmd_identify( FetModule *fet,
+		      fet_reply_cb_t cb, gpointer userdata );
 
 /* Write context.
    Args:
     -  fet: The FetModule to send the command on.
-    - regs: 16 entry array of 16 register values. */
-void fet_cmd_write_context( FetModule *fet, uint16_t *regs );
+    - regs: 16 entry array of 16 register values.
+   All 16 registers are written. */
+int fet_cmd_write_context( FetModule *fet, uint16_t *regs,
+			   fet_reply_cb_t cb, gpointer userdata );
 
 /* Read context.
    Args:
-    -  fet: The FetModule to send the command on. */
-void fet_cmd_read_context( gpointer _fet );
+    -  fet: The FetModule to send the command on.
+   The registers are in the data of the reply. */
+int fet_cmd_read_context( FetModule *fet,
+			  fet_reply_cb_t cb, gpointer userdata );
 
 typedef enum {
 	FET_ERASE_ALL,
@@ -59,9 +146,10 @@ typedef enum {
 	FET_ERASE_INFO
 } fet_cmd_erase_t;
 
-void fet_cmd_erase( FetModule *fet, 
-		    fet_cmd_erase_t s,
-		    uint16_t addr );		    
+int fet_cmd_erase( FetModule *fet, 
+		   fet_cmd_erase_t s,
+		   uint16_t addr,
+		   fet_reply_cb_t cb, gpointer userdata );		    
 
  enum {
 	 FET_RESET_PUC = 1<<0,
@@ -80,13 +168,20 @@ void fet_cmd_erase( FetModule *fet,
  *  - dirty: The FET tool seems to accept two different arguments, depending
  * 	     on whether it's a reset to try and get out of an explosion/failure.
  *           Setting this to TRUE will send this failure reset command. */
-void fet_cmd_reset( FetModule *fet, 
-		    uint8_t rtype, 
-		    gboolean dirty );
+int fet_cmd_reset( FetModule *fet, 
+		   uint8_t rtype, 
+		   gboolean dirty,
+		   fet_reply_cb_t cb, gpointer userdata );
 		    
 
-void fet_cmd_close( FetModule *fet );
+int fet_cmd_close( FetModule *fet,
+		   fet_reply_cb_t cb, gpointer userdata );
+
+int fet_cmd_run( FetModule *fet,
+		 fet_reply_cb_t cb, gpointer userdata );
 
-void fet_cmd_run( gpointer _fet );
+/* Execute a single instruction */
+int fet_cmd_step( FetModule *fet,
+		  fet_reply_cb_t cb, gpointer userdata );
 
 #endif	/* __FET_COMMANDS */
@@ -0,0 +1,261 @@
+/* Streams images into a target's memory through a FET
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fet-download.h"
+#include "fet-commands.h"
+#include <stdio.h>
+
+/* Allocate a download, and set up everything but what it sends */
+static fet_download_t* fet_download_new( FetModule *fet,
+					 uint8_t window,
+					 fet_download_cb_t cb,
+					 gpointer userdata );
+
+/* Queue writes until the window is full or there's nothing left to send */
+static void fet_download_fill( fet_download_t *dl );
+
+/* fet_download_fill() for downloads of extents and of scripts */
+static void fet_download_fill_extents( fet_download_t *dl );
+static void fet_download_fill_script( fet_download_t *dl );
+
+/* Record that a write of len bytes has been queued */
+static void fet_download_sent( fet_download_t *dl, uint32_t len );
+
+/* Called with the FET's reply to a write */
+static void fet_download_write_done( FetModule *fet,
+				     fet_reply_status_t status,
+				     const fet_reply_t *reply,
+				     gpointer _dl );
+
+/* Timeout callback for retrying once frames have been freed */
+static gboolean fet_download_retry( gpointer _dl );
+
+/* Report the outcome and free the download */
+static void fet_download_finish( fet_download_t *dl );
+
+static fet_download_t* fet_download_new( FetModule *fet,
+					 uint8_t window,
+					 fet_download_cb_t cb,
+					 gpointer userdata )
+{
+	fet_download_t *dl;
+	g_assert( fet != NULL && window > 0 );
+
+	dl = g_malloc( sizeof(fet_download_t) );
+
+	dl->fet = fet;
+	dl->extents = NULL;
+	dl->n_extents = 0;
+	dl->cur = 0;
+	dl->pos = 0;
+	dl->script = NULL;
+	dl->frame = 0;
+	dl->window = window;
+	dl->in_flight = 0;
+	dl->lengths = g_queue_new();
+	dl->failed = FALSE;
+	dl->report = TRUE;
+	dl->cb = cb;
+	dl->userdata = userdata;
+
+	dl->bytes_total = dl->bytes_done = 0;
+	dl->timer = g_timer_new();
+	return dl;
+}
+
+void fet_download_start( FetModule *fet,
+			 const elf_extent_t *extents,
+			 uint16_t n_extents,
+			 uint8_t window,
+			 gboolean report,
+			 fet_download_cb_t cb,
+			 gpointer userdata )
+{
+	fet_download_t *dl;
+	uint16_t i;
+	g_assert( extents != NULL );
+
+	dl = fet_download_new( fet, window, cb, userdata );
+	dl->extents = extents;
+	dl->n_extents = n_extents;
+	dl->report = report;
+
+	for( i=0; i<n_extents; i++ )
+		dl->bytes_total += extents[i].len;
+
+	fet_download_fill( dl );
+}
+
+void fet_download_script_start( FetModule *fet,
+				fet_script_t *script,
+				uint8_t window,
+				fet_download_cb_t cb,
+				gpointer userdata )
+{
+	fet_download_t *dl;
+	g_assert( script != NULL );
+	g_assert( script->max_payload <= fet_module_get_max_payload( fet ) );
+
+	dl = fet_download_new( fet, window, cb, userdata );
+	dl->script = fet_script_ref( script );
+	dl->bytes_total = script->len;
+	dl->report = FALSE;
+
+	fet_download_fill( dl );
+}
+
+static void fet_download_fill( fet_download_t *dl )
+{
+	gboolean all_sent;
+	g_assert( dl != NULL );
+
+	if( dl->script != NULL ) {
+		fet_download_fill_script( dl );
+		all_sent = dl->frame >= dl->script->n_frames;
+	} else {
+		fet_download_fill_extents( dl );
+		all_sent = dl->cur >= dl->n_extents;
+	}
+
+	if( dl->in_flight == 0 && ( all_sent || dl->failed ) )
+		fet_download_finish( dl );
+}
+
+static void fet_download_fill_extents( fet_download_t *dl )
+{
+	/* Once a write has failed, or been cancelled, there's no point
+	 * sending any more */
+	while( dl->in_flight < dl->window && dl->cur < dl->n_extents
+	       && !dl->failed )
+	{
+		const elf_extent_t *ext = dl->extents + dl->cur;
+		uint32_t len = ext->len - dl->pos;
+
+		/* One frame per write, so that the window counts frames */
+		if( len > fet_cmd_write_mem_max( dl->fet ) )
+			len = fet_cmd_write_mem_max( dl->fet );
+
+		if( len > 0 ) {
+			if( fet_cmd_write_mem( dl->fet,
+					       ext->addr + dl->pos,
+					       ext->data + dl->pos,
+					       len,
+					       fet_download_write_done, dl ) != 0 ) {
+				/* The frame pool's exhausted.  The next reply will
+				 * bring us back here, but if there isn't one to come
+				 * then we need to try again later. */
+				if( dl->in_flight == 0 )
+					fet_module_timeout_add( dl->fet, 10,
+								fet_download_retry, dl );
+				return;
+			}
+
+			fet_download_sent( dl, len );
+			dl->pos += len;
+		}
+
+		if( dl->pos >= ext->len ) {
+			dl->cur++;
+			dl->pos = 0;
+		}
+	}
+}
+
+static void fet_download_fill_script( fet_download_t *dl )
+{
+	const fet_script_t *script = dl->script;
+
+	while( dl->in_flight < dl->window && dl->frame < script->n_frames
+	       && !dl->failed )
+	{
+		const fet_script_frame_t *f = script->frames + dl->frame;
+
+		if( fet_cmd_write_mem_encoded( dl->fet, f->addr, f->len,
+					       script->wire + f->wire_off,
+					       f->wire_len,
+					       fet_download_write_done, dl ) != 0 ) {
+			/* As above */
+			if( dl->in_flight == 0 )
+				fet_module_timeout_add( dl->fet, 10,
+							fet_download_retry, dl );
+			return;
+		}
+
+		fet_download_sent( dl, f->len );
+		dl->frame++;
+	}
+}
+
+static void fet_download_sent( fet_download_t *dl, uint32_t len )
+{
+	g_queue_push_tail( dl->lengths, GUINT_TO_POINTER(len) );
+	dl->in_flight++;
+}
+
+static gboolean fet_download_retry( gpointer _dl )
+{
+	fet_download_fill( (fet_download_t*)_dl );
+
+	return FALSE;
+}
+
+static void fet_download_write_done( FetModule *fet,
+				     fet_reply_status_t status,
+				     const fet_reply_t *reply,
+				     gpointer _dl )
+{
+	fet_download_t *dl = (fet_download_t*)_dl;
+	g_assert( dl != NULL && dl->in_flight > 0 );
+
+	/* Replies come back in the order the writes were sent */
+	dl->in_flight--;
+	dl->bytes_done += GPOINTER_TO_UINT( g_queue_pop_head( dl->lengths ) );
+
+	if( status != FET_REPLY_OK )
+		dl->failed = TRUE;
+
+	if( dl->report ) {
+		printf( "\rLoading: %6lu/%6lu bytes",
+			(long unsigned int)dl->bytes_done,
+			(long unsigned int)dl->bytes_total );
+		fflush( stdout );
+	}
+
+	fet_download_fill( dl );
+}
+
+static void fet_download_finish( fet_download_t *dl )
+{
+	gdouble t;
+	g_assert( dl != NULL );
+
+	t = g_timer_elapsed( dl->timer, NULL );
+	if( dl->report )
+		printf( "\nLoaded %lu bytes in %.2f s (%.0f bytes/s)%s\n",
+			(long unsigned int)dl->bytes_done, t,
+			t > 0 ? dl->bytes_done / t : 0,
+			dl->failed ? " -- some writes FAILED" : "" );
+
+	if( dl->cb != NULL )
+		dl->cb( dl, !dl->failed, dl->userdata );
+
+	if( dl->script != NULL )
+		fet_script_free( dl->script );
+	g_timer_destroy( dl->timer );
+	g_queue_free( dl->lengths );
+	g_free( dl );
+}
@@ -0,0 +1,107 @@
+/* Streams images into a target's memory through a FET
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef __FET_DOWNLOAD_H
+#define __FET_DOWNLOAD_H
+#include <glib.h>
+#include <stdint.h>
+#include "fet-module.h"
+#include "elf-access.h"
+#include "fet-script.h"
+
+/* The default number of memory writes kept in flight */
+#define FET_DOWNLOAD_WINDOW 4
+
+typedef struct fet_download_ts fet_download_t;
+
+/* Called when a download has finished.
+ * ok is FALSE if the FET rejected, or failed to acknowledge, any of
+ * the writes. */
+typedef void (*fet_download_cb_t) ( fet_download_t *dl, gboolean ok, gpointer userdata );
+
+struct fet_download_ts
+{
+	FetModule *fet;
+
+	/* The extents to write */
+	const elf_extent_t *extents;
+	uint16_t n_extents;
+	/* The extent being written, and the next byte to write within it */
+	uint16_t cur;
+	uint32_t pos;
+
+	/* Or the script to send, and the next frame to send from it.
+	 * The download holds a reference to the script. */
+	fet_script_t *script;
+	uint32_t frame;
+
+	/* The number of writes to keep in flight, and the number that are */
+	uint8_t window;
+	uint8_t in_flight;
+	/* The lengths of the writes in flight, oldest at the head */
+	GQueue *lengths;
+
+	/*** Progress ***/
+	uint32_t bytes_total, bytes_done;
+	gboolean failed;
+	GTimer *timer;
+	/* Whether progress is printed as it goes */
+	gboolean report;
+
+	fet_download_cb_t cb;
+	gpointer userdata;
+};
+
+/* Start writing extents into the target's memory.
+ * A new write is queued as soon as the FET acknowledges a previous one,
+ * keeping up to window writes in flight at once.
+ * Args:
+ *  -      fet: The FetModule to download through.
+ *  -   extents: The extents to write, which are streamed straight
+ *               out of their buffers.  These must remain valid until
+ *               the download completes.
+ *  - n_extents: The number of extents.
+ *  -   window: The number of writes to keep in flight.
+ *  -   report: Whether to print progress as it goes.
+ *  -       cb: Function to call when the download is complete.
+ *              The download is freed once this returns. */
+void fet_download_start( FetModule *fet,
+			 const elf_extent_t *extents,
+			 uint16_t n_extents,
+			 uint8_t window,
+			 gboolean report,
+			 fet_download_cb_t cb,
+			 gpointer userdata );
+
+/* Start sending a script's writes to the target.
+ * This works like fet_download_start(), but the frames go out as they
+ * were encoded when the script was compiled.  Progress isn't printed,
+ * as many of these may be running at once.
+ * Args:
+ *  -    fet: The FetModule to download through.  Its maximum payload
+ *            must be at least the one that the script was compiled for.
+ *  - script: The script to send.  The download takes a reference to it.
+ *  - window: The number of writes to keep in flight.
+ *  -     cb: Function to call when the download is complete.
+ *            The download is freed once this returns. */
+void fet_download_script_start( FetModule *fet,
+				fet_script_t *script,
+				uint8_t window,
+				fet_download_cb_t cb,
+				gpointer userdata );
+
+#endif	/* __FET_DOWNLOAD_H */
@@ -0,0 +1,261 @@
+/* A FET emulator on a pseudo-terminal, for testing
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+/* Usage: fet-emu LINK [BAD_ADDR]
+ * Opens a pty, links LINK to it, and answers the FET commands that
+ * fetproxy sends down it until it's killed.  Memory writes land in an
+ * image of the target's memory, and reads come back out of it.  If
+ * BAD_ADDR is given, the byte written there is corrupted, so that
+ * verifying it fails. */
+#include "crc.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define FRAME_BOUNDARY 0x7e
+#define FRAME_ESCAPE 0x7d
+
+/* Largest command or reply payload */
+#define EMU_FRAME_MAX 4096
+
+/* The target's address space */
+#define EMU_MEM_LEN 0x100000
+
+/* What the emulated target calls itself */
+#define EMU_NAME "MSP430F2274 (emulated)"
+
+/* Little endian fields within a frame */
+#define LE16(p) ( ((uint16_t)(p)[0]) | (((uint16_t)(p)[1]) << 8) )
+#define LE32(p) ( ((uint32_t)LE16(p)) | (((uint32_t)LE16((p)+2)) << 16) )
+
+static uint8_t mem[EMU_MEM_LEN];
+static long bad_addr = -1;
+
+/* Answer one command.  fd is the pty's master. */
+static void emu_command( int fd, const uint8_t *d, uint16_t len );
+
+/* Send a reply, framed as the FET frames them */
+static void emu_reply( int fd, const uint8_t *d, uint16_t len );
+
+/* Store a little endian 32-bit value */
+static void emu_put32( uint8_t *p, uint32_t v );
+
+static void emu_put32( uint8_t *p, uint32_t v )
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+static void emu_reply( int fd, const uint8_t *d, uint16_t len )
+{
+	uint8_t f[EMU_FRAME_MAX + 4];
+	uint16_t c;
+	size_t pos = 0;
+
+	/* The length covers the payload and the checksum */
+	f[0] = (len + 2) & 0xff;
+	f[1] = (len + 2) >> 8;
+	memcpy( f + 2, d, len );
+
+	c = crc_final( crc_update( crc_init(), d, len ) );
+	f[len + 2] = c & 0xff;
+	f[len + 3] = c >> 8;
+
+	while( pos < (size_t)len + 4 ) {
+		ssize_t w = write( fd, f + pos, len + 4 - pos );
+
+		if( w < 0 && errno != EINTR && errno != EAGAIN ) {
+			perror( "fet-emu: write" );
+			exit( 1 );
+		}
+		if( w > 0 )
+			pos += w;
+	}
+}
+
+static void emu_command( int fd, const uint8_t *d, uint16_t len )
+{
+	uint8_t r[EMU_FRAME_MAX];
+	uint16_t rlen = 4;
+	uint32_t addr, n;
+
+	if( len < 4 )
+		return;
+
+	/* An acknowledgement, unless there's more to say */
+	memset( r, 0, sizeof(r) );
+	r[0] = d[0];
+
+	switch( d[0] )
+	{
+	case 0x03:
+		/* Identify: the name sits 4 bytes into the data block, which
+		 * goes on to the code start and size */
+		r[1] = 0x03;
+		emu_put32( r + 4, 0x2a );
+		strcpy( (char*)r + 12, EMU_NAME );
+		r[8 + 0x24] = 0x00;
+		r[8 + 0x25] = 0x80;
+		emu_put32( r + 8 + 0x26, 0x8000 );
+		rlen = 8 + 0x2a;
+		break;
+
+	case 0x08:
+		/* Read the registers: all zero, each as a 32-bit word */
+		r[1] = 0x03;
+		emu_put32( r + 4, 64 );
+		rlen = 8 + 64;
+		break;
+
+	case 0x0c:
+		/* Erase: the emulation doesn't distinguish the areas */
+		memset( mem, 0xff, sizeof(mem) );
+		break;
+
+	case 0x0d:
+		if( len < 12 )
+			return;
+		addr = LE32( d + 4 ) % EMU_MEM_LEN;
+		n = LE32( d + 8 );
+		if( n > sizeof(r) - 8 || addr + n > EMU_MEM_LEN )
+			return;
+
+		r[1] = 0x03;
+		emu_put32( r + 4, n );
+		memcpy( r + 8, mem + addr, n );
+		rlen = 8 + n;
+		break;
+
+	case 0x0e:
+		if( len < 12 )
+			return;
+		addr = LE32( d + 4 ) % EMU_MEM_LEN;
+		n = LE16( d + 8 );
+		if( n != len - 12 || addr + n > EMU_MEM_LEN )
+			return;
+
+		memcpy( mem + addr, d + 12, n );
+		if( bad_addr >= addr && bad_addr < addr + n )
+			mem[bad_addr] ^= 0x01;
+		break;
+
+	case 0x12:
+		/* State, or halt: the target's always halted */
+		r[1] = 0x02;
+		r[4] = 1;
+		rlen = 10;
+		break;
+	}
+
+	emu_reply( fd, r, rlen );
+}
+
+int main( int argc, char** argv )
+{
+	static uint8_t frame[EMU_FRAME_MAX + 2];
+	uint16_t flen = 0;
+	int escape = 0, in_frame = 0;
+	struct termios t;
+	int fd, slave;
+
+	if( argc < 2 || argc > 3 ) {
+		fprintf( stderr, "Usage: %s LINK [BAD_ADDR]\n", argv[0] );
+		return 1;
+	}
+	if( argc == 3 )
+		bad_addr = strtol( argv[2], NULL, 0 );
+
+	fd = posix_openpt( O_RDWR | O_NOCTTY );
+	if( fd < 0 || grantpt( fd ) < 0 || unlockpt( fd ) < 0 ) {
+		perror( "fet-emu: Failed to open a pty" );
+		return 1;
+	}
+
+	/* Hold the other side open, so that reads don't fail between
+	 * fetproxy's opens of it, and keep it raw */
+	slave = open( ptsname( fd ), O_RDWR | O_NOCTTY );
+	if( slave < 0 || tcgetattr( slave, &t ) < 0 ) {
+		perror( "fet-emu: Failed to open the pty's slave" );
+		return 1;
+	}
+	cfmakeraw( &t );
+	tcsetattr( slave, TCSANOW, &t );
+
+	unlink( argv[1] );
+	if( symlink( ptsname( fd ), argv[1] ) < 0 ) {
+		perror( "fet-emu: Failed to link to the pty" );
+		return 1;
+	}
+
+	while( 1 )
+	{
+		uint8_t buf[512];
+		ssize_t r, i;
+
+		r = read( fd, buf, sizeof(buf) );
+		if( r < 0 && errno == EINTR )
+			continue;
+		if( r <= 0 ) {
+			perror( "fet-emu: read" );
+			return 1;
+		}
+
+		for( i=0; i<r; i++ )
+		{
+			uint8_t c = buf[i];
+
+			if( c == FRAME_BOUNDARY ) {
+				/* Frames start and end with a boundary */
+				if( in_frame && flen >= 2 ) {
+					uint16_t chk = LE16( frame + flen - 2 );
+
+					if( crc_final( crc_update( crc_init(), frame, flen - 2 ) ) == chk )
+						emu_command( fd, frame, flen - 2 );
+					else
+						fprintf( stderr, "fet-emu: Bad checksum -- discarding frame\n" );
+					in_frame = 0;
+				} else
+					in_frame = 1;
+
+				flen = 0;
+				escape = 0;
+				continue;
+			}
+
+			if( c == FRAME_ESCAPE ) {
+				escape = 1;
+				continue;
+			}
+			if( escape ) {
+				c ^= 0x20;
+				escape = 0;
+			}
+
+			if( flen < sizeof(frame) )
+				frame[flen++] = c;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,326 @@
+/* Programs one target of a gang, all loaded with the same script
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fet-gang.h"
+#include "fet-commands.h"
+#include "fet-download.h"
+#include "fet-poll.h"
+#include <string.h>
+
+/* A target being programmed */
+typedef struct {
+	FetModule *fet;
+	fet_script_t *script;
+	uint8_t window;
+
+	/* The stage in progress */
+	fet_gang_stage_t stage;
+	GTimer *stage_timer, *timer;
+
+	/*** Verification ***/
+	/* The extent being read back, and where the read in flight starts */
+	uint16_t ext;
+	uint32_t pos;
+	/* The read in flight, and its length */
+	uint8_t *buf;
+	uint32_t len;
+
+	fet_gang_result_t result;
+
+	fet_gang_cb_t cb;
+	gpointer userdata;
+} fet_gang_t;
+
+/* Finish the current stage, and start the next one */
+static void fet_gang_next( fet_gang_t *g );
+
+/* Fail the current stage */
+static void fet_gang_fail( fet_gang_t *g, fet_reply_status_t status );
+
+/* Report the result and free everything */
+static void fet_gang_finish( fet_gang_t *g );
+
+/* Called with the reply to a stage's command */
+static void fet_gang_stage_done( FetModule *fet,
+				 fet_reply_status_t status,
+				 const fet_reply_t *reply,
+				 gpointer _g );
+
+/* Called when the load has finished */
+static void fet_gang_loaded( fet_download_t *dl, gboolean ok, gpointer _g );
+
+/* Read back the next chunk of the image.
+ * Returns FALSE once there's nothing left to read. */
+static gboolean fet_gang_verify_next( fet_gang_t *g );
+
+/* Timeout callback for retrying a read once frames have been freed */
+static gboolean fet_gang_verify_retry( gpointer _g );
+
+/* Called with the data of each read */
+static void fet_gang_verify_read( FetModule *fet,
+				  fet_reply_status_t status,
+				  const fet_reply_t *reply,
+				  gpointer _g );
+
+/* Called when the reset before the target's started is done */
+static void fet_gang_reset_done( FetModule *fet,
+				 fet_reply_status_t status,
+				 const fet_reply_t *reply,
+				 gpointer _g );
+
+static const char *stage_names[FET_GANG_N_STAGES] =
+{
+	"identify",
+	"erase",
+	"load",
+	"verify",
+	"start"
+};
+
+const char* fet_gang_stage_name( fet_gang_stage_t stage )
+{
+	g_assert( stage < FET_GANG_N_STAGES );
+
+	return stage_names[stage];
+}
+
+void fet_gang_program( FetModule *fet,
+		       fet_script_t *script,
+		       uint8_t window,
+		       fet_gang_cb_t cb,
+		       gpointer userdata )
+{
+	fet_gang_t *g;
+	g_assert( fet != NULL && script != NULL && window > 0 );
+
+	g = g_slice_new0( fet_gang_t );
+	g->fet = fet;
+	g->script = fet_script_ref( script );
+	g->window = window;
+	g->cb = cb;
+	g->userdata = userdata;
+
+	g->result.ok = TRUE;
+	g->result.status = FET_REPLY_OK;
+
+	g->timer = g_timer_new();
+	g->stage_timer = g_timer_new();
+
+	/* Identify first, which also waits out the FET's set up */
+	g->stage = FET_GANG_IDENTIFY;
+	if( fet_cmd_identify( fet, fet_gang_stage_done, g ) != 0 )
+		fet_gang_fail( g, FET_REPLY_CANCELLED );
+}
+
+static void fet_gang_next( fet_gang_t *g )
+{
+	int r = 0;
+	g_assert( g != NULL );
+
+	g->result.times[g->stage] = g_timer_elapsed( g->stage_timer, NULL );
+	g_timer_start( g->stage_timer );
+
+	g->stage++;
+
+	switch( g->stage ) {
+	case FET_GANG_ERASE:
+		r = fet_cmd_erase( g->fet, FET_ERASE_MAIN, 0,
+				   fet_gang_stage_done, g );
+		break;
+
+	case FET_GANG_LOAD:
+		fet_download_script_start( g->fet, g->script, g->window,
+					   fet_gang_loaded, g );
+		break;
+
+	case FET_GANG_VERIFY:
+		g->ext = 0;
+		g->pos = 0;
+		g->len = 0;
+		g->buf = g_malloc( g->window * fet_cmd_read_mem_max( g->fet ) );
+
+		if( !fet_gang_verify_next( g ) )
+			fet_gang_next( g );
+		break;
+
+	case FET_GANG_START:
+		r = fet_cmd_reset( g->fet, FET_RESET_ALL, FALSE,
+				   fet_gang_reset_done, g );
+		break;
+
+	default:
+		fet_gang_finish( g );
+	}
+
+	if( r != 0 )
+		fet_gang_fail( g, FET_REPLY_CANCELLED );
+}
+
+static void fet_gang_fail( fet_gang_t *g, fet_reply_status_t status )
+{
+	g_assert( g != NULL );
+
+	g->result.times[g->stage] = g_timer_elapsed( g->stage_timer, NULL );
+	g->result.ok = FALSE;
+	g->result.failed = g->stage;
+	g->result.status = status;
+
+	fet_gang_finish( g );
+}
+
+static void fet_gang_finish( fet_gang_t *g )
+{
+	g_assert( g != NULL );
+
+	g->result.total = g_timer_elapsed( g->timer, NULL );
+
+	if( g->cb != NULL )
+		g->cb( g->fet, &g->result, g->userdata );
+
+	fet_script_free( g->script );
+	g_free( g->buf );
+	g_timer_destroy( g->timer );
+	g_timer_destroy( g->stage_timer );
+	g_slice_free( fet_gang_t, g );
+}
+
+static void fet_gang_stage_done( FetModule *fet,
+				 fet_reply_status_t status,
+				 const fet_reply_t *reply,
+				 gpointer _g )
+{
+	fet_gang_t *g = (fet_gang_t*)_g;
+	g_assert( g != NULL );
+
+	if( status != FET_REPLY_OK ) {
+		fet_gang_fail( g, status );
+		return;
+	}
+
+	if( g->stage == FET_GANG_IDENTIFY ) {
+		const fet_reply_identify_t *id = fet_module_get_identity( fet );
+
+		if( id != NULL )
+			g_strlcpy( g->result.name, id->name, sizeof(g->result.name) );
+	} else if( g->stage == FET_GANG_START )
+		/* Nobody's watching the target once it's been started */
+		fet_poll_stop( fet );
+
+	fet_gang_next( g );
+}
+
+static void fet_gang_loaded( fet_download_t *dl, gboolean ok, gpointer _g )
+{
+	fet_gang_t *g = (fet_gang_t*)_g;
+	g_assert( g != NULL );
+
+	if( !ok )
+		fet_gang_fail( g, FET_REPLY_ERROR );
+	else
+		fet_gang_next( g );
+}
+
+static gboolean fet_gang_verify_next( fet_gang_t *g )
+{
+	const elf_image_t *img = g->script->image;
+	const elf_extent_t *ext;
+	g_assert( g != NULL );
+
+	/* Move past what's been read */
+	g->pos += g->len;
+	g->len = 0;
+
+	while( g->ext < img->n_extents && g->pos >= img->extents[g->ext].len ) {
+		g->ext++;
+		g->pos = 0;
+	}
+
+	if( g->ext >= img->n_extents )
+		return FALSE;
+	ext = img->extents + g->ext;
+
+	/* Keep a window's worth of frames in flight */
+	g->len = MIN( ext->len - g->pos,
+		      (uint32_t)g->window * fet_cmd_read_mem_max( g->fet ) );
+
+	if( fet_cmd_read_mem( g->fet, ext->addr + g->pos, g->buf, g->len,
+			      fet_gang_verify_read, g ) != 0 ) {
+		/* Nothing else should be using the frames, so they'll be back
+		 * soon */
+		g->len = 0;
+		fet_module_timeout_add( g->fet, 10, fet_gang_verify_retry, g );
+	}
+
+	return TRUE;
+}
+
+static gboolean fet_gang_verify_retry( gpointer _g )
+{
+	fet_gang_t *g = (fet_gang_t*)_g;
+
+	if( !fet_gang_verify_next( g ) )
+		fet_gang_next( g );
+
+	return FALSE;
+}
+
+static void fet_gang_verify_read( FetModule *fet,
+				  fet_reply_status_t status,
+				  const fet_reply_t *reply,
+				  gpointer _g )
+{
+	fet_gang_t *g = (fet_gang_t*)_g;
+	const elf_extent_t *ext;
+	g_assert( g != NULL );
+
+	if( status != FET_REPLY_OK ) {
+		fet_gang_fail( g, status );
+		return;
+	}
+
+	ext = g->script->image->extents + g->ext;
+
+	if( memcmp( g->buf, ext->data + g->pos, g->len ) != 0 ) {
+		uint32_t i;
+
+		for( i=0; g->buf[i] == ext->data[g->pos + i]; i++ );
+		g->result.bad_addr = ext->addr + g->pos + i;
+
+		fet_gang_fail( g, FET_REPLY_OK );
+		return;
+	}
+
+	if( !fet_gang_verify_next( g ) )
+		fet_gang_next( g );
+}
+
+static void fet_gang_reset_done( FetModule *fet,
+				 fet_reply_status_t status,
+				 const fet_reply_t *reply,
+				 gpointer _g )
+{
+	fet_gang_t *g = (fet_gang_t*)_g;
+	g_assert( g != NULL );
+
+	if( status != FET_REPLY_OK ) {
+		fet_gang_fail( g, status );
+		return;
+	}
+
+	if( fet_cmd_run( fet, fet_gang_stage_done, g ) != 0 )
+		fet_gang_fail( g, FET_REPLY_CANCELLED );
+}
@@ -0,0 +1,85 @@
+/* Programs one target of a gang, all loaded with the same script
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef __FET_GANG_H
+#define __FET_GANG_H
+#include <glib.h>
+#include <stdint.h>
+#include "fet-module.h"
+#include "fet-script.h"
+
+/* The stages that a target goes through, in order */
+typedef enum {
+	/* Find out what the target is */
+	FET_GANG_IDENTIFY,
+	/* Erase its main flash */
+	FET_GANG_ERASE,
+	/* Send the script */
+	FET_GANG_LOAD,
+	/* Read the image back, and compare it */
+	FET_GANG_VERIFY,
+	/* Reset the target and set it running */
+	FET_GANG_START,
+	FET_GANG_N_STAGES
+} fet_gang_stage_t;
+
+/* How programming a target went */
+typedef struct {
+	/* TRUE if all of the stages passed */
+	gboolean ok;
+	/* The stage that failed, if one did */
+	fet_gang_stage_t failed;
+	/* How the failing command finished.  This is FET_REPLY_OK if it was
+	 * the data that failed to verify. */
+	fet_reply_status_t status;
+	/* The first address that failed to verify */
+	uint32_t bad_addr;
+
+	/* What the target identified as, or "" if it didn't */
+	char name[33];
+
+	/* How long each stage took, and the whole lot, in seconds.
+	 * Stages that weren't reached take 0. */
+	gdouble times[FET_GANG_N_STAGES];
+	gdouble total;
+} fet_gang_result_t;
+
+/* Called once a target has been programmed, or has failed.
+ * result is only valid during the call. */
+typedef void (*fet_gang_cb_t) ( FetModule *fet,
+				const fet_gang_result_t *result,
+				gpointer userdata );
+
+/* Program a target: identify, erase, load, verify and start it.
+ * Each FET of a gang should run this from its own thread, so that the
+ * whole gang takes as long as its slowest target.  The FET must have
+ * been opened and configured already.
+ * Args:
+ *  -    fet: The FetModule that the target's connected to.
+ *  - script: The script to load.  A reference is held until cb is called.
+ *  - window: The number of writes, and reads, to keep in flight.
+ *  -     cb: Function to call with the result. */
+void fet_gang_program( FetModule *fet,
+		       fet_script_t *script,
+		       uint8_t window,
+		       fet_gang_cb_t cb,
+		       gpointer userdata );
+
+/* Returns a name for a stage, for reports */
+const char* fet_gang_stage_name( fet_gang_stage_t stage );
+
+#endif	/* __FET_GANG_H */
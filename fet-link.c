@@ -0,0 +1,170 @@
+/* Recovers from the FET being unplugged
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fet-link.h"
+#include "fet-commands.h"
+#include "fet-cache.h"
+#include "fet-poll.h"
+
+/* Timeout callback: try to reopen the FET */
+static gboolean fet_link_retry( gpointer _fet );
+
+/* Arrange for the next attempt at reopening the FET */
+static void fet_link_schedule( FetModule *fet );
+
+/* Called with the reply to the last of the commands that set the FET
+ * up again */
+static void fet_link_restored( FetModule *fet,
+			       fet_reply_status_t status,
+			       const fet_reply_t *reply,
+			       gpointer userdata );
+
+void fet_link_init( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	fet->dev_name = NULL;
+	fet->link_state = FET_LINK_UP;
+	fet->link_setup = FALSE;
+	fet->held_head = fet->held_tail = NULL;
+	fet->link_timer = 0;
+	fet->link_retry_ms = FET_LINK_RETRY_MIN_MS;
+	fet->link_running = FALSE;
+	fet->link_drops = 0;
+
+	fet->setup_conf = fet->setup_sbw = FALSE;
+	fet->setup_vcc = FALSE;
+	fet->setup_vcc_mv = 0;
+}
+
+void fet_link_free( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	if( fet->link_timer != 0 ) {
+		fet_module_source_remove( fet, fet->link_timer );
+		fet->link_timer = 0;
+	}
+
+	g_free( fet->dev_name );
+	fet->dev_name = NULL;
+}
+
+void fet_link_lost( FetModule *fet )
+{
+	gboolean was_up;
+	g_assert( fet != NULL );
+
+	if( fet->link_state == FET_LINK_DOWN )
+		return;
+	was_up = ( fet->link_state == FET_LINK_UP );
+
+	g_warning( "Lost the FET -- trying to reopen %s", fet->dev_name );
+	fet->link_drops++;
+
+	/* If it went during the set up, the target was already stopped */
+	if( was_up )
+		fet->link_running = fet_poll_active( fet );
+	fet_poll_stop( fet );
+
+	/* Anything queued from here on waits for the link.  While it's
+	 * being set up, the only frames queued are the set up commands,
+	 * which are sent afresh next time. */
+	fet->link_state = FET_LINK_DOWN;
+	fet_module_serial_close( fet, was_up );
+
+	/* The target may well have been reset */
+	fet_cache_flush( fet );
+	fet_cache_regs_invalidate( fet );
+
+	/* Keep backing off if it's not coming back properly */
+	if( was_up )
+		fet->link_retry_ms = FET_LINK_RETRY_MIN_MS;
+	fet_link_schedule( fet );
+}
+
+static void fet_link_schedule( FetModule *fet )
+{
+	fet->link_timer = fet_module_timeout_add( fet, fet->link_retry_ms,
+						  fet_link_retry, fet );
+
+	fet->link_retry_ms *= 2;
+	if( fet->link_retry_ms > FET_LINK_RETRY_MAX_MS )
+		fet->link_retry_ms = FET_LINK_RETRY_MAX_MS;
+}
+
+static gboolean fet_link_retry( gpointer _fet )
+{
+	FetModule *fet = (FetModule*)_fet;
+	int r = 0;
+
+	fet->link_timer = 0;
+
+	if( !fet_module_serial_open( fet ) ) {
+		fet_link_schedule( fet );
+		return FALSE;
+	}
+
+	g_message( "Reopened %s -- setting the FET up again", fet->dev_name );
+	fet->link_state = FET_LINK_SETUP;
+
+	/* These go out ahead of the held commands */
+	fet->link_setup = TRUE;
+	r |= fet_cmd_open( fet, NULL, NULL );
+	r |= fet_cmd_init( fet, NULL, NULL );
+	if( fet->setup_conf )
+		r |= fet_cmd_conf( fet, fet->setup_sbw, NULL, NULL );
+	if( fet->setup_vcc )
+		r |= fet_cmd_set_vcc( fet, fet->setup_vcc_mv, NULL, NULL );
+	r |= fet_cmd_identify( fet, fet_link_restored, NULL );
+	fet->link_setup = FALSE;
+
+	/* The held frames were all taken from the pool, so it may have
+	 * run dry.  Try again later, when their owners might have given
+	 * up on some. */
+	if( r != 0 ) {
+		g_warning( "No frames free to set the FET up" );
+		fet_link_lost( fet );
+	}
+
+	return FALSE;
+}
+
+static void fet_link_restored( FetModule *fet,
+			       fet_reply_status_t status,
+			       const fet_reply_t *reply,
+			       gpointer userdata )
+{
+	/* It went again while being set up */
+	if( fet->link_state != FET_LINK_SETUP )
+		return;
+
+	if( status != FET_REPLY_OK ) {
+		g_warning( "Failed to set the FET up again" );
+		fet_link_lost( fet );
+		return;
+	}
+
+	g_message( "The FET's back" );
+	fet->link_state = FET_LINK_UP;
+	fet_module_release_held( fet );
+
+	if( fet->link_running ) {
+		fet->link_running = FALSE;
+		fet_poll_lost( fet );
+	}
+}
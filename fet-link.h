@@ -0,0 +1,45 @@
+/* Recovers from the FET being unplugged
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef __FET_LINK_H
+#define __FET_LINK_H
+#include <glib.h>
+#include <stdint.h>
+#include "fet-module.h"
+
+/* When the FET's serial device goes away (e.g. a USB reset), it's
+ * reopened after FET_LINK_RETRY_MIN_MS, with the interval doubling up to
+ * FET_LINK_RETRY_MAX_MS for as long as that fails.  Once it's open
+ * again, the FET's set up as it was before (open, init, conf, vcc and
+ * identify), and then the commands that queued up in the meantime go
+ * out.
+ * Commands that were waiting for replies when it went get
+ * FET_REPLY_ERROR.  The target's memory and registers are assumed to
+ * have changed.  If the target was running, the halt listeners are told
+ * once the FET's back, with target_state's signal set to
+ * GDB_CLIENT_SIGLOST. */
+#define FET_LINK_RETRY_MIN_MS 100
+#define FET_LINK_RETRY_MAX_MS 5000
+
+void fet_link_init( FetModule *fet );
+void fet_link_free( FetModule *fet );
+
+/* The serial device has failed.  Close it, and start trying to get it
+ * back. */
+void fet_link_lost( FetModule *fet );
+
+#endif	/* __FET_LINK_H */
@@ -23,8 +23,14 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #include "fet-module.h"
+#include "fet-commands.h"
+#include "fet-download.h"
+#include "fet-cache.h"
+#include "fet-poll.h"
+#include "fet-link.h"
 #include "crc.h"
 #include "serial.h"
 
@@ -33,20 +39,49 @@ gboolean fet_module_io_error( GIOChannel *source, GIOCondition condition,
 
 /*** Incoming Data Functions ***/
 
+/* The serial port options for talking to the FET */
+static const serial_settings_t fet_serial_settings =
+{
+	.baud = 460800,
+	.parity = PARITY_NONE,
+	.stop_bits = 1,
+	.flow_control = FLOW_NONE
+};
+
+/* Watch the serial port for cond, from the FET's main context */
+static guint fet_module_watch_add( FetModule *fet, GIOCondition cond, GIOFunc func );
+
 /* Process incoming data */
 gboolean fet_module_proc_incoming( GIOChannel *source, GIOCondition condition,
 				   gpointer _fet );
 
 /* Reads in available bytes from the input.
- * When a full frame is achieved, it returns 0.
+ * When a full frame is achieved, it returns 0, and points frame at its
+ * payload (i.e. the data without the length or checksum), which is len
+ * bytes long.  The frame remains valid until the next call.
  * When a full frame has not been acheived, it returns 1.
  * When an error occurs, it returns -1 */
-static int fet_module_read_frame( FetModule* fet  );
+static int fet_module_read_frame( FetModule* fet, uint8_t **frame, uint16_t *len );
+
+/* Reads as much as is available from the serial port into the receive
+ * ring, in as few reads as possible.
+ * Returns the number of bytes read, or -1 on error. */
+static int fet_module_rx_fill( FetModule* fet );
+
+/* Returns a pointer to a contiguous copy of len bytes of the receive ring,
+ * starting from index pos.  Only copies if the data wraps. */
+static uint8_t* fet_module_rx_linear( FetModule* fet, uint32_t pos, uint16_t len );
+
+/* Folds the frame payload between ring indices from and to into the
+ * receive checksum */
+static void fet_module_rx_crc_fold( FetModule* fet, uint32_t from, uint32_t to );
 
-/* Displays the contents of a frame */
-static void debug_show_frame( uint8_t* buf, uint16_t len );
+/* Hands a reply to the command that's waiting for it */
+static void fet_module_reply_dispatch( FetModule* fet, const uint8_t *d, uint16_t len );
 
-static void debug_show_data( const uint8_t* buf, uint16_t len );
+/* Logs the contents of a frame, if debug messages are enabled.
+ * dir says which way it went. */
+static void debug_show_frame( const char *dir, const uint8_t* buf, uint16_t len );
 
 /*** Outgoing Queue Functions ***/
 
@@ -54,22 +89,34 @@ static void debug_show_data( const uint8_t* buf, uint16_t len );
 static gboolean fet_module_proc_outgoing( GIOChannel *source, GIOCondition condition,
 					  gpointer _fet );
 
-/* Escape the byte pointed to by d.  Put the result in d.
- * Returns TRUE if it's OK to move on to the next byte. */
-static gboolean fet_module_outgoing_escape_byte( FetModule* fet, uint8_t *d );
-
 /* Whether data's ready to transmit */
 static gboolean fet_module_outgoing_queued( FetModule* fet );
 
-/* Returns the next byte to transmit */
-static uint8_t fet_module_outgoing_next( FetModule* fet );
-
 /* Adds the frame directly to the queue (memory allocation must have
  * already been done) */
 static void fet_module_out_queue_add_frame( FetModule* fet, fet_frame_t* frame );
 
-/* Removes the last frame from the transmit queue */
-static void fet_module_out_queue_del( FetModule* fet );
+/* Moves the first frame from the transmit queue onto the queue of frames
+ * waiting for replies */
+static void fet_module_out_queue_sent( FetModule* fet );
+
+/*** Reply Queue Functions ***/
+
+/* Removes the first frame from the reply queue, calls its callback with
+ * the given outcome, and returns it to the frame pool */
+static void fet_module_wait_queue_complete( FetModule* fet,
+					    fet_reply_status_t status,
+					    const fet_reply_t *reply );
+
+/* Start the timeout for the reply at the head of the reply queue,
+ * if it's not already running */
+static void fet_module_reply_timer_start( FetModule* fet );
+
+/* Stop the reply timeout */
+static void fet_module_reply_timer_stop( FetModule* fet );
+
+/* Timeout callback for when the FET fails to reply */
+static gboolean fet_module_reply_timeout( gpointer _fet );
 
 /*** "Internal" Client API Functions ***/
 
@@ -80,99 +127,125 @@ void fet_instance_init( GTypeInstance *fet, gpointer g_class );
 /* Free information related to a module. */
 void fet_free( FetModule* fet );
 
+const fet_reply_identify_t* fet_module_get_identity( FetModule* fet )
+{
+	assert( fet != NULL );
+
+	if( !fet->identified )
+		return NULL;
+
+	return &fet->identity;
+}
+
 static void fet_module_print_stats( FetModule* fet );
 
-static uint8_t fet_module_outgoing_next( FetModule* fet )
-{
-	const uint8_t FRAME_BOUNDARY = 0x7E;
-	fet_frame_t* frame;
+#define FRAME_BOUNDARY 0x7E
+#define FRAME_ESCAPE 0x7D
 
-	assert( fet != NULL );
+/* Append d to the wire image at o, escaping it if necessary */
+#define FET_WIRE_PUT(o, d) do {						\
+		uint8_t _d = (d);					\
+		if( _d == FRAME_BOUNDARY || _d == FRAME_ESCAPE ) {	\
+			*((o)++) = FRAME_ESCAPE;			\
+			_d ^= 0x20;					\
+		}							\
+		*((o)++) = _d;						\
+	} while(0)
 
-	frame = (fet_frame_t*)g_queue_peek_tail( fet->out_frames );
+uint16_t fet_module_frame_encode( const uint8_t *buf, uint16_t len, uint8_t *out )
+{
+	uint8_t *o = out;
+	uint16_t c = crc_init();
+	uint16_t i;
+	assert( buf != NULL && out != NULL );
 
-	if( fet->tx_pos == 0 )
-		return FRAME_BOUNDARY;
-	else if( fet->tx_pos < frame->len + 1 )
-		return frame->data[ fet->tx_pos - 1 ];
-	else if( fet->tx_pos < frame->len + 3 )
-	{
-		if( !fet->checked ) {
-			/* Calculate checksum */
-			fet->o_chk = crc_block( frame->data, frame->len );
-			fet->checked = TRUE;
-		}
+	*(o++) = FRAME_BOUNDARY;
 
-		if( fet->tx_pos == frame->len + 1 )
-			/* Low byte */
-			return (fet->o_chk) & 0xff;
-		else
-			/* High byte */
-			return (fet->o_chk >> 8) & 0xff;
-	} else if ( fet->tx_pos == frame->len + 3 ) {
-		return FRAME_BOUNDARY;
+	/* The checksum is folded in as each byte is escaped */
+	for( i=0; i<len; i++ )
+	{
+		c = crc_update_byte( c, buf[i] );
+		FET_WIRE_PUT( o, buf[i] );
 	}
-	else
-		g_error( "Trying to transmit past end of frame" );
-	
+
+	c = crc_final( c );
+	FET_WIRE_PUT( o, c & 0xff );
+	FET_WIRE_PUT( o, (c >> 8) & 0xff );
+
+	*(o++) = FRAME_BOUNDARY;
+
+	return o - out;
 }
 
-/* This function needs a bit of cleanup */
 static gboolean fet_module_proc_outgoing( GIOChannel *source, GIOCondition condition,
 					  gpointer _fet )
 {
 	FetModule *fet = (FetModule*)_fet;
-	GIOChannel *ioc;
+	int fd;
 	assert( fet != NULL );
-	ioc = serial_conn_get_io_channel( fet->serial );
+	fd = g_io_channel_unix_get_fd( fet->ioc );
 
-	/* If there's an item in the list, transmit part of it */
-	while( g_queue_get_length( fet->out_frames ) )
+	/* Hand as much of the queue as we can to the serial port at once */
+	while( fet->out_head != NULL )
 	{
-		fet_frame_t* frame;
-		gboolean inc;
-		uint8_t d;
-		gsize w;
-		GError *error = NULL;
-		GIOStatus s;
-
-		frame = (fet_frame_t*)g_queue_peek_tail( fet->out_frames );
-		d = fet_module_outgoing_next( fet );
-
-		inc = fet_module_outgoing_escape_byte( fet, &d );
-
-		/* write data */
-		s = g_io_channel_write_chars( ioc, (gchar*)&d, 1, &w, &error );
+		struct iovec iov[FET_TX_IOV_MAX];
+		fet_frame_t *frame;
+		int n;
+		ssize_t w;
+
+		for( frame = fet->out_head, n = 0;
+		     frame != NULL && n < FET_TX_IOV_MAX;
+		     frame = frame->next, n++ )
+		{
+			iov[n].iov_base = (uint8_t*)frame->wire_ptr;
+			iov[n].iov_len = frame->wire_len;
+		}
 
-		if( s == G_IO_STATUS_AGAIN )
-			break;
+		/* Resume part way through the current frame */
+		iov[0].iov_base = (uint8_t*)iov[0].iov_base + fet->tx_pos;
+		iov[0].iov_len -= fet->tx_pos;
 
-		if( s == G_IO_STATUS_ERROR )
-			g_error( "Error writing to file: %s", error->message );
+		w = writev( fd, iov, n );
 
-		g_assert( s == G_IO_STATUS_NORMAL );
+		if( w < 0 ) {
+			if( errno == EAGAIN || errno == EINTR )
+				break;
 
-		if( w == 0 ) continue;
+			g_warning( "Error writing to the FET: %m" );
 
-		if( inc )
-			fet->tx_pos += w;
+			/* This source is going anyway */
+			fet->out_watch = 0;
+			fet_link_lost( fet );
+			return FALSE;
+		}
 
 		fet->bytes_tx += w;
 
-		/* check for end of frame */
-		if( frame->len + 4 == fet->tx_pos )
+		/* Remove the frames that have been completely written */
+		while( w > 0 )
 		{
-			fet_module_out_queue_del( fet );
+			uint16_t rem = fet->out_head->wire_len - fet->tx_pos;
+
+			if( w < rem ) {
+				fet->tx_pos += w;
+				break;
+			}
+
+			w -= rem;
+			fet_module_out_queue_sent( fet );
 			fet->frames_tx ++;
-			fet->tx_pos = fet->o_chk = 0;
-			fet->checked = FALSE;
+			fet->tx_pos = 0;
 
 			fet_module_print_stats( fet );
 		}
+
+		/* The tty's full */
+		if( fet->tx_pos != 0 )
+			break;
 	}
 
 	if( !fet_module_outgoing_queued(fet) ) {
-		fet->mon_write = FALSE;
+		fet->out_watch = 0;
 		return FALSE; 
 	}
 
@@ -183,7 +256,7 @@ static gboolean fet_module_outgoing_queued( FetModule* fet )
 {
 	assert( fet != NULL );
 
-	if( g_queue_get_length(fet->out_frames) )
+	if( fet->out_head != NULL )
 		return TRUE;
 	else
 		return FALSE;
@@ -191,62 +264,274 @@ static gboolean fet_module_outgoing_queued( FetModule* fet )
 
 static void fet_module_out_queue_add_frame( FetModule* fet, fet_frame_t* frame )
 {
+	fet_frame_t **pp;
 	assert( fet != NULL && frame != NULL );
 
-	g_queue_push_head( fet->out_frames, frame );
+	/* Nothing but the commands that set the FET up again can go out
+	 * until the link's back */
+	if( fet->link_state != FET_LINK_UP && !fet->link_setup ) {
+		frame->next = NULL;
+		if( fet->held_tail != NULL )
+			fet->held_tail->next = frame;
+		else
+			fet->held_head = frame;
+		fet->held_tail = frame;
+		return;
+	}
+
+	if( frame->prio == FET_PRIO_URGENT ) {
+		/* Go ahead of everything but the frame that's part way out,
+		 * and any other urgent frames */
+		pp = &fet->out_head;
+		if( *pp != NULL && fet->tx_pos != 0 )
+			pp = &(*pp)->next;
+		while( *pp != NULL && (*pp)->prio == FET_PRIO_URGENT )
+			pp = &(*pp)->next;
+	} else
+		pp = fet->out_tail != NULL ? &fet->out_tail->next : &fet->out_head;
+
+	frame->next = *pp;
+	*pp = frame;
+	if( frame->next == NULL )
+		fet->out_tail = frame;
+
+	if( fet->out_watch == 0 && fet->ioc != NULL )
+		fet->out_watch = fet_module_watch_add( fet, G_IO_OUT,
+						       fet_module_proc_outgoing );
+}
+
+void fet_module_cancel_bulk( FetModule* fet )
+{
+	fet_frame_t **pp, *f, *cancelled = NULL, **ctail = &cancelled;
+	assert( fet != NULL );
+
+	/* The frame that's part way out has to finish */
+	pp = &fet->out_head;
+	if( *pp != NULL && fet->tx_pos != 0 )
+		pp = &(*pp)->next;
+
+	fet->out_tail = NULL;
+	while( *pp != NULL ) {
+		f = *pp;
+
+		if( f->prio == FET_PRIO_BULK ) {
+			*pp = f->next;
+			f->next = NULL;
+			*ctail = f;
+			ctail = &f->next;
+		} else
+			pp = &f->next;
+	}
+
+	/* Find the new tail */
+	for( f = fet->out_head; f != NULL; f = f->next )
+		fet->out_tail = f;
+
+	/* Only tell their owners once the queue's consistent, as they
+	 * might queue more */
+	while( cancelled != NULL ) {
+		fet_reply_cb_t cb;
+		gpointer userdata;
 
-	if( !fet->mon_write ) {
-		g_io_add_watch( fet->ioc, G_IO_OUT, fet_module_proc_outgoing, fet );
-		fet->mon_write = TRUE;
+		f = cancelled;
+		cancelled = f->next;
+
+		cb = f->cb;
+		userdata = f->userdata;
+		fet_module_frame_free( fet, f );
+
+		if( cb != NULL )
+			cb( fet, FET_REPLY_CANCELLED, NULL, userdata );
 	}
 }
 
-static void fet_module_out_queue_del( FetModule* fet )
+static void fet_module_out_queue_sent( FetModule* fet )
+{
+	fet_frame_t *frame;
+	assert( fet != NULL && fet->out_head != NULL );
+
+	frame = fet->out_head;
+
+	fet->out_head = frame->next;
+	if( fet->out_head == NULL )
+		fet->out_tail = NULL;
+
+	/* The frame's now on the wire, so its reply could arrive at any time */
+	frame->next = NULL;
+	if( fet->wait_tail != NULL )
+		fet->wait_tail->next = frame;
+	else
+		fet->wait_head = frame;
+	fet->wait_tail = frame;
+
+	fet_module_reply_timer_start( fet );
+}
+
+static void fet_module_wait_queue_complete( FetModule* fet,
+					    fet_reply_status_t status,
+					    const fet_reply_t *reply )
 {
 	fet_frame_t *frame;
+	fet_reply_cb_t cb;
+	gpointer userdata;
+	assert( fet != NULL && fet->wait_head != NULL );
+
+	frame = fet->wait_head;
+
+	fet->wait_head = frame->next;
+	if( fet->wait_head == NULL )
+		fet->wait_tail = NULL;
+
+	/* The next reply gets its own full timeout */
+	fet_module_reply_timer_stop( fet );
+	fet_module_reply_timer_start( fet );
+
+	/* Free the frame before calling back, so that the callback can
+	 * reuse it for the next command */
+	cb = frame->cb;
+	userdata = frame->userdata;
+	fet_module_frame_free( fet, frame );
+
+	if( cb != NULL )
+		cb( fet, status, reply, userdata );
+}
+
+static void fet_module_reply_timer_start( FetModule* fet )
+{
+	assert( fet != NULL );
+
+	if( fet->reply_timer != 0 || fet->wait_head == NULL )
+		return;
+
+	fet->reply_timer = fet_module_timeout_add( fet, fet->wait_head->timeout,
+						   fet_module_reply_timeout, fet );
+}
+
+static void fet_module_reply_timer_stop( FetModule* fet )
+{
 	assert( fet != NULL );
 
-	frame = (fet_frame_t*)g_queue_peek_tail( fet->out_frames );
+	if( fet->reply_timer == 0 )
+		return;
+
+	fet_module_source_remove( fet, fet->reply_timer );
+	fet->reply_timer = 0;
+}
+
+static gboolean fet_module_reply_timeout( gpointer _fet )
+{
+	FetModule *fet = (FetModule*)_fet;
+	assert( fet != NULL && fet->wait_head != NULL );
+
+	/* This source is finished with */
+	fet->reply_timer = 0;
 
-	/* Free the data */
-	g_free( frame->data );
-	frame->data = NULL;
+	g_warning( "FET didn't reply to command 0x%2.2x", fet->wait_head->data[0] );
+	fet->replies_timedout ++;
 
-	/* Free the element */
-	g_free( frame );
+	fet_module_wait_queue_complete( fet, FET_REPLY_TIMEOUT, NULL );
 
-	g_queue_pop_tail( fet->out_frames );
+	return FALSE;
 }
 
-int fet_module_transmit( FetModule* fet, const void* buf, uint8_t len )
+fet_frame_t* fet_module_frame_alloc( FetModule* fet )
 {
 	fet_frame_t *frame;
-	assert( fet != NULL && buf != NULL );
+	assert( fet != NULL );
 
-	printf("Out: ");
-	debug_show_data( buf, len );
-	printf("\n");
+	frame = fet->frame_free;
+	if( frame == NULL )
+		return NULL;
 
-	frame = g_malloc( sizeof(fet_frame_t) );
+	fet->frame_free = frame->next;
 
-	/* Allocate memory for the data and it's sentinel and checksum */
-	frame->data = g_malloc( len );
-	assert( frame->data != NULL );
-	g_memmove( frame->data, buf, len );
+	frame->next = NULL;
+	frame->len = 0;
 
-	frame->len = len;
+	frame->prio = FET_PRIO_NORMAL;
+	frame->reply_type = FET_TYPE_ACK;
+	frame->timeout = FET_REPLY_TIMEOUT_MS;
+	frame->cb = NULL;
+	frame->userdata = NULL;
+	return frame;
+}
+
+void fet_module_frame_free( FetModule* fet, fet_frame_t* frame )
+{
+	assert( fet != NULL && frame != NULL );
+
+	frame->next = fet->frame_free;
+	fet->frame_free = frame;
+}
+
+int fet_module_frame_transmit( FetModule* fet, fet_frame_t* frame )
+{
+	assert( fet != NULL && frame != NULL );
+	assert( frame->len > 0 && frame->len <= fet->max_payload );
+
+	debug_show_frame( "Out", frame->data, frame->len );
+
+	frame->wire_len = fet_module_frame_encode( frame->data, frame->len, frame->wire );
+	frame->wire_ptr = frame->wire;
+
+	fet_module_out_queue_add_frame( fet, frame );
+
+	return 0;
+}
+
+int fet_module_frame_transmit_encoded( FetModule* fet, fet_frame_t* frame )
+{
+	assert( fet != NULL && frame != NULL );
+	assert( frame->len > 0 && frame->len <= fet->max_payload );
+	assert( frame->wire_ptr != NULL && frame->wire_len > 0 );
 
 	fet_module_out_queue_add_frame( fet, frame );
 
 	return 0;
 }
 
+int fet_module_transmit( FetModule* fet, const void* buf, uint16_t len,
+			 uint8_t reply_type, fet_reply_cb_t cb, gpointer userdata )
+{
+	fet_frame_t *frame;
+	assert( fet != NULL && buf != NULL && len <= fet->max_payload );
+
+	frame = fet_module_frame_alloc( fet );
+	if( frame == NULL ) {
+		g_warning( "FET frame pool exhausted -- dropping frame" );
+		return -1;
+	}
+
+	memcpy( frame->data, buf, len );
+	frame->len = len;
+
+	frame->reply_type = reply_type;
+	frame->cb = cb;
+	frame->userdata = userdata;
+
+	return fet_module_frame_transmit( fet, frame );
+}
+
+void fet_module_set_max_payload( FetModule* fet, uint16_t len )
+{
+	assert( fet != NULL );
+	assert( len >= FET_PAYLOAD_MIN && len <= FET_OUTBUF_LEN );
+
+	fet->max_payload = len;
+}
+
+uint16_t fet_module_get_max_payload( FetModule* fet )
+{
+	assert( fet != NULL );
+
+	return fet->max_payload;
+}
+
 static void fet_module_print_stats( FetModule* fet )
 {
 	assert( fet != NULL );
-	return;
 
-	printf( "\rFrames: %6lu IN, %6lu OUT. Bytes: %9lu IN, %9lu OUT",
+	g_debug( "Frames: %6lu IN, %6lu OUT. Bytes: %9lu IN, %9lu OUT",
 		(long unsigned int)fet->frames_rx, 
 		(long unsigned int)fet->frames_tx, 
 		(long unsigned int)fet->bytes_rx, 
@@ -257,56 +542,174 @@ void fet_free( FetModule* fet )
 {
 	assert( fet != NULL );
 
-	while( g_queue_get_length( fet->out_frames ) > 0 )
-	{
-		fet_frame_t *f = (fet_frame_t*)g_queue_peek_tail(fet->out_frames);
-		g_free( f->data );
-		g_free( f );
-		g_queue_pop_tail( fet->out_frames );
-	}
+	fet_module_reply_timer_stop( fet );
+
+	fet->out_head = fet->out_tail = NULL;
+	fet->wait_head = fet->wait_tail = NULL;
+	fet->frame_free = NULL;
+
+	g_free( fet->frame_pool );
+	fet->frame_pool = NULL;
+
+	fet_link_free( fet );
+	fet_poll_free( fet );
+	fet_cache_free( fet );
 
-	g_queue_free( fet->out_frames );
-	fet->out_frames = NULL;
+	if( fet->context != NULL ) {
+		g_main_context_unref( fet->context );
+		fet->context = NULL;
+	}
 }
 
 FetModule* fet_module_open( char* fname, GMainContext *context )
 {
 	FetModule *fet = NULL;
-	const serial_settings_t settings =
-	{
-		.baud = 460800,
-		.parity = PARITY_NONE,
-		.stop_bits = 1,
-		.flow_control = FLOW_NONE
-	};
 	assert( fname != NULL );
 
 	fet = g_object_new( FET_MODULE_TYPE, NULL  );
+	fet->dev_name = g_strdup( fname );
+	if( context != NULL )
+		fet->context = g_main_context_ref( context );
 
 	/* Open the serial device */
-	fet->serial = serial_conn_open( fname, &settings );
+	if( !fet_module_serial_open( fet ) ) {
+		fet_module_close( fet );
+		return NULL;
+	}
+
+	return fet;
+}
 
+guint fet_module_timeout_add( FetModule *fet, guint ms,
+			      GSourceFunc func, gpointer data )
+{
+	GSource *src;
+	guint id;
+	assert( fet != NULL && func != NULL );
+
+	src = g_timeout_source_new( ms );
+	g_source_set_callback( src, func, data, NULL );
+	id = g_source_attach( src, fet->context );
+	g_source_unref( src );
+
+	return id;
+}
+
+void fet_module_source_remove( FetModule *fet, guint id )
+{
+	GSource *src;
+	assert( fet != NULL && id != 0 );
+
+	src = g_main_context_find_source_by_id( fet->context, id );
+	if( src != NULL )
+		g_source_destroy( src );
+}
+
+static guint fet_module_watch_add( FetModule *fet, GIOCondition cond, GIOFunc func )
+{
+	GSource *src;
+	guint id;
+
+	src = g_io_create_watch( fet->ioc, cond );
+	g_source_set_callback( src, (GSourceFunc)func, fet, NULL );
+	id = g_source_attach( src, fet->context );
+	g_source_unref( src );
+
+	return id;
+}
+
+gboolean fet_module_serial_open( FetModule *fet )
+{
+	assert( fet != NULL && fet->serial == NULL );
+
+	fet->serial = serial_conn_open( fet->dev_name, &fet_serial_settings );
 	if( fet->serial == NULL )
-		g_error( "Failed to open serial... TODO: more error info :-/\n" );
+		return FALSE;
 
 	fet->ioc = serial_conn_get_io_channel( fet->serial );
 
-	g_io_add_watch( fet->ioc, G_IO_IN, fet_module_proc_incoming, fet );
+	fet->in_watch = fet_module_watch_add( fet, G_IO_IN,
+					      fet_module_proc_incoming );
 
-	g_io_add_watch( fet->ioc, G_IO_OUT, fet_module_proc_outgoing, fet );
-	fet->mon_write = TRUE;
+	if( fet_module_outgoing_queued( fet ) )
+		fet->out_watch = fet_module_watch_add( fet, G_IO_OUT,
+						       fet_module_proc_outgoing );
 
-	g_io_add_watch( fet->ioc, G_IO_ERR | G_IO_HUP | G_IO_NVAL,
-			fet_module_io_error, fet );
+	fet->err_watch = fet_module_watch_add( fet, G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+					       fet_module_io_error );
 
-	return fet;
+	return TRUE;
+}
+
+void fet_module_serial_close( FetModule *fet, gboolean hold )
+{
+	assert( fet != NULL );
+
+	if( fet->in_watch != 0 )
+		fet_module_source_remove( fet, fet->in_watch );
+	if( fet->out_watch != 0 )
+		fet_module_source_remove( fet, fet->out_watch );
+	if( fet->err_watch != 0 )
+		fet_module_source_remove( fet, fet->err_watch );
+	fet->in_watch = fet->out_watch = fet->err_watch = 0;
+
+	if( fet->serial != NULL ) {
+		serial_conn_close( fet->serial );
+		fet->serial = NULL;
+		fet->ioc = NULL;
+	}
+
+	/* The frame that was part way out isn't going to be answered */
+	if( fet->out_head != NULL && fet->tx_pos != 0 )
+		fet_module_out_queue_sent( fet );
+	fet->tx_pos = 0;
+
+	/* Otherwise the rest aren't going anywhere either */
+	if( !hold )
+		while( fet->out_head != NULL )
+			fet_module_out_queue_sent( fet );
+
+	/* The rest go out once the link's back, ahead of anything that's
+	 * been held already */
+	if( fet->out_head != NULL ) {
+		fet->out_tail->next = fet->held_head;
+		if( fet->held_tail == NULL )
+			fet->held_tail = fet->out_tail;
+		fet->held_head = fet->out_head;
+		fet->out_head = fet->out_tail = NULL;
+	}
+
+	/* Anything that had arrived is from before */
+	fet->rx_head = fet->rx_tail = 0;
+	fet->rx_crc = crc_init();
+	fet->rx_crc_len = 0;
+
+	/* Their callbacks may queue more, which are held */
+	while( fet->wait_head != NULL )
+		fet_module_wait_queue_complete( fet, FET_REPLY_ERROR, NULL );
+}
+
+void fet_module_release_held( FetModule *fet )
+{
+	fet_frame_t *frame;
+	assert( fet != NULL && fet->link_state == FET_LINK_UP );
+
+	while( fet->held_head != NULL ) {
+		frame = fet->held_head;
+
+		fet->held_head = frame->next;
+		if( fet->held_head == NULL )
+			fet->held_tail = NULL;
+
+		fet_module_out_queue_add_frame( fet, frame );
+	}
 }
 
 void fet_module_close( FetModule* fet )
 {
 	assert( fet != NULL );
 
-	printf( "TODO: Close fd etc...\n" );
+	fet_module_serial_close( fet, FALSE );
 
 	fet_free( fet );
 
@@ -338,96 +741,229 @@ GType fet_module_get_type( void )
 void fet_instance_init( GTypeInstance *gti, gpointer g_class )
 {
 	FetModule *fet = (FetModule*)gti;
+	uint16_t i;
 
+	fet->context = NULL;
 	fet->serial = NULL;
-	fet->mon_write = FALSE;
 	fet->ioc = NULL;
-	fet->out_frames = g_queue_new();
-
-	fet->in_len = 0;
+	fet->in_watch = fet->out_watch = fet->err_watch = 0;
+	/* Put all the frames in the pool on the free list */
+	fet->frame_pool = g_new( fet_frame_t, FET_FRAME_POOL_LEN );
+	fet->frame_free = NULL;
+	for( i=0; i<FET_FRAME_POOL_LEN; i++ )
+		fet_module_frame_free( fet, fet->frame_pool + i );
+	fet->out_head = fet->out_tail = NULL;
+	fet->wait_head = fet->wait_tail = NULL;
+	fet->reply_timer = 0;
+	fet->max_payload = FET_PAYLOAD_DEFAULT;
+	fet->identified = FALSE;
+
+	fet_cache_init( fet );
+
+	fet->rx_head = fet->rx_tail = 0;
+	fet->rx_crc = crc_init();
+	fet->rx_crc_len = 0;
 
 	fet->bytes_discarded = 0;
 	fet->frames_discarded = 0;
 	fet->bytes_rx = fet->bytes_tx = 0;
 	fet->frames_rx = fet->frames_tx = 0;
+	fet->frames_unmatched = 0;
+	fet->frames_undecoded = 0;
+	fet->replies_timedout = 0;
 
-	fet->o_chk = fet->tx_pos = 0;
-	fet->checked = FALSE;
-	fet->tx_escaped = FALSE;
+	fet->tx_pos = 0;
+
+	fet->gdbclient_userdata = NULL;
+	fet->gdb_stop_userdata = NULL;
+	fet_poll_init( fet );
+	fet_link_init( fet );
 }
 
 gboolean fet_module_proc_incoming( GIOChannel *source, GIOCondition condition,
 				   gpointer _fet )
 {
 	FetModule *fet = (FetModule*)_fet;
+	uint8_t *d;
+	uint16_t flen;
+	int r;
 	assert( fet != NULL );
 
-	printf( "INCOMING\n" );
-	while( fet_module_read_frame( fet ) == 0 )
+	while( (r = fet_module_read_frame( fet, &d, &flen )) == 0 )
 	{
-		uint16_t flen = ( ((uint16_t)fet->inbuf[1]) << 8 | fet->inbuf[0] ) - 2;
-		uint8_t *d = fet->inbuf + 2;
+		debug_show_frame( "In", d, flen );
 
-		printf( "In: " );
-		debug_show_data( fet->inbuf + 2, flen );
-		printf("\n");
+		fet_module_reply_dispatch( fet, d, flen );
+	}
 
-		if( flen < 4 )
-			continue;
+	if( r < 0 ) {
+		/* This source is going anyway */
+		fet->in_watch = 0;
+		fet_link_lost( fet );
+		return FALSE;
+	}
 
-		/* Some sort of ACK to the continue command */
-		if( d[0] == 0x11 && d[1] == 0x00 && d[2] == 0x00 && d[3] == 0x00 ) {
-			gdb_client_command_complete( &fet->target_state,
-						     fet->gdbclient_userdata );
-			continue;
-		}
+	return TRUE;
+}
 
-		if( flen < 8 )
-			/* Ignore the frame for the moment */
-			continue;
+static void fet_module_reply_dispatch( FetModule* fet, const uint8_t *d, uint16_t len )
+{
+	fet_frame_t *frame;
+	fet_reply_t reply;
+	fet_reply_kind_t kind;
+	fet_reply_status_t status;
+	assert( fet != NULL && d != NULL );
+
+	if( len < 4 ) {
+		g_warning( "Discarding %hu byte reply -- too short", len );
+		fet->frames_unmatched ++;
+		return;
+	}
 
-		if( d[0] == 0x08 && d[1] == 0x03 && d[2] == 0x00 && d[3] == 0x00
-		    && d[4] == 0x40 && d[5] == 0x00 && d[6] == 0x00 && d[7] == 0x00 ) {
-			if( flen < 72 ) {
-				g_debug( "Thing with header that looks like registers, but not long enough" );
-				continue;
-			}
+	kind = fet_reply_decode( &reply, d, len );
 
-			/* Go through the data */
-			uint8_t i;
-			uint8_t *p;
-			for( i=0, p=d+8; i<16; i++, p+=4 )
-				fet->target_state.reg[i] = ((uint16_t)*p) | ((uint16_t)(*(p+1)));
+	if( kind == FET_REPLY_KIND_UNKNOWN || kind == FET_REPLY_KIND_MALFORMED ) {
+		g_warning( "Couldn't decode reply to command 0x%2.2x (type 0x%2.2x)",
+			   reply.cmd, reply.type );
+		fet->frames_undecoded ++;
+	}
 
-			gdb_client_command_complete( &fet->target_state,
-						     fet->gdbclient_userdata );
-		}
+	/* The FET answers commands in order, so the reply belongs to the
+	 * oldest command with a matching code */
+	for( frame = fet->wait_head; frame != NULL; frame = frame->next )
+		if( frame->data[0] == reply.cmd )
+			break;
 
+	if( frame == NULL ) {
+		g_warning( "Unsolicited reply to command 0x%2.2x", reply.cmd );
+		fet->frames_unmatched ++;
+		return;
+	}
 
+	/* Any commands sent before it aren't going to get a reply */
+	while( fet->wait_head != frame ) {
+		g_warning( "FET skipped command 0x%2.2x", fet->wait_head->data[0] );
+		fet->replies_timedout ++;
+		fet_module_wait_queue_complete( fet, FET_REPLY_TIMEOUT, NULL );
+	}
 
+	if( kind == FET_REPLY_KIND_ERROR ) {
+		g_warning( "FET error in reply to command 0x%2.2x: %s",
+			   reply.cmd, reply.u.error.msg );
+		status = FET_REPLY_ERROR;
+	} else if( kind == FET_REPLY_KIND_MALFORMED )
+		status = FET_REPLY_ERROR;
+	else if( frame->reply_type == FET_TYPE_ANY
+		 || frame->reply_type == reply.type
+		 || ( frame->reply_type == FET_TYPE_ACK
+		      && reply.type == FET_TYPE_FLASH_ACK ) )
+		status = FET_REPLY_OK;
+	else {
+		g_warning( "Reply to command 0x%2.2x has type 0x%2.2x, not 0x%2.2x",
+			   reply.cmd, reply.type, frame->reply_type );
+		status = FET_REPLY_ERROR;
 	}
 
-	return TRUE;
+	fet_module_wait_queue_complete( fet, status, &reply );
 }
 
 /* Reads in available bytes from the input.
  * When a full frame is achieved, it returns 0.
  * When a full frame has not been acheived, it returns 1.
  * When an error occurs, it returns -1 */
-int fet_module_read_frame( FetModule* fet )
+int fet_module_read_frame( FetModule* fet, uint8_t **frame, uint16_t *len )
+{
+	assert( fet != NULL && frame != NULL && len != NULL );
+
+	while( 1 )
+	{
+		uint32_t avail = fet->rx_head - fet->rx_tail;
+		int r;
+
+		/* Only go to the serial port when the ring doesn't hold a whole frame */
+		if( avail >= 2 )
+		{
+			uint8_t *f = fet_module_rx_linear( fet, fet->rx_tail, 2 );
+			uint16_t flen = ((uint16_t)f[1]) << 8 | f[0];
+
+			/* FIXME:  At the moment, this assumes that we don't miss any bytes from
+			   the FET tool.  This should be changed. */
+			if( flen < 2 || flen + 2 > FET_RX_RING_LEN )
+			{
+				fprintf( stderr, "Warning: Incoming frame too long - discarding\n" );
+				fet->bytes_discarded += avail;
+				fet->rx_tail = fet->rx_head;
+				fet->rx_crc = crc_init();
+				fet->rx_crc_len = 0;
+				continue;
+			}
+
+			/* Fold whatever's arrived of the payload into the checksum */
+			fet_module_rx_crc_fold( fet,
+						fet->rx_tail + 2 + fet->rx_crc_len,
+						fet->rx_tail + MIN( avail, flen ) );
+
+			if( avail >= flen + 2 )
+			{
+				uint16_t chk, calc;
+
+				f = fet_module_rx_linear( fet, fet->rx_tail, flen + 2 );
+				fet->rx_tail += flen + 2;
+
+				chk = ((uint16_t)f[flen+1]) << 8 | f[flen];
+				calc = crc_final( fet->rx_crc );
+
+				/* Start afresh for the next frame */
+				fet->rx_crc = crc_init();
+				fet->rx_crc_len = 0;
+
+				if( calc != chk ) {
+					g_warning( "Checksum incorrect (%4.4hx received, %4.4hx calculated) - discarding frame",
+						   chk, calc );
+
+					fet->frames_discarded ++;
+					fet->bytes_discarded += flen + 2;
+					continue;
+				}
+
+				*frame = f + 2;
+				*len = flen - 2;
+
+				fet->frames_rx++;
+				return 0;	/* Whole frame */
+			}
+		}
+
+		r = fet_module_rx_fill( fet );
+		if( r < 0 )
+			return -1;
+
+		if( r == 0 )
+			return 1;	/* Not a whole frame yet */
+	}
+}
+
+static int fet_module_rx_fill( FetModule* fet )
 {
-	gboolean whole_frame = FALSE;
 	GIOChannel *ioc;
-	assert( fet != NULL && fet->in_len < FET_INBUF_LEN );
+	int total = 0;
+	assert( fet != NULL );
 
-	ioc = serial_conn_get_io_channel( fet->serial );
+	ioc = fet->ioc;
 
-	while( !whole_frame )
+	while( fet->rx_head - fet->rx_tail < FET_RX_RING_LEN )
 	{
-		uint8_t d;
+		uint32_t off = fet->rx_head & (FET_RX_RING_LEN - 1);
+		gsize space = FET_RX_RING_LEN - (fet->rx_head - fet->rx_tail);
 		gsize r;
 		GError *error = NULL;
-		GIOStatus s = g_io_channel_read_chars( ioc, (char*)&d, 1, &r, &error );
+		GIOStatus s;
+
+		/* Only read up to the end of the ring */
+		if( space > FET_RX_RING_LEN - off )
+			space = FET_RX_RING_LEN - off;
+
+		s = g_io_channel_read_chars( ioc, (gchar*)fet->rx_ring + off, space, &r, &error );
 
 		if( s == G_IO_STATUS_AGAIN )
 			break;
@@ -436,123 +972,512 @@ int fet_module_read_frame( FetModule* fet )
 		if( s == G_IO_STATUS_EOF )
 			break;
 
-		if( s == G_IO_STATUS_ERROR )
-			g_error( "Failed to read input: %s", error->message );
+		if( s == G_IO_STATUS_ERROR ) {
+			g_warning( "Error reading from the FET: %s", error->message );
+			g_error_free( error );
+			return -1;
+		}
 
 		g_assert( s == G_IO_STATUS_NORMAL );
 
 		/* Serial devices can return 0 - but doesn't mean EOF */
 		if( r == 0 ) break;
 
-		fet->bytes_rx ++;
+		fet->rx_head += r;
+		fet->bytes_rx += r;
+		total += r;
 
-		/* FIXME:  At the moment, this assumes that we don't miss any bytes from 
-		   the FET tool.  This should be changed. */
+		/* A short read means that there's nothing more waiting */
+		if( r < space )
+			break;
+	}
 
-		/* Make sure we don't overflow the buffer */
-		if( fet->in_len >= FET_INBUF_LEN )
-		{
-			fprintf( stderr, "Warning: Incoming frame too long - discarding\n" );
-			fet->bytes_discarded += fet->in_len;
-			fet->in_len = 0;
-		}
-		
-		fet->inbuf[ fet->in_len ] = d;
-		fet->in_len ++;
+	return total;
+}
+
+static void fet_module_rx_crc_fold( FetModule* fet, uint32_t from, uint32_t to )
+{
+	assert( fet != NULL );
 
+	while( (int32_t)(to - from) > 0 )
+	{
+		uint32_t off = from & (FET_RX_RING_LEN - 1);
+		uint32_t n = to - from;
 
-		if( fet->in_len >= 2 )
-		{
-			uint16_t flen = ((uint16_t)fet->inbuf[1]) << 8 | fet->inbuf[0];
+		/* Don't run off the end of the ring */
+		if( n > FET_RX_RING_LEN - off )
+			n = FET_RX_RING_LEN - off;
 
-			if( fet->in_len >= (flen + 2) )
-			{
-				uint16_t chk = ((uint16_t)fet->inbuf[flen+1]) << 8 | fet->inbuf[flen];
-				uint16_t calc = crc_block( fet->inbuf + 2, flen - 2 );
-
-/* 				printf( "Checksumming: " ); */
-/* 				debug_show_data( fet->inbuf + 2, flen - 2 ); */
-/* 				printf ("\n"); */
-				if( calc == chk )
-					whole_frame = TRUE;
-				else {
-					g_error( "FAIL: Checksum incorrect (%4.4hx received, %4.4hx calculated)", chk, calc );
-					memmove( fet->inbuf, 
-						 fet->inbuf + flen + 2, 
-						 fet->in_len - (flen + 2 ) );
-
-					printf( "Checksum invalid\n" );
+		fet->rx_crc = crc_update( fet->rx_crc, fet->rx_ring + off, n );
+		fet->rx_crc_len += n;
+		from += n;
+	}
+}
 
-					fet->frames_discarded ++;
+static uint8_t* fet_module_rx_linear( FetModule* fet, uint32_t pos, uint16_t len )
+{
+	uint32_t off = pos & (FET_RX_RING_LEN - 1);
+	uint32_t first;
+	assert( fet != NULL && len <= FET_RX_RING_LEN );
 
-					/* Discard current data */
-					fet->bytes_discarded += fet->in_len;
-					fet->in_len -= flen + 2;
-				}
+	if( off + len <= FET_RX_RING_LEN )
+		return fet->rx_ring + off;
 
-				fet->in_len = 0;
-			}
-		}
+	/* The data wraps around the end of the ring */
+	first = FET_RX_RING_LEN - off;
+	memcpy( fet->rx_frame, fet->rx_ring + off, first );
+	memcpy( fet->rx_frame + first, fet->rx_ring, len - first );
+
+	return fet->rx_frame;
+}
+
+static void debug_show_frame( const char *dir, const uint8_t* buf, uint16_t len )
+{
+	GString *s;
+	uint16_t i;
+
+	s = g_string_sized_new( 3 * len );
+
+	for( i=0 ; i < len; i++ )
+	{
+		g_string_append_printf( s, " %2.2X", (unsigned int)buf[i] );
 	}
 
-	if( !whole_frame )
-		return 1;	/* Not a whole frame yet */
+	g_debug( "%s:%s", dir, s->str );
+	g_string_free( s, TRUE );
+}
+
+gboolean fet_module_io_error( GIOChannel *source, GIOCondition condition,
+			      gpointer _fet )
+{
+	FetModule *fet = (FetModule*)_fet;
+	assert( fet != NULL );
+
+	g_warning( "The FET's serial device has gone away" );
 
-	fet->frames_rx++;
-	return 0;	/* Whole frame */
+	/* This source is going anyway */
+	fet->err_watch = 0;
+	fet_link_lost( fet );
+	return FALSE;
 }
 
-void debug_show_frame( uint8_t* buf, uint16_t len )
+/* Halt listener for the GdbClient */
+static void fet_module_gdb_halted( FetModule *fet, gpointer userdata );
+
+void fet_module_gdbclient_init( gpointer gdbc, gpointer _fet )
 {
-	printf("IN: ");
-	debug_show_data( buf, len );
-	printf("\n");
+	FetModule *fet = (FetModule*)_fet;
+
+	fet->gdbclient_userdata = gdbc;
+
+	fet_poll_remove_listener( fet, fet_module_gdb_halted, NULL );
+	fet_poll_add_listener( fet, fet_module_gdb_halted, NULL );
 }
 
-static void debug_show_data( const uint8_t* buf, uint16_t len )
+/* Take the registers from a context read into the register cache,
+ * keeping any that gdb has changed since.
+ * Returns FALSE if the read failed. */
+static gboolean fet_module_gdb_regs_merge( FetModule *fet,
+					   fet_reply_status_t status,
+					   const fet_reply_t *reply )
 {
-	uint16_t i;
+	gdb_client_info_t *st = &fet->target_state;
+	uint8_t i;
 
-	for( i=0 ; i < len; i++ )
-	{
-		printf( "%2.2X ", (unsigned int)buf[i] );
+	if( status != FET_REPLY_OK || reply->kind != FET_REPLY_KIND_CONTEXT ) {
+		g_warning( "Failed to read registers" );
+		return FALSE;
 	}
+
+	for( i=0; i<16; i++ )
+		if( !(st->reg_dirty & (1 << i)) )
+			st->reg[i] = reply->u.context.reg[i];
+
+	st->reg_valid = 0xffff;
+	return TRUE;
 }
 
-static gboolean fet_module_outgoing_escape_byte( FetModule* fet, uint8_t *d )
+/* Called with the reply to a register read on behalf of the GdbClient */
+static void fet_module_gdb_registers_read( FetModule *fet,
+					   fet_reply_status_t status,
+					   const fet_reply_t *reply,
+					   gpointer userdata )
 {
-	fet_frame_t *frame;
 	assert( fet != NULL );
-	frame = (fet_frame_t*)g_queue_peek_tail( fet->out_frames );
 
-	if( fet->tx_pos != 0 && fet->tx_pos != frame->len + 3
-	    && ( *d == 0x7E || *d == 0x7D ) )
-	{
-		if( !fet->tx_escaped ) {
-			*d = 0x7D;
-			fet->tx_escaped = TRUE;
-			return FALSE;
-		} else {
-			*d ^= 0x20;
-			fet->tx_escaped = FALSE;
-			return TRUE;
+	if( fet_module_gdb_regs_merge( fet, status, reply ) )
+		gdb_client_command_complete( &fet->target_state,
+					     fet->gdbclient_userdata );
+	else
+		/* EIO */
+		gdb_client_command_error( 0x05, fet->gdbclient_userdata );
+}
+
+/* Called with the reply to writing back the register cache */
+static void fet_module_gdb_registers_written( FetModule *fet,
+					      fet_reply_status_t status,
+					      const fet_reply_t *reply,
+					      gpointer userdata )
+{
+	if( status != FET_REPLY_OK )
+		g_warning( "Failed to write registers" );
+}
+
+/* Write back any registers that gdb has changed, then set the target
+ * running, or step it */
+static void fet_module_gdb_resume( FetModule *fet, gboolean step );
+
+/* Called with the registers that were missing from the cache when
+ * writing it back */
+static void fet_module_gdb_registers_fetched( FetModule *fet,
+					      fet_reply_status_t status,
+					      const fet_reply_t *reply,
+					      gpointer _step )
+{
+	assert( fet != NULL );
+
+	if( fet_module_gdb_regs_merge( fet, status, reply ) )
+		fet_module_gdb_resume( fet, GPOINTER_TO_INT(_step) );
+	else
+		/* EIO */
+		gdb_client_command_error( 0x05, fet->gdbclient_userdata );
+}
+
+static void fet_module_gdb_halted( FetModule *fet, gpointer userdata )
+{
+	gpointer cli = fet->gdb_stop_userdata;
+	assert( fet != NULL );
+
+	/* The target may have been set running by something other than gdb */
+	if( cli == NULL )
+		return;
+	fet->gdb_stop_userdata = NULL;
+
+	if( fet->target_state.reg_valid == 0xffff )
+		gdb_client_command_complete( &fet->target_state, cli );
+	else
+		/* EIO */
+		gdb_client_command_error( 0x05, cli );
+}
+
+/* Called with the reply to a run command on behalf of the GdbClient */
+static void fet_module_gdb_running( FetModule *fet,
+				    fet_reply_status_t status,
+				    const fet_reply_t *reply,
+				    gpointer userdata )
+{
+	gpointer cli = fet->gdb_stop_userdata;
+	assert( fet != NULL );
+
+	if( status != FET_REPLY_OK ) {
+		g_warning( "Failed to set the target running" );
+		fet_poll_stop( fet );
+
+		/* gdb may have gone in the meantime */
+		if( cli == NULL )
+			return;
+		fet->gdb_stop_userdata = NULL;
+
+		/* EIO */
+		gdb_client_command_error( 0x05, cli );
+		return;
+	}
+
+	/* gdb gets its stop reply when the target halts.  Until then,
+	 * the target can get on with other clients' commands. */
+	if( cli != NULL )
+		gdb_client_command_running( cli );
+}
+
+/* Called with the reply to a step command on behalf of the GdbClient */
+static void fet_module_gdb_stepped( FetModule *fet,
+				    fet_reply_status_t status,
+				    const fet_reply_t *reply,
+				    gpointer userdata )
+{
+	/* The context read that follows the step completes the command */
+	if( status != FET_REPLY_OK )
+		g_warning( "Failed to step the target" );
+}
+
+/* Called when a memory write has finished on behalf of the GdbClient */
+static void fet_module_gdb_mem_written( fet_download_t *dl,
+					gboolean ok,
+					gpointer _ext )
+{
+	FetModule *fet = dl->fet;
+
+	g_slice_free( elf_extent_t, _ext );
+
+	if( ok )
+		gdb_client_command_complete( &fet->target_state,
+					     fet->gdbclient_userdata );
+	else
+		/* EFAULT */
+		gdb_client_command_error( 0x0e, fet->gdbclient_userdata );
+}
+
+/* A memory read on behalf of the GdbClient */
+typedef struct {
+	/* The page aligned block that's read from the target */
+	uint8_t *buf;
+	uint32_t addr, len;
+	/* The part of it that gdb asked for */
+	uint32_t want_addr, want_len;
+	/* Whether the data can go into the cache, and the cache
+	 * generation from when the read was sent */
+	gboolean cache;
+	uint32_t gen;
+} fet_module_gdb_read_t;
+
+/* Called with the data from a memory read on behalf of the GdbClient */
+static void fet_module_gdb_mem_read( FetModule *fet,
+				     fet_reply_status_t status,
+				     const fet_reply_t *reply,
+				     gpointer _rd )
+{
+	fet_module_gdb_read_t *rd = (fet_module_gdb_read_t*)_rd;
+	assert( fet != NULL && rd != NULL );
+
+	if( status == FET_REPLY_OK ) {
+		if( rd->cache )
+			fet_cache_fill( fet, rd->gen, rd->addr, rd->buf, rd->len );
+
+		fet->target_state.mem = rd->buf + (rd->want_addr - rd->addr);
+		fet->target_state.mem_len = rd->want_len;
+		gdb_client_command_complete( &fet->target_state,
+					     fet->gdbclient_userdata );
+	} else
+		/* EFAULT */
+		gdb_client_command_error( 0x0e, fet->gdbclient_userdata );
+
+	fet->target_state.mem = NULL;
+	fet->target_state.mem_len = 0;
+	g_free( rd->buf );
+	g_slice_free( fet_module_gdb_read_t, rd );
+}
+
+void fet_module_gdb_detach( gpointer _fet )
+{
+	FetModule *fet = FET_MODULE(_fet);
+	gdb_client_info_t *st = &fet->target_state;
+
+	/* Leave the target running, but don't wait for it on gdb's behalf */
+	fet->gdb_stop_userdata = NULL;
+	fet_poll_remove_listener( fet, fet_module_gdb_halted, NULL );
+	fet->gdbclient_userdata = NULL;
+
+	if( st->reg_dirty == 0 )
+		return;
+
+	/* The FET writes all the registers at once */
+	if( st->reg_valid == 0xffff )
+		fet_cmd_write_context( fet, st->reg,
+				       fet_module_gdb_registers_written, NULL );
+	else {
+		g_warning( "Dropping register changes from a departed gdb" );
+		st->reg_valid = 0;
+	}
+	st->reg_dirty = 0;
+}
+
+void fet_module_gdb_read_registers( gpointer _fet )
+{
+	FetModule *fet = FET_MODULE(_fet);
+
+	/* A running target's registers mean nothing */
+	if( fet_poll_active( fet ) ) {
+		/* EAGAIN */
+		gdb_client_command_error( 0x0b, fet->gdbclient_userdata );
+		return;
+	}
+
+	/* The registers can't change while the target's halted */
+	if( fet->target_state.reg_valid == 0xffff ) {
+		gdb_client_command_complete( &fet->target_state,
+					     fet->gdbclient_userdata );
+		return;
+	}
+
+	fet_cmd_read_context( fet, fet_module_gdb_registers_read, NULL );
+}
+
+void fet_module_gdb_stop_query( gpointer _fet )
+{
+	FetModule *fet = FET_MODULE(_fet);
+
+	/* It has to have stopped before gdb can be told why.  gdb gets
+	 * its reply from the halt listener. */
+	if( fet_poll_interrupt( fet ) ) {
+		fet->gdb_stop_userdata = fet->gdbclient_userdata;
+		return;
+	}
+
+	fet_module_gdb_read_registers( fet );
+}
+
+void fet_module_gdb_write_registers( const uint16_t *regs, uint16_t mask,
+				     gpointer _fet )
+{
+	FetModule *fet = FET_MODULE(_fet);
+	gdb_client_info_t *st = &fet->target_state;
+	uint8_t i;
+
+	/* They're written back when the target next runs */
+	for( i=0; i<16; i++ )
+		if( mask & (1 << i) )
+			st->reg[i] = regs[i];
+
+	st->reg_valid |= mask;
+	st->reg_dirty |= mask;
+
+	gdb_client_command_complete( st, fet->gdbclient_userdata );
+}
+
+static void fet_module_gdb_resume( FetModule *fet, gboolean step )
+{
+	gdb_client_info_t *st = &fet->target_state;
+
+	if( st->reg_dirty != 0 ) {
+		/* The FET writes all the registers at once */
+		if( st->reg_valid != 0xffff ) {
+			if( fet_cmd_read_context( fet, fet_module_gdb_registers_fetched,
+						  GINT_TO_POINTER(step) ) != 0 )
+				/* EAGAIN */
+				gdb_client_command_error( 0x0b, fet->gdbclient_userdata );
+			return;
 		}
-	} 
 
-	fet->tx_escaped = FALSE;
-	return TRUE;
+		/* The target mustn't run with the old registers, so they
+		 * stay dirty, and it stays put, until they're written */
+		if( fet_cmd_write_context( fet, st->reg,
+					   fet_module_gdb_registers_written, NULL ) != 0 ) {
+			/* EAGAIN */
+			gdb_client_command_error( 0x0b, fet->gdbclient_userdata );
+			return;
+		}
+		st->reg_dirty = 0;
+	}
+
+	if( step ) {
+		/* Read the registers for the stop reply straight after the
+		 * step, rather than waiting for it to be acknowledged */
+		fet->target_state.signal = GDB_CLIENT_SIGTRAP;
+		if( fet_cmd_step( fet, fet_module_gdb_stepped, NULL ) != 0 ) {
+			/* EAGAIN */
+			gdb_client_command_error( 0x0b, fet->gdbclient_userdata );
+			return;
+		}
+
+		if( fet_cmd_read_context( fet, fet_module_gdb_registers_read, NULL ) != 0 )
+			/* It's stepped, but where to is anyone's guess: EIO */
+			gdb_client_command_error( 0x05, fet->gdbclient_userdata );
+	} else {
+		if( fet_cmd_run( fet, fet_module_gdb_running, NULL ) != 0 ) {
+			/* EAGAIN */
+			gdb_client_command_error( 0x0b, fet->gdbclient_userdata );
+			return;
+		}
+		fet->gdb_stop_userdata = fet->gdbclient_userdata;
+	}
 }
 
-gboolean fet_module_io_error( GIOChannel *source, GIOCondition condition,
-			      gpointer _fet )
+void fet_module_gdb_cont( gpointer _fet )
 {
-	fprintf( stderr, "Erk, error.  I should do something\n" );
-	return FALSE;
+	fet_module_gdb_resume( FET_MODULE(_fet), FALSE );
 }
 
-void fet_module_gdbclient_init( gpointer gdbc, gpointer _fet )
+void fet_module_gdb_step( gpointer _fet )
 {
-	FetModule *fet = (FetModule*)_fet;
+	fet_module_gdb_resume( FET_MODULE(_fet), TRUE );
+}
 
-	fet->gdbclient_userdata = gdbc;
+void fet_module_gdb_interrupt( gpointer _fet )
+{
+	FetModule *fet = FET_MODULE(_fet);
+
+	/* Nothing to stop */
+	if( !fet_poll_active( fet ) )
+		return;
+
+	/* Whatever was being streamed to or from the target is moot now */
+	fet_module_cancel_bulk( fet );
+
+	/* The halt listener sends gdb its stop reply */
+	fet_poll_interrupt( fet );
+}
+
+void fet_module_gdb_write_mem( uint32_t addr, const uint8_t *data, uint32_t len,
+			       gpointer _fet )
+{
+	FetModule *fet = FET_MODULE(_fet);
+	elf_extent_t *ext;
+
+	/* Stream it through the downloader, which splits it into frames of
+	 * the FET's maximum size, and keeps the pool from running dry.
+	 * gdb sends lots of these, so they go quietly. */
+	ext = g_slice_new( elf_extent_t );
+	ext->addr = addr;
+	ext->data = data;
+	ext->len = len;
+
+	fet_download_start( fet, ext, 1, FET_DOWNLOAD_WINDOW, FALSE,
+			    fet_module_gdb_mem_written, ext );
+}
+
+void fet_module_gdb_read_mem( uint32_t addr, uint32_t len, gpointer _fet )
+{
+	FetModule *fet = FET_MODULE(_fet);
+	fet_module_gdb_read_t *rd;
+	uint32_t page_addr, page_len;
+
+	/* Memory that the target's changing can't be read reliably, and
+	 * the reads would hold up the polls */
+	if( fet_poll_active( fet ) ) {
+		/* EAGAIN */
+		gdb_client_command_error( 0x0b, fet->gdbclient_userdata );
+		return;
+	}
+
+	/* Leave half of the frame pool for everything else.  gdb accepts
+	 * a shorter reply than it asked for, and comes back for the rest. */
+	len = MIN( len, (uint32_t)fet_cmd_read_mem_max( fet ) * (FET_FRAME_POOL_LEN / 2) );
+
+	rd = g_slice_new( fet_module_gdb_read_t );
+	rd->want_addr = addr;
+	rd->want_len = len;
+	rd->cache = !fet_cache_is_uncached( fet, addr, len );
+	rd->gen = fet_cache_gen( fet );
+
+	/* Read whole pages, so that they can all be cached, unless they
+	 * take in memory that mustn't be read without being asked for */
+	page_addr = FET_CACHE_PAGE_FLOOR( addr );
+	page_len = MIN( FET_CACHE_PAGE_CEIL( addr + len ), 0x100000 ) - page_addr;
+
+	if( rd->cache && !fet_cache_is_uncached( fet, page_addr, page_len ) ) {
+		rd->addr = page_addr;
+		rd->len = page_len;
+	} else {
+		rd->addr = addr;
+		rd->len = len;
+	}
+	rd->buf = g_malloc( rd->len );
+
+	/* While the target's halted, there's no need to go to the FET
+	 * for memory that's been read before */
+	if( rd->cache
+	    && fet_cache_read( fet, addr, rd->buf + (addr - rd->addr), len ) ) {
+		rd->cache = FALSE;
+		fet_module_gdb_mem_read( fet, FET_REPLY_OK, NULL, rd );
+		return;
+	}
+
+	if( fet_cmd_read_mem( fet, rd->addr, rd->buf, rd->len,
+			      fet_module_gdb_mem_read, rd ) != 0 ) {
+		g_free( rd->buf );
+		g_slice_free( fet_module_gdb_read_t, rd );
+
+		/* EAGAIN */
+		gdb_client_command_error( 0x0b, fet->gdbclient_userdata );
+	}
 }
@@ -26,22 +26,99 @@
 #include <glib-object.h>
 #include "serial.h"
 #include "gdb-client.h"
+#include "fet-replies.h"
 
-#define FET_INBUF_LEN 512
-#define FET_OUTBUF_LEN 512
+/* Size of the receive ring buffer -- must be a power of two.
+ * This matches the size of the kernel's tty input buffer, so a single
+ * read can drain everything that's waiting. */
+#define FET_RX_RING_LEN 4096
+/* The largest frame payload that can be sent to any FET */
+#define FET_OUTBUF_LEN 2048
+
+/* The largest frame payload a FET is assumed to accept, unless it's
+ * configured otherwise with fet_module_set_max_payload() */
+#define FET_PAYLOAD_DEFAULT 255
+/* ...and the smallest payload limit that can be configured */
+#define FET_PAYLOAD_MIN 64
+
+/* Worst-case wire length of a frame with a len byte payload: two sentinels,
+ * plus the payload and checksum with every byte escaped */
+#define FET_FRAME_WIRE_LEN(len) (2 + 2 * ((len) + 2))
+
+/* The number of frames in each FET's frame pool.
+ * This bounds the number of frames that may be queued for transmission. */
+#define FET_FRAME_POOL_LEN 32
+
+typedef struct fet_frame_ts fet_frame_t;
+
+struct fet_ts;
+
+typedef struct fet_ts FetModule;	
+
+/* How long to wait for the FET to reply to a command, in ms */
+#define FET_REPLY_TIMEOUT_MS 1000
+
+/* How a command finished */
+typedef enum {
+	FET_REPLY_OK,		/* The FET replied with the expected type */
+	FET_REPLY_ERROR,	/* The FET NAKed the command, or flagged an error */
+	FET_REPLY_TIMEOUT,	/* The FET didn't reply in time */
+	FET_REPLY_CANCELLED	/* The command was dropped before it was sent */
+} fet_reply_status_t;
+
+/* Transmit priority classes.
+ * Urgent frames go out ahead of everything else that's still queued.
+ * Bulk frames can be cancelled with fet_module_cancel_bulk(). */
+typedef enum {
+	FET_PRIO_BULK,
+	FET_PRIO_NORMAL,
+	FET_PRIO_URGENT
+} fet_prio_t;
+
+/* Called when a command has completed.
+ * reply is NULL if the command timed out or was cancelled. */
+typedef void (*fet_reply_cb_t) ( FetModule *fet,
+				 fet_reply_status_t status,
+				 const fet_reply_t *reply,
+				 gpointer userdata );
 
 /* Frames that head out of the FET.
- * Data is the frame payload.
- * i.e. it does _not_ contain the frame sentinels or checksum */
-typedef struct
+ * These are allocated from the FetModule's frame pool with
+ * fet_module_frame_alloc(), filled in, and then handed over with
+ * fet_module_frame_transmit(). */
+struct fet_frame_ts
 {
+	/* The next frame in the transmit queue or free list */
+	fet_frame_t *next;
+
+	/* The frame payload.
+	 * i.e. it does _not_ contain the frame sentinels or checksum */
+	uint8_t data[FET_OUTBUF_LEN];
 	uint16_t len;
-	uint8_t *data;
-} fet_frame_t;
 
-struct fet_ts;
+	/* The complete wire image of the frame, ready to be written straight
+	 * to the serial port.  Filled in by fet_module_frame_transmit(). */
+	uint8_t wire[FET_FRAME_WIRE_LEN(FET_OUTBUF_LEN)];
+	uint16_t wire_len;
+	/* The wire image that's written out.  This is wire, unless the frame
+	 * was encoded ahead of time, in which case it points at that. */
+	const uint8_t *wire_ptr;
 
-typedef struct fet_ts FetModule;	
+	/* One of the FET_PRIO_* classes */
+	uint8_t prio;
+
+	/*** The reply that the frame's waiting for ***/
+	/* The reply type expected -- one of the FET_TYPE_* values */
+	uint8_t reply_type;
+	/* How long to wait for the reply once the frame's been sent, in ms */
+	guint timeout;
+	/* Function to call with the reply.  May be NULL. */
+	fet_reply_cb_t cb;
+	gpointer userdata;
+};
+
+/* The maximum number of frames handed to the serial port in one write */
+#define FET_TX_IOV_MAX 16
 
 typedef struct
 {
@@ -59,35 +136,69 @@ GType fet_module_get_type( void );
 #define FET_IS_MODULE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), FET_MODULE_TYPE))
 #define FET_MODULE_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), FET_MODULE_TYPE, FetModuleClass))
 
+/* The state of the serial link to the FET */
+typedef enum {
+	/* Commands go straight out */
+	FET_LINK_UP,
+	/* The FET's gone, and we're trying to reopen it */
+	FET_LINK_DOWN,
+	/* It's been reopened, and is being set up again */
+	FET_LINK_SETUP
+} fet_link_state_t;
+
 struct fet_ts
 {
 	GObject parent;
 
 	/* private */
+	/* The main context that all of our sources are attached to */
+	GMainContext *context;
 	SerialConn *serial;
-	/* Whether we're currently following writability */
-	gboolean mon_write;
 	/* The channel for monitoring the serial */
 	GIOChannel *ioc;
+	/* The watches on ioc.  out_watch is 0 when we're not following
+	 * writability. */
+	guint in_watch, out_watch, err_watch;
 
 	/*** Transmission ***/
-	/* Queue of outgoing frames - all of fet_frame_t */
-	/* Note: the data in these frames has already been escaped */
-	GQueue* out_frames; 
-
-	/* Checksum value for the currently transmitting frame */
-	uint16_t o_chk;
-	gboolean checked;	/* Whether the checksum has been calculated */
-	gboolean tx_escaped;	/* Whether the next byte has been escaped */
+	/* The frame pool, and the list of frames in it that are free */
+	fet_frame_t *frame_pool;
+	fet_frame_t *frame_free;
+
+	/* Queue of outgoing frames, linked through their next pointers.
+	 * Frames are added at out_tail, and transmitted from out_head. */
+	fet_frame_t *out_head, *out_tail;
+
 	/* The next byte to be transmitted within the current frame */
 	uint16_t tx_pos;
 
+	/* The largest frame payload this FET accepts */
+	uint16_t max_payload;
+
+	/* What the FET said the target was, the last time it was asked.
+	 * This holds for as long as the FET stays initialised. */
+	fet_reply_identify_t identity;
+	gboolean identified;
+
+	/* Frames that have been sent and are waiting for their replies,
+	 * in the order they went out on the wire */
+	fet_frame_t *wait_head, *wait_tail;
+	/* Timeout source for the reply to the frame at wait_head */
+	guint reply_timer;
+
 	/*** Reception ***/
-	/* Buffer of incoming data */
-	/* Always contains the beginning part of a frame */
-	uint8_t inbuf[FET_INBUF_LEN];
-	/* The number of bytes in the input buffer */
-	uint16_t in_len;
+	/* Ring buffer of incoming data.
+	 * rx_head and rx_tail are free-running indices: the unprocessed
+	 * data lies between rx_tail and rx_head.  rx_tail always points at
+	 * the beginning of a frame. */
+	uint8_t rx_ring[FET_RX_RING_LEN];
+	uint32_t rx_head, rx_tail;
+	/* The running checksum of the frame at rx_tail, and the number of
+	 * its payload bytes that have been folded into it */
+	uint16_t rx_crc;
+	uint16_t rx_crc_len;
+	/* Frames that wrap around the end of the ring get copied here */
+	uint8_t rx_frame[FET_RX_RING_LEN];
 
 	/* Callback for receiving a frame.
 	 * The data pointed to contains the beginning part of the frame */
@@ -97,26 +208,191 @@ struct fet_ts
 	uint32_t bytes_discarded, frames_discarded; /* Frames with invalid checksums */
 	uint32_t bytes_rx, bytes_tx;   
 	uint32_t frames_rx, frames_tx;  /* Valid checksum frames received */
+	uint32_t frames_unmatched;	/* Replies that no command was waiting for */
+	uint32_t frames_undecoded;	/* Replies that there's no decoder for */
+	uint32_t replies_timedout;
+
+	/*** Target memory cache -- see fet-cache.h ***/
+	/* Pages of memory, keyed by page number */
+	GHashTable *cache;
+	/* Ranges that are never cached */
+	GArray *cache_uncached;
+	/* Bumped whenever the cache is invalidated */
+	uint32_t cache_gen;
+	uint32_t cache_hits, cache_misses;
 
 	/* Information about the target's state */
 	gdb_client_info_t target_state;
+	/* The GdbClient that's waiting for the target to halt, after
+	 * setting it running or asking why it stopped while it ran.
+	 * Other clients may be served in the meantime. */
+	gpointer gdb_stop_userdata;
+
+	/*** Link recovery -- see fet-link.h ***/
+	/* The serial device, for reopening it */
+	gchar *dev_name;
+	fet_link_state_t link_state;
+	/* Set while fet-link queues the commands that bring the FET up,
+	 * which go out ahead of everything else */
+	gboolean link_setup;
+	/* Frames waiting for the link to come back up */
+	fet_frame_t *held_head, *held_tail;
+	/* Timeout source for the next attempt at reopening, and the time
+	 * until the one after that, in ms */
+	guint link_timer;
+	guint link_retry_ms;
+	/* Whether the target was running when the link went down */
+	gboolean link_running;
+	uint32_t link_drops;
+	/* How the FET was last set up, to be repeated after a reconnect */
+	gboolean setup_conf, setup_sbw;
+	gboolean setup_vcc;
+	uint16_t setup_vcc_mv;
+
+	/*** Halt detection -- see fet-poll.h ***/
+	/* Timeout source for the next poll, or 0 */
+	guint poll_timer;
+	/* The time until the next poll after that, in ms */
+	guint poll_interval;
+	/* Bumped whenever polling starts or stops, so that stale replies
+	 * can be spotted */
+	guint poll_gen;
+	/* Whether the target's running and being polled */
+	gboolean poll_active;
+	/* fet_poll_listener_t* to tell when the target halts */
+	GSList *poll_listeners;
+	uint32_t polls_tx;
 	gpointer gdbclient_userdata;
 };
 
 /* Create a connection to a FET.
- * Opens the serial port given in fname */
+ * Opens the serial port given in fname.
+ * All of the FET's sources are attached to context (NULL for the
+ * default one), and everything it calls back happens in the thread
+ * that runs context.  Different FETs can be run from different
+ * threads.
+ * Returns NULL if the serial port can't be opened. */
 FetModule* fet_module_open( char *fname, GMainContext *context );
 
 /* Close a FET connection */
 void fet_module_close( FetModule *fet );
 
-/* Add a FET to a mainloop */
-void fet_module_add_source( FetModule *fet, GMainContext *context );
+/* Open the FET's serial device, and start watching it.
+ * Returns FALSE if it can't be opened. */
+gboolean fet_module_serial_open( FetModule *fet );
+
+/* Close the FET's serial device.
+ * The frames that have gone out, or started to, get FET_REPLY_ERROR.
+ * If hold is TRUE, those that haven't are held until
+ * fet_module_release_held(), along with any queued in the meantime.
+ * Otherwise they get FET_REPLY_ERROR too. */
+void fet_module_serial_close( FetModule *fet, gboolean hold );
+
+/* Queue the frames that were held while the link was down */
+void fet_module_release_held( FetModule *fet );
+
+/* Call func after ms milliseconds, from the FET's main context.
+ * Works like g_timeout_add(). */
+guint fet_module_timeout_add( FetModule *fet, guint ms,
+			      GSourceFunc func, gpointer data );
+
+/* Remove a source that was added to the FET's main context */
+void fet_module_source_remove( FetModule *fet, guint id );
+
+/* Transmit a command.
+ * Args:
+ *  - reply_type: The type of reply the command should get (FET_TYPE_*).
+ *  -         cb: Function to call with the reply.  May be NULL.
+ * Returns 0 on success, or -1 if the frame pool is exhausted. */
+int fet_module_transmit( FetModule* fet, const void* buf, uint16_t len,
+			 uint8_t reply_type, fet_reply_cb_t cb, gpointer userdata );
+
+/* Set the largest frame payload that the FET accepts.
+ * len must be between FET_PAYLOAD_MIN and FET_OUTBUF_LEN. */
+void fet_module_set_max_payload( FetModule* fet, uint16_t len );
+
+/* Returns the largest frame payload that the FET accepts */
+uint16_t fet_module_get_max_payload( FetModule* fet );
+
+/* Returns what the target was identified as by fet_cmd_identify(),
+ * or NULL if it hasn't been yet */
+const fet_reply_identify_t* fet_module_get_identity( FetModule* fet );
+
+/* Take a frame from the FET's frame pool, for the caller to build its
+ * payload in.  The frame must then be passed to fet_module_frame_transmit.
+ * The frame's reply fields are set up to expect an ACK within
+ * FET_REPLY_TIMEOUT_MS, with no callback, and it has normal priority.
+ * Returns NULL if the pool is exhausted. */
+fet_frame_t* fet_module_frame_alloc( FetModule* fet );
+
+/* Transmit a frame that was allocated with fet_module_frame_alloc().
+ * The frame's data and len must have been filled in, and len must be
+ * no more than the FET's maximum payload.
+ * Any number of frames may be in flight at once: replies are matched to
+ * them in the order they were sent.  The frame returns to the pool once
+ * its reply has arrived, or it's timed out. */
+int fet_module_frame_transmit( FetModule* fet, fet_frame_t* frame );
 
-/* Transmit a frame */
-int fet_module_transmit( FetModule* fet, const void* buf, uint8_t len );
+/* Encode a frame payload into its wire format: sentinels, escaped data and
+ * escaped checksum.  out must have room for FET_FRAME_WIRE_LEN(len) bytes.
+ * Returns the number of bytes written to out. */
+uint16_t fet_module_frame_encode( const uint8_t *buf, uint16_t len, uint8_t *out );
+
+/* Transmit a frame whose wire image was built ahead of time with
+ * fet_module_frame_encode().  frame->wire_ptr and wire_len must point at
+ * it, and it's written out from there, so it must remain valid until the
+ * frame's callback has been called.
+ * len must still be set to the payload length, and data[0] to the
+ * command, as that's what the reply is matched against.  The rest of
+ * data is ignored. */
+int fet_module_frame_transmit_encoded( FetModule* fet, fet_frame_t* frame );
+
+/* Return a frame that was allocated with fet_module_frame_alloc(), but
+ * not transmitted, to the pool */
+void fet_module_frame_free( FetModule* fet, fet_frame_t* frame );
+
+/* Drop the bulk frames that haven't started going out yet.
+ * Their callbacks are called with FET_REPLY_CANCELLED. */
+void fet_module_cancel_bulk( FetModule* fet );
 
 /* Initialise the GdbClient <-> FetModule link */
 void fet_module_gdbclient_init( gpointer gdbc, gpointer _fet );
 
+/* GdbClient callback: the GdbClient has gone.
+ * Anything it was waiting for is dropped, and any registers it changed
+ * are written back, so that the next client finds the target as this
+ * one left it. */
+void fet_module_gdb_detach( gpointer _fet );
+
+/* GdbClient callback: read the target's registers.
+ * These come from target_state if they're all there.  If the target's
+ * running, gdb gets EAGAIN. */
+void fet_module_gdb_read_registers( gpointer _fet );
+
+/* GdbClient callback: gdb's asking why the target stopped.
+ * If it's running, it's halted first. */
+void fet_module_gdb_stop_query( gpointer _fet );
+
+/* GdbClient callback: change the target's registers.
+ * These are held in target_state until the target next runs. */
+void fet_module_gdb_write_registers( const uint16_t *regs, uint16_t mask,
+				     gpointer _fet );
+
+/* GdbClient callback: set the target running */
+void fet_module_gdb_cont( gpointer _fet );
+
+/* GdbClient callback: step the target by one instruction */
+void fet_module_gdb_step( gpointer _fet );
+
+/* GdbClient callback: gdb wants the running target stopped */
+void fet_module_gdb_interrupt( gpointer _fet );
+
+/* GdbClient callback: write to the target's memory */
+void fet_module_gdb_write_mem( uint32_t addr, const uint8_t *data, uint32_t len,
+			       gpointer _fet );
+
+/* GdbClient callback: read from the target's memory.
+ * If the target's running, gdb gets EAGAIN. */
+void fet_module_gdb_read_mem( uint32_t addr, uint32_t len, gpointer _fet );
+
 #endif	/* __FET_MODULE_H */
@@ -0,0 +1,276 @@
+/* Detects the target halting while it runs
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fet-poll.h"
+#include "fet-commands.h"
+#include "fet-cache.h"
+#include <string.h>
+
+typedef struct {
+	fet_halt_cb_t cb;
+	gpointer userdata;
+} fet_poll_listener_t;
+
+/* Timeout callback: send the next poll */
+static gboolean fet_poll_send( gpointer _fet );
+
+/* Called with the reply to a poll */
+static void fet_poll_reply( FetModule *fet,
+			    fet_reply_status_t status,
+			    const fet_reply_t *reply,
+			    gpointer _gen );
+
+/* Called with the reply to a halt command */
+static void fet_poll_halted( FetModule *fet,
+			     fet_reply_status_t status,
+			     const fet_reply_t *reply,
+			     gpointer _gen );
+
+/* Called with the registers once the target's halted */
+static void fet_poll_context( FetModule *fet,
+			      fet_reply_status_t status,
+			      const fet_reply_t *reply,
+			      gpointer _gen );
+
+/* Arrange for the next poll to go out after the current interval */
+static void fet_poll_schedule( FetModule *fet );
+
+void fet_poll_init( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	fet->poll_timer = 0;
+	fet->poll_interval = FET_POLL_MIN_MS;
+	fet->poll_gen = 0;
+	fet->poll_active = FALSE;
+	fet->poll_listeners = NULL;
+	fet->polls_tx = 0;
+	fet->target_state.signal = GDB_CLIENT_SIGTRAP;
+}
+
+void fet_poll_free( FetModule *fet )
+{
+	GSList *l;
+	g_assert( fet != NULL );
+
+	fet_poll_stop( fet );
+
+	for( l = fet->poll_listeners; l != NULL; l = l->next )
+		g_slice_free( fet_poll_listener_t, l->data );
+	g_slist_free( fet->poll_listeners );
+	fet->poll_listeners = NULL;
+}
+
+void fet_poll_start( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	fet_poll_stop( fet );
+
+	fet->poll_active = TRUE;
+	fet->poll_interval = FET_POLL_MIN_MS;
+	fet_poll_schedule( fet );
+}
+
+void fet_poll_stop( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	if( fet->poll_timer != 0 ) {
+		fet_module_source_remove( fet, fet->poll_timer );
+		fet->poll_timer = 0;
+	}
+
+	/* Whatever's in flight now refers to a previous run */
+	fet->poll_gen++;
+	fet->poll_active = FALSE;
+}
+
+gboolean fet_poll_interrupt( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	if( !fet->poll_active )
+		return FALSE;
+
+	if( fet->poll_timer != 0 ) {
+		fet_module_source_remove( fet, fet->poll_timer );
+		fet->poll_timer = 0;
+	}
+
+	/* A poll that's in flight mustn't report the halt as well */
+	fet->poll_gen++;
+
+	if( fet_cmd_halt( fet, fet_poll_halted, GUINT_TO_POINTER(fet->poll_gen) ) != 0 ) {
+		g_warning( "No frames free to halt the target" );
+		fet_poll_schedule( fet );
+	}
+
+	return TRUE;
+}
+
+void fet_poll_lost( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	fet_poll_stop( fet );
+	fet_cache_flush( fet );
+
+	fet->target_state.signal = GDB_CLIENT_SIGLOST;
+	if( fet_cmd_read_context( fet, fet_poll_context,
+				  GUINT_TO_POINTER(fet->poll_gen) ) != 0 )
+		/* Tell them anyway, without the registers */
+		fet_poll_context( fet, FET_REPLY_ERROR, NULL,
+				  GUINT_TO_POINTER(fet->poll_gen) );
+}
+
+gboolean fet_poll_active( FetModule *fet )
+{
+	g_assert( fet != NULL );
+
+	return fet->poll_active;
+}
+
+void fet_poll_add_listener( FetModule *fet, fet_halt_cb_t cb, gpointer userdata )
+{
+	fet_poll_listener_t *li;
+	g_assert( fet != NULL && cb != NULL );
+
+	li = g_slice_new( fet_poll_listener_t );
+	li->cb = cb;
+	li->userdata = userdata;
+
+	fet->poll_listeners = g_slist_append( fet->poll_listeners, li );
+}
+
+void fet_poll_remove_listener( FetModule *fet, fet_halt_cb_t cb, gpointer userdata )
+{
+	GSList *l;
+	g_assert( fet != NULL );
+
+	for( l = fet->poll_listeners; l != NULL; l = l->next ) {
+		fet_poll_listener_t *li = l->data;
+
+		if( li->cb == cb && li->userdata == userdata ) {
+			fet->poll_listeners = g_slist_remove( fet->poll_listeners, li );
+			g_slice_free( fet_poll_listener_t, li );
+			return;
+		}
+	}
+}
+
+static void fet_poll_schedule( FetModule *fet )
+{
+	fet->poll_timer = fet_module_timeout_add( fet, fet->poll_interval,
+						  fet_poll_send, fet );
+
+	fet->poll_interval *= 2;
+	if( fet->poll_interval > FET_POLL_MAX_MS )
+		fet->poll_interval = FET_POLL_MAX_MS;
+}
+
+static gboolean fet_poll_send( gpointer _fet )
+{
+	FetModule *fet = (FetModule*)_fet;
+
+	fet->poll_timer = 0;
+
+	/* Only one poll is in flight at a time: the next is scheduled
+	 * once this one's answered */
+	if( fet_cmd_poll( fet, fet_poll_reply, GUINT_TO_POINTER(fet->poll_gen) ) == 0 )
+		fet->polls_tx++;
+	else
+		fet_poll_schedule( fet );
+
+	return FALSE;
+}
+
+static void fet_poll_reply( FetModule *fet,
+			    fet_reply_status_t status,
+			    const fet_reply_t *reply,
+			    gpointer _gen )
+{
+	guint gen = GPOINTER_TO_UINT(_gen);
+
+	if( gen != fet->poll_gen )
+		return;
+
+	if( status != FET_REPLY_OK || reply->kind != FET_REPLY_KIND_STATE
+	    || reply->u.state.running ) {
+		fet_poll_schedule( fet );
+		return;
+	}
+
+	/* It's halted.  Everyone's going to want the registers, and
+	 * whatever was read while it ran is stale. */
+	fet->poll_active = FALSE;
+	fet_cache_flush( fet );
+	fet->target_state.signal = GDB_CLIENT_SIGTRAP;
+	if( fet_cmd_read_context( fet, fet_poll_context, _gen ) != 0 )
+		/* Tell them anyway, without the registers */
+		fet_poll_context( fet, FET_REPLY_ERROR, NULL, _gen );
+}
+
+static void fet_poll_halted( FetModule *fet,
+			     fet_reply_status_t status,
+			     const fet_reply_t *reply,
+			     gpointer _gen )
+{
+	if( GPOINTER_TO_UINT(_gen) != fet->poll_gen )
+		return;
+
+	if( status != FET_REPLY_OK ) {
+		/* Carry on watching it */
+		g_warning( "Failed to halt the target" );
+		fet_poll_schedule( fet );
+		return;
+	}
+
+	fet->poll_active = FALSE;
+	fet_cache_flush( fet );
+	fet->target_state.signal = GDB_CLIENT_SIGINT;
+	if( fet_cmd_read_context( fet, fet_poll_context, _gen ) != 0 )
+		/* Tell them anyway, without the registers */
+		fet_poll_context( fet, FET_REPLY_ERROR, NULL, _gen );
+}
+
+static void fet_poll_context( FetModule *fet,
+			      fet_reply_status_t status,
+			      const fet_reply_t *reply,
+			      gpointer _gen )
+{
+	gdb_client_info_t *st = &fet->target_state;
+	GSList *l, *next;
+
+	/* The target's been set running again in the meantime */
+	if( GPOINTER_TO_UINT(_gen) != fet->poll_gen )
+		return;
+
+	if( status == FET_REPLY_OK && reply->kind == FET_REPLY_KIND_CONTEXT ) {
+		memcpy( st->reg, reply->u.context.reg, sizeof(st->reg) );
+		st->reg_valid = 0xffff;
+	} else
+		g_warning( "Failed to read registers after the target halted" );
+
+	/* Listeners may remove themselves */
+	for( l = fet->poll_listeners; l != NULL; l = next ) {
+		fet_poll_listener_t *li = l->data;
+		next = l->next;
+
+		li->cb( fet, li->userdata );
+	}
+}
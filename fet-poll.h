@@ -0,0 +1,69 @@
+/* Detects the target halting while it runs
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef __FET_POLL_H
+#define __FET_POLL_H
+#include <glib.h>
+#include <stdint.h>
+#include "fet-module.h"
+
+/* The interval between polls starts at FET_POLL_MIN_MS when the target
+ * is set running, and doubles after each poll up to FET_POLL_MAX_MS.
+ * Short runs to the next breakpoint are caught quickly, without long
+ * runs tying up the serial link. */
+#define FET_POLL_MIN_MS 2
+#define FET_POLL_MAX_MS 500
+
+/* Called when the target has halted.
+ * The registers are in the FET's target_state by the time this is
+ * called, unless reading them failed, in which case
+ * target_state.reg_valid is 0.  target_state.signal says why it
+ * halted. */
+typedef void (*fet_halt_cb_t) ( FetModule *fet, gpointer userdata );
+
+void fet_poll_init( FetModule *fet );
+void fet_poll_free( FetModule *fet );
+
+/* Start polling the target, which has just been set running.
+ * If it's already being polled, the interval goes back to the start. */
+void fet_poll_start( FetModule *fet );
+
+/* Stop polling.  Replies to polls in flight are ignored. */
+void fet_poll_stop( FetModule *fet );
+
+/* Stop the running target straight away.
+ * The halt command goes out ahead of anything queued, and the halt
+ * listeners are called once it's taken effect, with target_state's
+ * signal set to GDB_CLIENT_SIGINT.
+ * Returns FALSE if the target isn't running. */
+gboolean fet_poll_interrupt( FetModule *fet );
+
+/* Tell the halt listeners that the target stopped because the FET
+ * was lost while it ran.  target_state's signal is set to
+ * GDB_CLIENT_SIGLOST, and the registers are read first. */
+void fet_poll_lost( FetModule *fet );
+
+/* Returns TRUE if the target's being polled, i.e. it's running */
+gboolean fet_poll_active( FetModule *fet );
+
+/* Register a function to be called whenever the target halts */
+void fet_poll_add_listener( FetModule *fet, fet_halt_cb_t cb, gpointer userdata );
+
+/* Remove a function registered with fet_poll_add_listener() */
+void fet_poll_remove_listener( FetModule *fet, fet_halt_cb_t cb, gpointer userdata );
+
+#endif	/* __FET_POLL_H */
@@ -0,0 +1,233 @@
+/* Decoding of the replies that come back from a FET
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fet-replies.h"
+#include <string.h>
+
+/* Decodes the parsed reply into its typed form.
+ * Returns the kind of reply decoded. */
+typedef fet_reply_kind_t (*fet_reply_decoder_t) ( fet_reply_t *reply );
+
+/* Split the payload into its header, parameters and data block.
+ * Returns FALSE if the reply is malformed. */
+static gboolean fet_reply_parse( fet_reply_t *reply, const uint8_t *buf, uint16_t len );
+
+static fet_reply_kind_t fet_reply_decode_ack( fet_reply_t *reply );
+static fet_reply_kind_t fet_reply_decode_error( fet_reply_t *reply );
+static fet_reply_kind_t fet_reply_decode_context( fet_reply_t *reply );
+static fet_reply_kind_t fet_reply_decode_mem( fet_reply_t *reply );
+static fet_reply_kind_t fet_reply_decode_identify( fet_reply_t *reply );
+static fet_reply_kind_t fet_reply_decode_state( fet_reply_t *reply );
+
+/* Decoders for specific command/type combinations */
+static const fet_reply_decoder_t fet_reply_decoders[256][FET_TYPE_COUNT] =
+{
+	[FET_C_READREGISTERS][FET_TYPE_DATA] = fet_reply_decode_context,
+	[FET_C_READMEMORY][FET_TYPE_DATA] = fet_reply_decode_mem,
+	[FET_C_IDENTIFY][FET_TYPE_DATA] = fet_reply_decode_identify,
+	[FET_C_IDENTIFY][FET_TYPE_MIXED] = fet_reply_decode_identify,
+	[FET_C_STATE][FET_TYPE_PARAM] = fet_reply_decode_state,
+	[FET_C_STATE][FET_TYPE_MIXED] = fet_reply_decode_state,
+};
+
+/* Decoders for types that mean the same whatever the command */
+static const fet_reply_decoder_t fet_reply_type_decoders[FET_TYPE_COUNT] =
+{
+	[FET_TYPE_ACK] = fet_reply_decode_ack,
+	[FET_TYPE_FLASH_ACK] = fet_reply_decode_ack,
+	[FET_TYPE_NAK] = fet_reply_decode_error,
+};
+
+/* Error descriptions, indexed by error code */
+static const char *fet_reply_errors[] =
+{
+	"No error",
+	"Could not initialize device interface",
+	"Could not close device interface",
+	"Invalid parameter(s)",
+	"Could not find device (or device not supported)",
+	"Unknown device",
+	"Could not read device memory",
+	"Could not write device memory",
+	"Could not read device configuration fuses",
+	"Incorrectly configured device; device derivative not supported",
+	"Could not set device Vcc",
+	"Could not reset device",
+	"Could not preserve/restore device memory",
+	"Could not set device operating frequency",
+	"Could not erase device memory",
+	"Could not set device breakpoint",
+	"Could not single step device",
+	"Could not run device (to breakpoint)",
+	"Could not determine device state",
+};
+
+#define N_ERRORS (sizeof(fet_reply_errors) / sizeof(fet_reply_errors[0]))
+
+/* Little endian fields within a reply */
+#define LE16(p) ( ((uint16_t)(p)[0]) | (((uint16_t)(p)[1]) << 8) )
+#define LE32(p) ( ((uint32_t)LE16(p)) | (((uint32_t)LE16((p)+2)) << 16) )
+
+fet_reply_kind_t fet_reply_decode( fet_reply_t *reply, const uint8_t *buf, uint16_t len )
+{
+	fet_reply_decoder_t dec = NULL;
+	g_assert( reply != NULL && buf != NULL );
+
+	if( !fet_reply_parse( reply, buf, len ) )
+		return reply->kind = FET_REPLY_KIND_MALFORMED;
+
+	if( reply->error != 0 )
+		dec = fet_reply_decode_error;
+	else if( reply->type < FET_TYPE_COUNT ) {
+		dec = fet_reply_decoders[reply->cmd][reply->type];
+
+		if( dec == NULL )
+			dec = fet_reply_type_decoders[reply->type];
+	}
+
+	if( dec == NULL )
+		return reply->kind = FET_REPLY_KIND_UNKNOWN;
+
+	return reply->kind = dec( reply );
+}
+
+const char* fet_reply_error_string( uint8_t code )
+{
+	if( code >= N_ERRORS )
+		return "Unknown error";
+
+	return fet_reply_errors[code];
+}
+
+static gboolean fet_reply_parse( fet_reply_t *reply, const uint8_t *buf, uint16_t len )
+{
+	uint16_t pos = 4;
+	g_assert( reply != NULL && buf != NULL );
+
+	reply->raw = buf;
+	reply->len = len;
+	reply->argc = 0;
+	reply->data = NULL;
+	reply->datalen = 0;
+
+	if( len < 4 )
+		return FALSE;
+
+	reply->cmd = buf[0];
+	reply->type = buf[1];
+	reply->state = buf[2];
+	reply->error = buf[3];
+
+	if( reply->type == FET_TYPE_PARAM || reply->type == FET_TYPE_MIXED ) {
+		uint16_t i;
+
+		if( len < pos + 2 )
+			return FALSE;
+		reply->argc = LE16( buf + pos );
+		pos += 2;
+
+		if( reply->argc > FET_REPLY_ARGV_MAX
+		    || len < pos + reply->argc * 4 )
+			return FALSE;
+
+		for( i=0; i<reply->argc; i++, pos += 4 )
+			reply->argv[i] = LE32( buf + pos );
+	}
+
+	if( reply->type == FET_TYPE_DATA || reply->type == FET_TYPE_MIXED ) {
+		if( len < pos + 4 )
+			return FALSE;
+		reply->datalen = LE32( buf + pos );
+		pos += 4;
+
+		if( reply->datalen > (uint32_t)(len - pos) )
+			return FALSE;
+		reply->data = buf + pos;
+	}
+
+	return TRUE;
+}
+
+static fet_reply_kind_t fet_reply_decode_ack( fet_reply_t *reply )
+{
+	return FET_REPLY_KIND_ACK;
+}
+
+static fet_reply_kind_t fet_reply_decode_error( fet_reply_t *reply )
+{
+	reply->u.error.code = reply->error;
+	reply->u.error.msg = fet_reply_error_string( reply->error );
+
+	return FET_REPLY_KIND_ERROR;
+}
+
+static fet_reply_kind_t fet_reply_decode_context( fet_reply_t *reply )
+{
+	uint8_t i;
+
+	/* Each register is sent as a 32-bit word */
+	if( reply->datalen < 16 * 4 )
+		return FET_REPLY_KIND_MALFORMED;
+
+	for( i=0; i<16; i++ )
+		reply->u.context.reg[i] = LE16( reply->data + i*4 );
+
+	return FET_REPLY_KIND_CONTEXT;
+}
+
+static fet_reply_kind_t fet_reply_decode_mem( fet_reply_t *reply )
+{
+	if( reply->datalen > 0xffff )
+		return FET_REPLY_KIND_MALFORMED;
+
+	reply->u.mem.data = reply->data;
+	reply->u.mem.len = reply->datalen;
+
+	return FET_REPLY_KIND_MEM;
+}
+
+static fet_reply_kind_t fet_reply_decode_identify( fet_reply_t *reply )
+{
+	fet_reply_identify_t *id = &reply->u.identify;
+
+	/* The name sits at offset 4, in a 32 byte field */
+	if( reply->datalen < 4 + 32 )
+		return FET_REPLY_KIND_MALFORMED;
+
+	memcpy( id->name, reply->data + 4, 32 );
+	id->name[32] = '\0';
+
+	id->code_start = 0;
+	id->code_size = 0;
+	if( reply->datalen >= 0x2a ) {
+		id->code_start = LE16( reply->data + 0x24 );
+		id->code_size = LE32( reply->data + 0x26 );
+	}
+
+	return FET_REPLY_KIND_IDENTIFY;
+}
+
+static fet_reply_kind_t fet_reply_decode_state( fet_reply_t *reply )
+{
+	if( reply->argc < 1 )
+		return FET_REPLY_KIND_MALFORMED;
+
+	reply->u.state.state = reply->argv[0];
+	reply->u.state.running = (reply->argv[0] & 0x01) ? TRUE : FALSE;
+
+	return FET_REPLY_KIND_STATE;
+}
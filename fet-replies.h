@@ -0,0 +1,157 @@
+/* Decoding of the replies that come back from a FET
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef __FET_REPLIES_H
+#define __FET_REPLIES_H
+#include <glib.h>
+#include <stdint.h>
+
+/* Frame types.  These are the second byte of every frame. */
+enum {
+	FET_TYPE_ACK = 0x00,
+	FET_TYPE_CMD = 0x01,
+	FET_TYPE_PARAM = 0x02,
+	FET_TYPE_DATA = 0x03,
+	FET_TYPE_MIXED = 0x04,
+	FET_TYPE_NAK = 0x05,
+	/* The acknowledgement to a write into flash */
+	FET_TYPE_FLASH_ACK = 0x06,
+
+	/* The number of real types */
+	FET_TYPE_COUNT,
+
+	/* Not a real type: accept whatever reply the FET sends */
+	FET_TYPE_ANY = 0xff
+};
+
+/* Command codes.  These are the first byte of every frame. */
+enum {
+	FET_C_OPEN = 0x01,
+	FET_C_CLOSE = 0x02,
+	FET_C_IDENTIFY = 0x03,
+	FET_C_CONFIGURE = 0x05,
+	FET_C_VCC = 0x06,
+	FET_C_RESET = 0x07,
+	FET_C_READREGISTERS = 0x08,
+	FET_C_WRITEREGISTERS = 0x09,
+	FET_C_BREAKPOINT = 0x0a,
+	FET_C_ERASE = 0x0c,
+	FET_C_READMEMORY = 0x0d,
+	FET_C_WRITEMEMORY = 0x0e,
+	FET_C_RUN = 0x11,
+	FET_C_STATE = 0x12,
+	FET_C_INITIALIZE = 0x27
+};
+
+/* The most parameters a reply can carry */
+#define FET_REPLY_ARGV_MAX 8
+
+/* What a reply has been decoded into */
+typedef enum {
+	/* No decoder knows about this reply */
+	FET_REPLY_KIND_UNKNOWN,
+	/* The reply's length fields don't agree with its size */
+	FET_REPLY_KIND_MALFORMED,
+	/* A plain acknowledgement */
+	FET_REPLY_KIND_ACK,
+	/* The FET reported an error -- see u.error */
+	FET_REPLY_KIND_ERROR,
+	/* The contents of the target's registers -- see u.context */
+	FET_REPLY_KIND_CONTEXT,
+	/* A block of the target's memory -- see u.mem */
+	FET_REPLY_KIND_MEM,
+	/* The identity of the target -- see u.identify */
+	FET_REPLY_KIND_IDENTIFY,
+	/* Whether the target's running -- see u.state */
+	FET_REPLY_KIND_STATE
+} fet_reply_kind_t;
+
+typedef struct {
+	uint16_t reg[16];
+} fet_reply_context_t;
+
+typedef struct {
+	/* Points into the reply */
+	const uint8_t *data;
+	uint16_t len;
+} fet_reply_mem_t;
+
+typedef struct {
+	/* The device's name, nul terminated */
+	char name[33];
+	/* Where code starts, and how much of it there's room for.
+	 * Zero if the FET didn't say. */
+	uint16_t code_start;
+	uint32_t code_size;
+} fet_reply_identify_t;
+
+typedef struct {
+	/* The raw state word */
+	uint32_t state;
+	gboolean running;
+} fet_reply_state_t;
+
+typedef struct {
+	uint8_t code;
+	/* Description of the error */
+	const char *msg;
+} fet_reply_error_t;
+
+/* A reply from the FET.
+ * This is only valid for the duration of the callback it's passed to. */
+typedef struct {
+	uint8_t cmd;
+	uint8_t type;
+	uint8_t state;
+	/* The FET's error code -- 0 if there wasn't an error */
+	uint8_t error;
+
+	/* Parameters, for PARAM and MIXED replies */
+	uint16_t argc;
+	uint32_t argv[FET_REPLY_ARGV_MAX];
+
+	/* Data block, for DATA and MIXED replies */
+	const uint8_t *data;
+	uint32_t datalen;
+
+	/* The whole reply payload */
+	const uint8_t *raw;
+	uint16_t len;
+
+	/* The decoded contents */
+	fet_reply_kind_t kind;
+	union {
+		fet_reply_context_t context;
+		fet_reply_mem_t mem;
+		fet_reply_identify_t identify;
+		fet_reply_state_t state;
+		fet_reply_error_t error;
+	} u;
+} fet_reply_t;
+
+/* Parse a reply payload into reply, and decode it according to its
+ * command and type.
+ * The reply points into buf, which must outlive it.
+ * Returns the kind of reply that was decoded.  reply->cmd and
+ * reply->type are only valid if this isn't FET_REPLY_KIND_MALFORMED,
+ * or len is at least 4. */
+fet_reply_kind_t fet_reply_decode( fet_reply_t *reply, const uint8_t *buf, uint16_t len );
+
+/* Returns a description of a FET error code */
+const char* fet_reply_error_string( uint8_t code );
+
+#endif	/* __FET_REPLIES_H */
@@ -0,0 +1,333 @@
+/* Pre-encoded streams of memory writes, for loading an image quickly
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "fet-script.h"
+#include "fet-commands.h"
+#include "fet-module.h"
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Saved scripts start with this, followed by the frames and then the
+ * wire images.  They're in the host's byte order and layout, as they're
+ * only for use where they were made: frame_size and the version catch
+ * anything that's changed. */
+#define FET_SCRIPT_MAGIC "FETSCRPT"
+#define FET_SCRIPT_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t frame_size;
+	uint32_t max_payload;
+	uint32_t n_frames;
+	uint32_t wire_len;
+	uint32_t len;
+	uint8_t hash[FET_SCRIPT_HASH_LEN];
+} fet_script_hdr_t;
+
+/* Hash the contents of an image, and where they go, into hash */
+static void fet_script_hash( const elf_image_t *image, uint8_t *hash );
+
+/* Check that the frames of a mapped script are within its wire images.
+ * Returns FALSE if they're not. */
+static gboolean fet_script_check_frames( const fet_script_t *script );
+
+fet_script_t* fet_script_compile( elf_image_t *image, uint16_t max_payload )
+{
+	fet_script_t *script;
+	fet_script_frame_t *frames;
+	uint16_t chunk, i;
+	uint32_t n, wire_max;
+	uint8_t *payload, *wire;
+	g_assert( image != NULL );
+	g_assert( max_payload >= FET_PAYLOAD_MIN && max_payload <= FET_OUTBUF_LEN );
+
+	/* The same chunking as fet_cmd_write_mem_max() */
+	chunk = (max_payload - FET_WRITE_MEM_HDR) & ~1;
+
+	script = g_malloc( sizeof(fet_script_t) );
+	script->image = elf_access_ref( image );
+	script->max_payload = max_payload;
+	script->len = image->len;
+	script->map = NULL;
+	script->map_len = 0;
+	script->refs = 1;
+
+	fet_script_hash( image, script->hash );
+
+	n = 0;
+	for( i=0; i<image->n_extents; i++ )
+		n += (image->extents[i].len + chunk - 1) / chunk;
+
+	/* Cleared, so that saved scripts have no stray padding */
+	frames = g_new0( fet_script_frame_t, n );
+	script->n_frames = n;
+
+	/* Room for the worst case, trimmed once the real size is known */
+	wire_max = n * FET_FRAME_WIRE_LEN(max_payload);
+	wire = g_malloc( wire_max );
+	script->wire_len = 0;
+
+	payload = g_malloc( max_payload );
+
+	n = 0;
+	for( i=0; i<image->n_extents; i++ )
+	{
+		const elf_extent_t *ext = image->extents + i;
+		uint32_t pos;
+
+		for( pos = 0; pos < ext->len; pos += chunk )
+		{
+			fet_script_frame_t *f = frames + n++;
+			uint16_t plen;
+
+			f->addr = ext->addr + pos;
+			f->len = MIN( chunk, ext->len - pos );
+
+			plen = fet_cmd_write_mem_payload( payload, f->addr,
+							  ext->data + pos, f->len );
+
+			f->wire_off = script->wire_len;
+			f->wire_len = fet_module_frame_encode( payload, plen,
+							       wire + script->wire_len );
+			script->wire_len += f->wire_len;
+		}
+	}
+
+	g_free( payload );
+	script->frames = frames;
+	script->wire = g_realloc( wire, script->wire_len );
+
+	return script;
+}
+
+gboolean fet_script_save( const fet_script_t *script, const char *fname )
+{
+	fet_script_hdr_t hdr;
+	gsize frames_len, len;
+	gchar *buf;
+	GError *err = NULL;
+	gboolean r;
+	g_assert( script != NULL && fname != NULL );
+
+	memset( &hdr, 0, sizeof(hdr) );
+	memcpy( hdr.magic, FET_SCRIPT_MAGIC, sizeof(hdr.magic) );
+	hdr.version = FET_SCRIPT_VERSION;
+	hdr.frame_size = sizeof(fet_script_frame_t);
+	hdr.max_payload = script->max_payload;
+	hdr.n_frames = script->n_frames;
+	hdr.wire_len = script->wire_len;
+	hdr.len = script->len;
+	memcpy( hdr.hash, script->hash, FET_SCRIPT_HASH_LEN );
+
+	frames_len = script->n_frames * sizeof(fet_script_frame_t);
+	len = sizeof(hdr) + frames_len + script->wire_len;
+
+	buf = g_malloc( len );
+	memcpy( buf, &hdr, sizeof(hdr) );
+	memcpy( buf + sizeof(hdr), script->frames, frames_len );
+	memcpy( buf + sizeof(hdr) + frames_len, script->wire, script->wire_len );
+
+	/* This goes through a temporary file, so other fetproxies never map
+	 * half a script */
+	r = g_file_set_contents( fname, buf, len, &err );
+	if( !r ) {
+		g_warning( "Failed to save script '%s': %s", fname, err->message );
+		g_error_free( err );
+	}
+
+	g_free( buf );
+	return r;
+}
+
+fet_script_t* fet_script_load( const char *fname,
+			       elf_image_t *image,
+			       uint16_t max_payload )
+{
+	const fet_script_hdr_t *hdr;
+	fet_script_t *script;
+	uint8_t hash[FET_SCRIPT_HASH_LEN];
+	struct stat st;
+	void *map;
+	size_t frames_len;
+	int fd;
+	g_assert( fname != NULL && image != NULL );
+
+	fd = open( fname, O_RDONLY );
+	if( fd < 0 )
+		return NULL;
+
+	if( fstat( fd, &st ) < 0 || st.st_size < (off_t)sizeof(fet_script_hdr_t) ) {
+		close( fd );
+		return NULL;
+	}
+
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	/* The mapping holds its own reference to the file */
+	close( fd );
+
+	if( map == MAP_FAILED ) {
+		g_warning( "Failed to map script '%s': %m", fname );
+		return NULL;
+	}
+
+	hdr = (const fet_script_hdr_t*)map;
+	frames_len = (size_t)hdr->n_frames * sizeof(fet_script_frame_t);
+	fet_script_hash( image, hash );
+
+	if( memcmp( hdr->magic, FET_SCRIPT_MAGIC, sizeof(hdr->magic) ) != 0
+	    || hdr->version != FET_SCRIPT_VERSION
+	    || hdr->frame_size != sizeof(fet_script_frame_t)
+	    || hdr->max_payload != max_payload
+	    || hdr->len != image->len
+	    || memcmp( hdr->hash, hash, FET_SCRIPT_HASH_LEN ) != 0
+	    || (size_t)st.st_size != sizeof(fet_script_hdr_t) + frames_len + hdr->wire_len ) {
+		g_warning( "'%s' isn't a script of this image", fname );
+		munmap( map, st.st_size );
+		return NULL;
+	}
+
+	script = g_malloc( sizeof(fet_script_t) );
+	script->image = elf_access_ref( image );
+	memcpy( script->hash, hash, FET_SCRIPT_HASH_LEN );
+	script->max_payload = max_payload;
+	script->frames = (const fet_script_frame_t*)( hdr + 1 );
+	script->n_frames = hdr->n_frames;
+	script->wire = (const uint8_t*)map + sizeof(fet_script_hdr_t) + frames_len;
+	script->wire_len = hdr->wire_len;
+	script->len = hdr->len;
+	script->map = map;
+	script->map_len = st.st_size;
+	script->refs = 1;
+
+	if( !fet_script_check_frames( script ) ) {
+		g_warning( "Script '%s' is corrupt", fname );
+		fet_script_free( script );
+		return NULL;
+	}
+
+	return script;
+}
+
+fet_script_t* fet_script_cached( const char *dir,
+				 elf_image_t *image,
+				 uint16_t max_payload )
+{
+	fet_script_t *script;
+	uint8_t hash[FET_SCRIPT_HASH_LEN];
+	gchar hex[FET_SCRIPT_HASH_LEN * 2 + 1], *fname;
+	guint i;
+	g_assert( dir != NULL && image != NULL );
+
+	fet_script_hash( image, hash );
+	for( i=0; i<FET_SCRIPT_HASH_LEN; i++ )
+		g_snprintf( hex + i*2, 3, "%2.2x", hash[i] );
+
+	fname = g_strdup_printf( "%s/%s-%hu.fsc", dir, hex, max_payload );
+
+	script = fet_script_load( fname, image, max_payload );
+	if( script != NULL )
+		g_message( "Using compiled image %s", fname );
+	else {
+		script = fet_script_compile( image, max_payload );
+
+		if( fet_script_save( script, fname ) )
+			g_message( "Compiled image into %s", fname );
+	}
+
+	g_free( fname );
+	return script;
+}
+
+fet_script_t* fet_script_ref( fet_script_t *script )
+{
+	g_assert( script != NULL );
+
+	g_atomic_int_inc( &script->refs );
+	return script;
+}
+
+void fet_script_free( fet_script_t *script )
+{
+	g_assert( script != NULL );
+
+	if( !g_atomic_int_dec_and_test( &script->refs ) )
+		return;
+
+	elf_access_free( script->image );
+
+	if( script->map != NULL )
+		munmap( script->map, script->map_len );
+	else {
+		g_free( (fet_script_frame_t*)script->frames );
+		g_free( (uint8_t*)script->wire );
+	}
+
+	g_free( script );
+}
+
+static void fet_script_hash( const elf_image_t *image, uint8_t *hash )
+{
+	GChecksum *cs;
+	gsize len = FET_SCRIPT_HASH_LEN;
+	uint16_t i;
+
+	cs = g_checksum_new( G_CHECKSUM_SHA256 );
+
+	for( i=0; i<image->n_extents; i++ )
+	{
+		const elf_extent_t *ext = image->extents + i;
+		uint8_t h[8] = { ext->addr & 0xff, (ext->addr >> 8) & 0xff,
+				 (ext->addr >> 16) & 0xff, (ext->addr >> 24) & 0xff,
+				 ext->len & 0xff, (ext->len >> 8) & 0xff,
+				 (ext->len >> 16) & 0xff, (ext->len >> 24) & 0xff };
+
+		g_checksum_update( cs, h, sizeof(h) );
+		g_checksum_update( cs, ext->data, ext->len );
+	}
+
+	g_checksum_get_digest( cs, hash, &len );
+	g_checksum_free( cs );
+}
+
+static gboolean fet_script_check_frames( const fet_script_t *script )
+{
+	uint16_t chunk = (script->max_payload - FET_WRITE_MEM_HDR) & ~1;
+	uint32_t i, len = 0;
+
+	/* The frames are trusted to be what they say they are -- the point
+	 * is not to look at them -- but they mustn't take us out of the
+	 * mapping */
+	for( i=0; i<script->n_frames; i++ )
+	{
+		const fet_script_frame_t *f = script->frames + i;
+
+		if( f->len == 0 || f->len > chunk
+		    || f->wire_len == 0
+		    || f->wire_len > FET_FRAME_WIRE_LEN(script->max_payload)
+		    || f->wire_off > script->wire_len
+		    || f->wire_len > script->wire_len - f->wire_off )
+			return FALSE;
+
+		len += f->len;
+	}
+
+	return len == script->len;
+}
@@ -0,0 +1,118 @@
+/* Pre-encoded streams of memory writes, for loading an image quickly
+   Copyright (C) 2009 Robert Spanton, Tom Bennellick
+
+   This file part of fetproxy.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef __FET_SCRIPT_H
+#define __FET_SCRIPT_H
+#include <glib.h>
+#include <stdint.h>
+#include "elf-access.h"
+
+/* The length of an image's hash, which is SHA-256 */
+#define FET_SCRIPT_HASH_LEN 32
+
+/* One memory write frame of a script */
+typedef struct {
+	/* Where the frame writes to, and how many bytes */
+	uint32_t addr;
+	uint16_t len;
+
+	/* The frame's wire image, as an offset into the script's wire buffer */
+	uint32_t wire_off;
+	uint16_t wire_len;
+} fet_script_frame_t;
+
+/* An image turned into the frames that write it, encoded once so that
+ * it can be sent to any number of FETs without doing it again.
+ * Frames are written to the FET straight out of the script.
+ * Scripts are read-only once they've been compiled, so they can be
+ * shared between threads.
+ *
+ * Scripts can be saved, and mapped back in by later runs.  A saved
+ * script is only used for the image it was compiled from (going by the
+ * image's hash), and the same maximum payload.  Nothing else about the
+ * FET or target changes the frames. */
+typedef struct {
+	/* The image that the script was compiled from, and its hash */
+	elf_image_t *image;
+	uint8_t hash[FET_SCRIPT_HASH_LEN];
+
+	/* The largest frame payload that the script was compiled for.
+	 * The script can be sent to any FET that accepts payloads at least
+	 * this large. */
+	uint16_t max_payload;
+
+	/* The frames, in the order they're to be sent */
+	const fet_script_frame_t *frames;
+	uint32_t n_frames;
+
+	/* The wire images of all of the frames, back to back */
+	const uint8_t *wire;
+	uint32_t wire_len;
+
+	/* The mapping of the file that the script was loaded from, which
+	 * frames and wire point into, or NULL if it was compiled */
+	void *map;
+	size_t map_len;
+
+	/* The number of bytes that the script writes */
+	uint32_t len;
+
+	/* The number of holders of the script */
+	int refs;
+} fet_script_t;
+
+/* Compile an image into a script.
+ * Args:
+ *  -       image: The image to compile.  The script takes a reference
+ *                 to it.
+ *  - max_payload: The largest frame payload to use.
+ * Returns the script, with one reference. */
+fet_script_t* fet_script_compile( elf_image_t *image, uint16_t max_payload );
+
+/* Save a script to a file, which is replaced atomically.
+ * Returns FALSE on failure, having given a warning. */
+gboolean fet_script_save( const fet_script_t *script, const char *fname );
+
+/* Map in a script that was saved by fet_script_save().
+ * Nothing is decoded or copied: the frames go out of the mapping.
+ * Args:
+ *  -       fname: The file to load.
+ *  -       image: The image that the script must have been compiled
+ *                 from.  The script takes a reference to it.
+ *  - max_payload: The maximum payload it must have been compiled for.
+ * Returns NULL if the file doesn't exist, or isn't a script of this
+ * image for this payload. */
+fet_script_t* fet_script_load( const char *fname,
+			       elf_image_t *image,
+			       uint16_t max_payload );
+
+/* Get a script for an image from the cache in directory dir, compiling
+ * it, and adding it to the cache, if it's not there.
+ * Arguments and result are as for fet_script_compile(). */
+fet_script_t* fet_script_cached( const char *dir,
+				 elf_image_t *image,
+				 uint16_t max_payload );
+
+/* Take another reference to a script.
+ * Returns script. */
+fet_script_t* fet_script_ref( fet_script_t *script );
+
+/* Drop a reference to a script.
+ * The script's freed once the last has gone. */
+void fet_script_free( fet_script_t *script );
+
+#endif	/* __FET_SCRIPT_H */
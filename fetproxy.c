@@ -18,28 +18,109 @@
 #include <gnet.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <string.h>
 #include "fet-module.h"
 #include "fet-commands.h"
+#include "fet-download.h"
+#include "fet-cache.h"
+#include "fet-script.h"
+#include "fet-gang.h"
 #include "elf-access.h"
 #include "gdb-remote.h"
 #include "gdb-client.h"
 
+/* A FET, and the gdb port that it's served on */
+typedef struct {
+	gchar *dev;
+	guint16 port;
+
+	/* All of the FET's work is done from this context, in a thread of
+	 * its own, so that one busy FET doesn't hold up the others */
+	GMainContext *context;
+	GMainLoop *loop;
+	GThread *thread;
+
+	FetModule *fet;
+	GdbRemote *rem;
+
+	/* How programming the target went, in gang mode */
+	fet_gang_result_t result;
+} fet_proxy_t;
+
 void config_create( int argc, char **argv );
 
-void send_elf( FetModule *fet, char* fname );
+/* Parse a "DEV[:PORT]" FET.  PORT is whatever's after the last colon,
+ * if it's all digits; otherwise the whole thing's the device, and the
+ * port's def_port.  An empty PORT also means def_port, for devices
+ * whose names end in a colon and digits.
+ * Returns FALSE if it's invalid. */
+static gboolean parse_fet( const gchar *s, guint16 def_port, fet_proxy_t *p );
+
+/* Open a FET and start listening for gdb on its port.
+ * Returns FALSE on failure. */
+static gboolean proxy_open( fet_proxy_t *p );
+
+/* Thread function that runs a FET's main loop */
+static gpointer proxy_run( gpointer _p );
+
+/* Parse an "ADDR:LEN" range.  Returns FALSE if it's invalid. */
+static gboolean parse_range( const gchar *s, uint32_t *addr, uint32_t *len );
+
+/* Open, initialise and configure a FET */
+static void setup_fet( FetModule *fet );
+
+/* Idle callback that sets up a gang FET, and starts programming it */
+static gboolean gang_start( gpointer _p );
+
+/* Called in a FET's thread once its target's been programmed */
+static void gang_programmed( FetModule *fet,
+			     const fet_gang_result_t *result,
+			     gpointer _p );
+
+/* Idle callback, in the main thread, for each target that's finished */
+static gboolean gang_done( gpointer _p );
+
+/* Print the result of programming every target of the gang.
+ * Returns TRUE if they all passed. */
+static gboolean gang_report( fet_proxy_t *proxies, guint n_proxies, gdouble t );
+
+/* Called with the target's identity, once the FET's up */
+static void identified( FetModule *fet,
+			fet_reply_status_t status,
+			const fet_reply_t *reply,
+			gpointer userdata );
 
-void send_elf_section( FetModule *fet, elf_section_t* sec );
+/* Log handler for daemon mode, which sends everything to syslog */
+static void log_syslog( const gchar *domain, GLogLevelFlags level,
+			const gchar *message, gpointer userdata );
 
-elf_section_t *cur_sec = NULL;
-elf_section_t *text = NULL, *vectors = NULL;
+/* Start loading the ELF image into a FET */
+void send_elf( FetModule *fet );
 
-gboolean send_elf_timeout( gpointer data );
+/* Called when the ELF file has been loaded */
+void send_elf_done( fet_download_t *dl, gboolean ok, gpointer data );
 
-void send_elf_section_chunk( FetModule *fet, elf_section_t* sec, uint32_t *pos );
+/* The ELF file being loaded.  This is shared by all the FETs. */
+elf_image_t *image = NULL;
+
+/* The image compiled into frames, in gang mode or when there's a
+ * script cache, and the number of targets that are still being
+ * programmed in gang mode */
+static fet_script_t *script = NULL;
+static guint gang_left = 0;
 
 static gchar *sdev = "/dev/ttyUSB0";
 static gchar *elf_file = NULL;
 static gint port = 2000;
+static gint window = FET_DOWNLOAD_WINDOW;
+static gint max_payload = FET_PAYLOAD_DEFAULT;
+static gchar **uncached = NULL;
+static gboolean daemonise = FALSE;
+static gchar **fet_specs = NULL;
+static gboolean gang = FALSE;
+static gchar *script_cache = NULL;
 static GMainLoop *ml = NULL;
 
 static GOptionEntry entries[] = 
@@ -47,6 +128,13 @@ static GOptionEntry entries[] =
 	{ "serial", 's', 0, G_OPTION_ARG_FILENAME, &sdev, "FET Serial Device" },
 	{ "load-file", 'l', 0, G_OPTION_ARG_FILENAME, &elf_file, "ELF file to load into device" },
 	{ "port", 'p', 0, G_OPTION_ARG_INT, &port, "Port to listen for gdb on" },
+	{ "window", 'w', 0, G_OPTION_ARG_INT, &window, "Number of memory writes to keep in flight when loading" },
+	{ "max-payload", 'm', 0, G_OPTION_ARG_INT, &max_payload, "Largest frame payload the FET accepts" },
+	{ "uncached", 'u', 0, G_OPTION_ARG_STRING_ARRAY, &uncached, "Range of target memory to never cache, as ADDR:LEN (may be repeated)" },
+	{ "daemon", 'd', 0, G_OPTION_ARG_NONE, &daemonise, "Run in the background, logging to syslog" },
+	{ "fet", 'f', 0, G_OPTION_ARG_STRING_ARRAY, &fet_specs, "FET to serve, as DEV[:PORT] (may be repeated, instead of --serial).  Ports default to consecutive ones from --port.  Use a /dev/serial/by-id path to pick a FET by its serial number, and end DEV with a colon if its name ends in a colon and digits" },
+	{ "gang", 'g', 0, G_OPTION_ARG_NONE, &gang, "Program every FET with the load file at once, report how each went, and exit" },
+	{ "cache", 'c', 0, G_OPTION_ARG_FILENAME, &script_cache, "Directory to keep compiled load files in, so that they're only compiled once" },
 	{ NULL }
 };
 
@@ -54,57 +142,218 @@ static GOptionEntry entries[] =
 #define P1OUT 0x21
 #define P1SEL 0x26
 
+static void setup_fet( FetModule *fet )
+{
+	fet_cmd_open( fet, NULL, NULL );
+	fet_cmd_init( fet, NULL, NULL );
+	fet_cmd_conf( fet, TRUE, NULL, NULL );
+	fet_cmd_set_vcc( fet, 3000, NULL, NULL );
+}
+
 gboolean init_stuff( gpointer data )
 {
 	FetModule *fet = (FetModule*)data;
 
-	fet_cmd_open(fet);
-	fet_cmd_init(fet);
-	fet_cmd_conf(fet, TRUE);
-	fet_cmd_set_vcc( fet, 3000 );
-	fet_cmd_identify( fet );
+	setup_fet( fet );
+	fet_cmd_identify( fet, identified, NULL );
+
+	if( image != NULL )
+		send_elf( fet );
 
 	return FALSE;
 }
 
 int main( int argc, char** argv )
 {
-	GMainContext *context;
-	FetModule *fet;
-	GdbRemote *rem;
-	gdb_client_callbacks_t fet_callbacks =
-	{
-		.init = fet_module_gdbclient_init,
-		.read_registers = fet_cmd_read_context,
-		.cont = fet_cmd_run
-	};
-
+	fet_proxy_t *proxies;
+	guint n_proxies, i;
+	GError *err = NULL;
+	GTimer *gang_timer = NULL;
+	int ret = 0;
+
+	if( !g_thread_supported() )
+		g_thread_init( NULL );
 	g_type_init();
 	gnet_init();
 
 	config_create( argc, argv );
 
+	/* The default context just accepts gdb connections */
 	ml = g_main_loop_new( NULL, FALSE );
-	context = g_main_loop_get_context( ml );
 
-	if( sdev != NULL )
+	if( fet_specs != NULL ) {
+		n_proxies = g_strv_length( fet_specs );
+		proxies = g_new0( fet_proxy_t, n_proxies );
+
+		for( i=0; i<n_proxies; i++ )
+			if( !parse_fet( fet_specs[i], port + i, proxies + i ) ) {
+				g_print( "Error: Invalid FET \"%s\"\n", fet_specs[i] );
+				return 1;
+			}
+	} else if( sdev != NULL ) {
+		n_proxies = 1;
+		proxies = g_new0( fet_proxy_t, 1 );
+		proxies->dev = g_strdup( sdev );
+		proxies->port = port;
+	} else {
+		n_proxies = 0;
+		proxies = NULL;
+	}
+
+	if( elf_file != NULL ) {
+		image = elf_access_load( elf_file );
+		if( image == NULL ) {
+			g_print( "Error: Failed to read %s\n", elf_file );
+			return 1;
+		}
+
+		for( i=0; i<image->n_extents; i++ )
+			printf( "Segment 0x%5.5x - 0x%5.5x\n",
+				image->extents[i].addr,
+				image->extents[i].addr + image->extents[i].len - 1 );
+
+		/* Encode the image once for the whole gang, or take it from
+		 * the cache if it's been done before */
+		if( script_cache != NULL )
+			script = fet_script_cached( script_cache, image, max_payload );
+		else if( gang )
+			script = fet_script_compile( image, max_payload );
+	}
+
+	for( i=0; i<n_proxies; i++ )
+		if( !proxy_open( proxies + i ) )
+			return 1;
+
+	/* The FETs stay initialised for as long as we run, however many
+	 * gdbs come and go.
+	 * This has to happen before any threads are started, as they
+	 * don't survive the fork. */
+	if( daemonise ) {
+		if( daemon( 1, 0 ) != 0 ) {
+			g_print( "Error: Failed to daemonise: %m\n" );
+			return 1;
+		}
+
+		openlog( "fetproxy", LOG_PID, LOG_DAEMON );
+		g_log_set_default_handler( log_syslog, NULL );
+	}
+
+	/* The GdbClients are created in the FETs' threads, so get their
+	 * type registered first */
+	gdb_client_get_type();
+
+	if( gang ) {
+		gang_left = n_proxies;
+		gang_timer = g_timer_new();
+	}
+
+	for( i=0; i<n_proxies; i++ ) {
+		fet_proxy_t *p = proxies + i;
+		GSource *src;
+
+		src = g_idle_source_new();
+		if( gang )
+			g_source_set_callback( src, gang_start, p, NULL );
+		else
+			g_source_set_callback( src, init_stuff, p->fet, NULL );
+		g_source_attach( src, p->context );
+		g_source_unref( src );
+
+		p->thread = g_thread_create( proxy_run, p, TRUE, &err );
+		if( p->thread == NULL )
+			g_error( "Failed to start a thread for %s: %s",
+				 p->dev, err->message );
+	}
+
+	if( !gang || n_proxies > 0 )
+		g_main_loop_run( ml );
+
+	if( gang ) {
+		if( !gang_report( proxies, n_proxies, g_timer_elapsed( gang_timer, NULL ) ) )
+			ret = 1;
+		g_timer_destroy( gang_timer );
+	}
+
+	for( i=0; i<n_proxies; i++ ) {
+		g_main_loop_quit( proxies[i].loop );
+		g_thread_join( proxies[i].thread );
+
+		fet_module_close( proxies[i].fet );
+		g_main_loop_unref( proxies[i].loop );
+		g_main_context_unref( proxies[i].context );
+		g_free( proxies[i].dev );
+	}
+	g_free( proxies );
+
+	if( script != NULL )
+		fet_script_free( script );
+	if( image != NULL )
+		elf_access_free( image );
+
+	return ret;
+}
+
+static gboolean proxy_open( fet_proxy_t *p )
+{
+	gdb_client_callbacks_t fet_callbacks =
 	{
-		fet = fet_module_open( sdev, context );
-		g_return_val_if_fail( fet != NULL, 1 );
+		.init = fet_module_gdbclient_init,
+		.read_registers = fet_module_gdb_read_registers,
+		.stop_query = fet_module_gdb_stop_query,
+		.write_registers = fet_module_gdb_write_registers,
+		.cont = fet_module_gdb_cont,
+		.step = fet_module_gdb_step,
+		.write_mem = fet_module_gdb_write_mem,
+		.read_mem = fet_module_gdb_read_mem,
+		.interrupt = fet_module_gdb_interrupt,
+		.detach = fet_module_gdb_detach
+	};
+	guint i;
+
+	p->context = g_main_context_new();
+	p->loop = g_main_loop_new( p->context, FALSE );
+
+	p->fet = fet_module_open( p->dev, p->context );
+	if( p->fet == NULL ) {
+		g_print( "Error: Failed to open FET \"%s\"\n", p->dev );
+		return FALSE;
+	}
+
+	fet_module_set_max_payload( p->fet, max_payload );
+
+	for( i=0; uncached != NULL && uncached[i] != NULL; i++ ) {
+		uint32_t addr, len;
+
+		if( !parse_range( uncached[i], &addr, &len ) ) {
+			g_print( "Error: Invalid uncached range \"%s\"\n", uncached[i] );
+			return FALSE;
+		}
+
+		fet_cache_add_uncached( p->fet, addr, len );
+	}
+
+	/* A gang's just programmed, so there's nothing for gdb to do */
+	if( gang ) {
+		g_message( "Programming %s", p->dev );
+		return TRUE;
 	}
 
 	/* Pass the FetModule* to all the FetModule callbacks */
-	fet_callbacks.userdata = fet;
+	fet_callbacks.userdata = p->fet;
 
-	rem = gdb_remote_listen( port, &fet_callbacks );
+	p->rem = gdb_remote_listen( p->port, &fet_callbacks, p->context );
 
-	g_timeout_add( 0, init_stuff, (gpointer)fet );
+	g_message( "Serving %s on port %hu", p->dev, p->port );
+	return TRUE;
+}
 
-	g_main_loop_run( ml );
+static gpointer proxy_run( gpointer _p )
+{
+	fet_proxy_t *p = (fet_proxy_t*)_p;
 
-	fet_module_close( fet );
+	g_main_loop_run( p->loop );
 
-	return 0;
+	return NULL;
 }
 
 void config_create( int argc, char **argv )
@@ -124,58 +373,208 @@ void config_create( int argc, char **argv )
 
 	if( sdev == NULL )
 		g_print( "Warning: No serial port specified = no FET!\n" );
+
+	if( max_payload < FET_PAYLOAD_MIN || max_payload > FET_OUTBUF_LEN ) {
+		g_print( "Error: The maximum payload must be between %u and %u\n",
+			 FET_PAYLOAD_MIN, FET_OUTBUF_LEN );
+		exit(1);
+	}
+
+	if( gang && elf_file == NULL ) {
+		g_print( "Error: Gang mode needs a file to load\n" );
+		exit(1);
+	}
+
+	if( window < 1 || window > FET_FRAME_POOL_LEN ) {
+		g_print( "Error: The write window must be between 1 and %u\n",
+			 FET_FRAME_POOL_LEN );
+		exit(1);
+	}
 }
 
-void send_elf( FetModule *fet, char* fname )
+static void identified( FetModule *fet,
+			fet_reply_status_t status,
+			const fet_reply_t *reply,
+			gpointer userdata )
 {
-	elf_access_load_sections( fname, &text, &vectors );
+	const fet_reply_identify_t *id = fet_module_get_identity( fet );
+
+	if( id == NULL ) {
+		g_warning( "Failed to identify the target" );
+		return;
+	}
 
-	g_timeout_add( 200, send_elf_timeout, (gpointer)fet );
+	g_message( "Target is %s", id->name );
 }
 
-void send_elf_section_chunk( FetModule *fet, elf_section_t* section, uint32_t *pos )
+static void log_syslog( const gchar *domain, GLogLevelFlags level,
+			const gchar *message, gpointer userdata )
 {
-	uint32_t rem;
-	const uint8_t CHUNK_LEN = 32;
-	g_assert( (*pos) < section->len );
+	int prio;
+
+	switch( level & G_LOG_LEVEL_MASK ) {
+	case G_LOG_LEVEL_ERROR:
+		prio = LOG_ERR;
+		break;
+	case G_LOG_LEVEL_CRITICAL:
+		prio = LOG_CRIT;
+		break;
+	case G_LOG_LEVEL_WARNING:
+		prio = LOG_WARNING;
+		break;
+	case G_LOG_LEVEL_DEBUG:
+		prio = LOG_DEBUG;
+		break;
+	default:
+		prio = LOG_INFO;
+	}
 
-	rem = section->len - (*pos);
+	syslog( prio, "%s", message );
+}
 
-	if( rem < CHUNK_LEN )
-		fet_cmd_write_mem( fet, 
-				   section->addr + (*pos),
-				   section->data + (*pos),
-				   rem );
-	else
-		fet_cmd_write_mem( fet, 
-				   section->addr + (*pos),
-				   section->data + (*pos),
-				   CHUNK_LEN );
+void send_elf( FetModule *fet )
+{
+	if( script != NULL ) {
+		fet_download_script_start( fet, script, window, send_elf_done, NULL );
+		return;
+	}
 
-	*pos += CHUNK_LEN;
+	/* The download holds on to the image until it's done */
+	fet_download_start( fet, image->extents, image->n_extents,
+			    window, TRUE, send_elf_done, elf_access_ref( image ) );
 }
 
-gboolean send_elf_timeout( gpointer data )
+void send_elf_done( fet_download_t *dl, gboolean ok, gpointer data )
 {
-	static uint32_t pos = 0;
-	FetModule *fet = (FetModule*)data;
+	FetModule *fet = dl->fet;
 
-	if( cur_sec == NULL )
-		cur_sec = text;
+	if( data != NULL )
+		elf_access_free( (elf_image_t*)data );
 
-	send_elf_section_chunk( fet, cur_sec, &pos );
-	
-	if( pos >= cur_sec->len ) {
-		if( cur_sec == text ) {
-			cur_sec = vectors;
-			pos = 0;
-		} else {
-			fet_cmd_run( fet );
-
-			/* Stop calling me */
+	if( !ok ) {
+		g_print( "Error: Failed to load %s\n", elf_file );
+		return;
+	}
+
+	fet_cmd_run( fet, NULL, NULL );
+}
+
+static gboolean parse_fet( const gchar *s, guint16 def_port, fet_proxy_t *p )
+{
+	const gchar *colon = strrchr( s, ':' );
+	gulong n = def_port;
+
+	p->dev = NULL;
+	p->port = def_port;
+
+	/* Device names can have colons in them too (/dev/serial/by-path
+	 * ones do), so it's only a port if it's all digits */
+	if( colon == NULL
+	    || strspn( colon + 1, "0123456789" ) != strlen( colon + 1 ) )
+		colon = s + strlen( s );
+	else if( colon[1] != 0 ) {
+		n = strtoul( colon + 1, NULL, 10 );
+		if( n == 0 || n > 0xffff )
 			return FALSE;
-		}
 	}
 
+	if( colon == s )
+		return FALSE;
+
+	p->dev = g_strndup( s, colon - s );
+	p->port = n;
 	return TRUE;
 }
+
+static gboolean parse_range( const gchar *s, uint32_t *addr, uint32_t *len )
+{
+	gchar *e;
+
+	*addr = strtoul( s, &e, 0 );
+	if( e == s || *e != ':' )
+		return FALSE;
+
+	s = e + 1;
+	*len = strtoul( s, &e, 0 );
+	if( e == s || *e != 0 || *len == 0 )
+		return FALSE;
+
+	return TRUE;
+}
+
+static gboolean gang_start( gpointer _p )
+{
+	fet_proxy_t *p = (fet_proxy_t*)_p;
+
+	setup_fet( p->fet );
+	fet_gang_program( p->fet, script, window, gang_programmed, p );
+
+	return FALSE;
+}
+
+static void gang_programmed( FetModule *fet,
+			     const fet_gang_result_t *result,
+			     gpointer _p )
+{
+	fet_proxy_t *p = (fet_proxy_t*)_p;
+
+	p->result = *result;
+
+	/* The count of targets left belongs to the main thread */
+	g_idle_add( gang_done, p );
+}
+
+static gboolean gang_done( gpointer _p )
+{
+	fet_proxy_t *p = (fet_proxy_t*)_p;
+
+	g_message( "%s: %s", p->dev, p->result.ok ? "done" : "FAILED" );
+
+	if( --gang_left == 0 )
+		g_main_loop_quit( ml );
+
+	return FALSE;
+}
+
+static gboolean gang_report( fet_proxy_t *proxies, guint n_proxies, gdouble t )
+{
+	gdouble sum = 0;
+	guint i, passed = 0;
+	fet_gang_stage_t s;
+
+	printf( "\n%-24s %-16s %-6s", "FET", "Target", "Result" );
+	for( s = 0; s < FET_GANG_N_STAGES; s++ )
+		printf( " %8s", fet_gang_stage_name( s ) );
+	printf( " %8s\n", "total" );
+
+	for( i=0; i<n_proxies; i++ ) {
+		const fet_gang_result_t *r = &proxies[i].result;
+
+		printf( "%-24s %-16s %-6s", proxies[i].dev,
+			r->name[0] != 0 ? r->name : "?",
+			r->ok ? "PASS" : "FAIL" );
+		for( s = 0; s < FET_GANG_N_STAGES; s++ )
+			printf( " %8.2f", r->times[s] );
+		printf( " %8.2f\n", r->total );
+
+		if( r->ok )
+			passed++;
+		else if( r->status == FET_REPLY_OK )
+			printf( "    %s failed at 0x%5.5x\n",
+				fet_gang_stage_name( r->failed ),
+				(unsigned int)r->bad_addr );
+		else
+			printf( "    %s failed: %s\n",
+				fet_gang_stage_name( r->failed ),
+				r->status == FET_REPLY_TIMEOUT ? "no reply"
+				: r->status == FET_REPLY_CANCELLED ? "not sent"
+				: "error" );
+
+		sum += r->total;
+	}
+
+	printf( "\n%u of %u passed in %.2f s (%.2f s if done one at a time)\n",
+		passed, n_proxies, t, sum );
+
+	return passed == n_proxies;
+}
@@ -0,0 +1,104 @@
+#!/bin/sh
+# Gang-programs a batch of emulated FETs (see fet-emu.c), and checks the
+# report and exit status that fetproxy gives: first with every target
+# good, and then with one that corrupts a byte.
+# Usage: gang-test.sh [N_FETS]
+
+N=${1:-4}
+# Where the image goes, and how much of it there is
+ADDR=61440
+LEN=3000
+# The byte that the bad target corrupts
+BAD=0x0f123
+
+dir=$(mktemp -d) || exit 1
+pids=
+fail=0
+
+trap 'kill $pids 2>/dev/null; rm -rf "$dir"' EXIT
+
+# Little endian fields
+le16() {
+	printf "\\$(printf %03o $(($1 & 255)))\\$(printf %03o $(($1 >> 8 & 255)))"
+}
+le32() {
+	le16 $(($1 & 65535))
+	le16 $(($1 >> 16 & 65535))
+}
+
+# An MSP430 executable, with one segment of random data, so that
+# plenty of it needs escaping
+{
+	printf '\177ELF\001\001\001\000\000\000\000\000\000\000\000\000'
+	le16 2; le16 105; le32 1; le32 $ADDR; le32 52; le32 0; le32 0
+	le16 52; le16 32; le16 1; le16 40; le16 0; le16 0
+
+	le32 1; le32 84; le32 $ADDR; le32 $ADDR; le32 $LEN; le32 $LEN; le32 5; le32 1
+	head -c $LEN /dev/urandom
+} > "$dir/image.elf"
+
+# Start the emulators, with the last one bad if asked for, and list them
+# as fetproxy options in $fets
+start_emus() {
+	kill $pids 2>/dev/null
+	pids=
+	fets=
+	i=0
+	while [ $i -lt $N ]; do
+		rm -f "$dir/fet$i"
+		if [ "$1" = bad ] && [ $i -eq $((N - 1)) ]; then
+			./fet-emu "$dir/fet$i" $BAD &
+		else
+			./fet-emu "$dir/fet$i" &
+		fi
+		pids="$pids $!"
+		fets="$fets -f $dir/fet$i"
+		i=$((i + 1))
+	done
+
+	i=0
+	while [ $i -lt $N ]; do
+		while [ ! -e "$dir/fet$i" ]; do sleep 0.1; done
+		i=$((i + 1))
+	done
+}
+
+# Gang-program the emulators, and check the exit status and how many
+# passed
+# Args: what's being tested, expected exit status, expected passes
+gang() {
+	./fetproxy -g -l "$dir/image.elf" -p 24000 $fets > "$dir/out" 2>&1
+	status=$?
+
+	if [ $status -ne $2 ]; then
+		echo "$1: fetproxy exited with $status, not $2"
+		fail=1
+	fi
+
+	if ! grep -q "^$3 of $N passed" "$dir/out"; then
+		echo "$1: $3 of $N targets should have passed"
+		fail=1
+	fi
+
+	if [ $(grep -c "MSP430F2274 (emulated) *PASS" "$dir/out") -ne $3 ]; then
+		echo "$1: the report should have $3 targets passing"
+		fail=1
+	fi
+}
+
+start_emus good
+gang "All good" 0 $N
+
+start_emus bad
+gang "One bad" 1 $((N - 1))
+if ! grep -q "verify failed at 0x0f123" "$dir/out"; then
+	echo "One bad: the report should say where verifying failed"
+	fail=1
+fi
+
+if [ $fail -ne 0 ]; then
+	cat "$dir/out"
+	exit 1
+fi
+
+echo "gang: $N targets OK"
@@ -1,6 +1,10 @@
 #include "gdb-client.h"
 #include <ctype.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 
 /* Instance initialisation */
 static void gdb_client_instance_init( GTypeInstance *gti, gpointer g_class );
@@ -20,22 +24,96 @@ static gboolean gdb_client_hup( GIOChannel *source,
 				GIOCondition cond,
 				gpointer _cli );
 
-/* Process an incoming byte */
-static void gdb_client_proc_byte( GdbClient *cli, uint8_t b );
+/* Parse and act upon the packets in the receive buffer, until the
+ * buffer's empty or a command has to wait for the target */
+static void gdb_client_proc_input( GdbClient *cli );
 
-static uint8_t gdb_client_checksum( uint8_t* data, uint16_t len );
+/* Carry on processing input after a command has finished */
+static void gdb_client_resume( GdbClient *cli );
 
-/* Process a received frame */
-static void gdb_client_proc_frame( GdbClient *cli );
+/* Pass over anything between packets, i.e. gdb's ACKs, and act on
+ * interrupts.  Stops at the beginning of the next packet. */
+static void gdb_client_skip( GdbClient *cli );
+
+/* Watch the socket for cond, from the client's main context */
+static guint gdb_client_watch_add( GdbClient *cli, GIOCondition cond, GIOFunc func );
+
+/* Remove a watch added by gdb_client_watch_add() */
+static void gdb_client_watch_remove( GdbClient *cli, guint id );
+
+/* Tidy up after gdb has gone away.
+ * If notify is TRUE, the detach callback is called.  That may free the
+ * client, so callers mustn't touch it afterwards. */
+static void gdb_client_disconnect( GdbClient *cli, gboolean notify );
+
+/* Undo the escaping of a packet's data, in place.
+ * Returns the length of the unescaped data. */
+static uint32_t gdb_client_unescape( uint8_t *data, uint32_t len );
+
+static uint8_t gdb_client_checksum( uint8_t* data, uint32_t len );
+
+/* Process a received packet */
+static void gdb_client_proc_packet( GdbClient *cli, uint8_t *data, uint32_t len );
+
+/* Process a memory write packet ('M' or 'X') */
+static void gdb_client_proc_write( GdbClient *cli, uint8_t *data, uint32_t len );
+
+/* Process a register read or write packet ('p', 'G' or 'P') */
+static void gdb_client_proc_reg( GdbClient *cli, uint8_t *data, uint32_t len );
+
+/* Write a register's value into p as gdb expects it: four hex digits,
+ * least significant byte first */
+static void gdb_client_hex_reg( uint8_t *p, uint16_t val );
+
+/* Decode a register's value from four hex digits, least significant
+ * byte first.  Returns FALSE if they're not valid. */
+static gboolean gdb_client_unhex_reg( uint8_t *p, uint16_t *val );
+
+/* Tell gdb that the target has stopped, along with the registers it
+ * needs straight away */
+static void gdb_client_stop_reply( GdbClient *cli, gdb_client_info_t *state );
+
+/* Process a memory read ('m') packet */
+static void gdb_client_proc_read( GdbClient *cli, uint8_t *data, uint32_t len );
+
+/* Decode hex digits in place.
+ * Returns the number of bytes decoded, or -1 if there's a non-hex digit. */
+static int32_t gdb_client_unhex( uint8_t *data, uint32_t len );
+
+/* Process a general query or set packet ('q' or 'Q') */
+static void gdb_client_proc_query( GdbClient *cli, uint8_t *data, uint32_t len );
+
+/* Reply to a qXfer:features:read request.
+ * args points just after the "qXfer:features:read:" */
+static void gdb_client_xfer_features( GdbClient *cli, const uint8_t *args, uint32_t len );
+
+/* Returns TRUE if the packet begins with prefix */
+static gboolean gdb_client_has_prefix( const uint8_t *data, uint32_t len,
+				       const char *prefix );
+
+/* Parse a hex number from *p, stopping at end or the first non-hex
+ * character.  Leaves *p pointing after the number.
+ * Returns FALSE if there weren't any hex digits. */
+static gboolean gdb_client_parse_hex( const uint8_t **p, const uint8_t *end,
+				      uint32_t *val );
 
 /* Add a frame to the transmit queue.
+ * If wrap is TRUE, the data is escaped and framed as a packet, with its
+ * checksum.  Otherwise it's sent as it is (e.g. for ACKs).
  * Copies the data. */
 static void gdb_client_tx_queue( GdbClient *cli,
 				 gboolean wrap,
 				 uint8_t *data,
-				 uint16_t len );
+				 uint32_t len );
 
-static void gdb_client_proc_next_frame( GdbClient *cli );
+
+/* The target description handed to gdb through qXfer */
+static const char target_xml[] =
+	"<?xml version=\"1.0\"?>"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+	"<target version=\"1.0\">"
+	"<architecture>msp430</architecture>"
+	"</target>";
 
 /* Return in the lower nibble.
  * 0xff if the character isn't found. */
@@ -53,16 +131,6 @@ static uint8_t hex_dig_to_nibble( gchar h )
 	return 0xff;	
 }
 
-static void debug_frame_out( uint8_t *d, uint16_t len )
-{
-	uint32_t i;
-
-	printf( "FRAME: " );
-	for( i=0; i<len; i++ )
-		printf( "%c", d[i] );
-	printf( "\n" );
-}
-
 GType gdb_client_get_type( void )
 {
 	static GType type = 0;
@@ -89,25 +157,32 @@ static void gdb_client_instance_init( GTypeInstance *gti, gpointer g_class )
 {
 	GdbClient *rem = (GdbClient*)gti;
 
+	rem->context = NULL;
 	rem->sock = NULL;
-	rem->inpos = 0;
-	rem->recv_state = GDB_REM_RECV_IDLE;
-	rem->recv_escape_next = FALSE;
-
-	rem->chk_recv = 0;
-	rem->chk_recv_pos = 0;
+	rem->in_size = GDB_CLIENT_INBUF_LEN;
+	rem->inbuf = g_malloc( rem->in_size );
+	rem->in_start = rem->in_end = 0;
+	rem->in_packet = FALSE;
+	rem->in_scan = 0;
+	rem->in_watch = 0;
+	rem->hup_watch = 0;
 
 	rem->out_q = g_queue_new();
-	rem->in_q = g_queue_new();
+	rem->opos = 0;
+	rem->out_watch = 0;
+	rem->no_ack = FALSE;
 	rem->wait_state = GDB_CLIENT_IDLE;
 }
 
-GdbClient* gdb_client_new( GTcpSocket *sock, gdb_client_callbacks_t *cb )
+GdbClient* gdb_client_new( GTcpSocket *sock, gdb_client_callbacks_t *cb,
+			   GMainContext *context )
 {
 	GdbClient *cli = g_object_new( GDB_CLIENT_TYPE, NULL );
 	GIOChannel *c = gnet_tcp_socket_get_io_channel( sock );
 	GError *err = NULL;
 
+	if( context != NULL )
+		cli->context = g_main_context_ref( context );
 	cli->sock = sock;
 	cli->target_cb = cb;
 	cb->init( cli, cb->userdata );
@@ -119,36 +194,117 @@ GdbClient* gdb_client_new( GTcpSocket *sock, gdb_client_callbacks_t *cb )
 		g_error( "Failed to set socket to non-blocking: %s",
 			 err->message );
 
-	g_io_add_watch( c, G_IO_IN, gdb_client_incoming, cli );
-	g_io_add_watch( c, G_IO_HUP, gdb_client_hup, cli );
+	cli->in_watch = gdb_client_watch_add( cli, G_IO_IN, gdb_client_incoming );
+	cli->hup_watch = gdb_client_watch_add( cli, G_IO_HUP, gdb_client_hup );
 
 	return cli;
 }
 
+static guint gdb_client_watch_add( GdbClient *cli, GIOCondition cond, GIOFunc func )
+{
+	GIOChannel *c = gnet_tcp_socket_get_io_channel( cli->sock );
+	GSource *src;
+	guint id;
+
+	src = g_io_create_watch( c, cond );
+	g_source_set_callback( src, (GSourceFunc)func, cli, NULL );
+	id = g_source_attach( src, cli->context );
+	g_source_unref( src );
+
+	return id;
+}
+
+static void gdb_client_watch_remove( GdbClient *cli, guint id )
+{
+	GSource *src = g_main_context_find_source_by_id( cli->context, id );
+
+	if( src != NULL )
+		g_source_destroy( src );
+}
+
+void gdb_client_free( GdbClient *cli )
+{
+	g_assert( cli != NULL );
+	/* A command can only be abandoned once gdb has gone */
+	g_assert( cli->sock == NULL || cli->wait_state == GDB_CLIENT_IDLE );
+
+	gdb_client_disconnect( cli, FALSE );
+
+	g_queue_free( cli->out_q );
+	g_free( cli->inbuf );
+	if( cli->context != NULL )
+		g_main_context_unref( cli->context );
+	g_object_unref( cli );
+}
+
+static void gdb_client_disconnect( GdbClient *cli, gboolean notify )
+{
+	gdb_client_frame_t *frame;
+
+	if( cli->sock == NULL )
+		return;
+
+	g_debug( "Client disconnected." );
+
+	if( cli->in_watch != 0 )
+		gdb_client_watch_remove( cli, cli->in_watch );
+	if( cli->hup_watch != 0 )
+		gdb_client_watch_remove( cli, cli->hup_watch );
+	if( cli->out_watch != 0 )
+		gdb_client_watch_remove( cli, cli->out_watch );
+	cli->in_watch = cli->hup_watch = cli->out_watch = 0;
+
+	while( (frame = g_queue_pop_head( cli->out_q )) != NULL ) {
+		g_free( frame->data );
+		g_free( frame );
+	}
+	cli->opos = 0;
+
+	gnet_tcp_socket_delete( cli->sock );
+	cli->sock = NULL;
+
+	if( notify && cli->target_cb->detach != NULL )
+		cli->target_cb->detach( cli->target_cb->userdata );
+}
+
 static gboolean gdb_client_incoming( GIOChannel *source,
 				     GIOCondition cond,
 				     gpointer _cli )
 {
-	gchar b;
 	gsize r;
 	GError *err = NULL;
 	GIOStatus stat;
 	GdbClient *cli = (GdbClient*)_cli;
 
-	do
+	/* Read as much as there's room for */
+	while( cli->in_end < cli->in_size )
 	{
-		stat = g_io_channel_read_chars( source, &b, 1, &r, &err );
+		stat = g_io_channel_read_chars( source,
+						(gchar*)cli->inbuf + cli->in_end,
+						cli->in_size - cli->in_end,
+						&r, &err );
 
 		if( stat == G_IO_STATUS_EOF ) {
-			cli->sock = NULL;
-			g_debug( "TODO: Client disconnection not yet supported!" );
+			/* This source is going anyway */
+			cli->in_watch = 0;
+			gdb_client_disconnect( cli, TRUE );
 			return FALSE;
 		}
 
-		if( stat == G_IO_STATUS_NORMAL )
-			gdb_client_proc_byte( cli, b );
+		if( stat != G_IO_STATUS_NORMAL )
+			break;
+
+		cli->in_end += r;
+	}
+
+	gdb_client_proc_input( cli );
+
+	/* Stop reading until there's room in the buffer again.
+	 * gdb_client_command_complete() starts it again. */
+	if( cli->in_end == cli->in_size ) {
+		cli->in_watch = 0;
+		return FALSE;
 	}
-	while( stat == G_IO_STATUS_NORMAL );	
 
 	return TRUE;
 }
@@ -158,99 +314,156 @@ static gboolean gdb_client_hup( GIOChannel *source,
 				gpointer _cli )
 {
 	GdbClient *cli = (GdbClient*)_cli;
-	g_debug( "TODO: handle hup!" );
 
-	gnet_tcp_socket_delete( cli->sock );
-	cli->sock = NULL;
-	
+	cli->hup_watch = 0;
+	gdb_client_disconnect( cli, TRUE );
+
 	return FALSE;
 }
 
-static void gdb_client_proc_byte( GdbClient *cli, uint8_t b )
+static void gdb_client_proc_input( GdbClient *cli )
 {
-	switch( cli->recv_state ) {
-	case GDB_REM_RECV_IDLE:
-		cli->inpos = 0;
-		cli->chk_recv = 0;
-		cli->chk_recv_pos = 0;
+	if( cli->sock == NULL )
+		return;
 
-		if( b == '$' )
-			cli->recv_state = GDB_REM_RECV_DATA;
-		break;
+	/* Interrupts have to be seen even while a command's waiting --
+	 * that's when they're needed */
+	if( !cli->in_packet )
+		gdb_client_skip( cli );
 
-	case GDB_REM_RECV_DATA:
-		if( b == '#' )
-			cli->recv_state = GDB_REM_RECV_CHECKSUM;
-		else if( b == '}' )
-			cli->recv_escape_next = TRUE;
-		else if( cli->inpos > GDB_CLIENT_INBUF_LEN ) {
-			g_warning( "Incoming frame buffer to long to store incoming frame -- discarding." );
-			cli->recv_state = GDB_REM_RECV_IDLE;
-		} else {
-			if( cli->recv_escape_next ) {
-				b ^= 0x20;
-				cli->recv_escape_next = FALSE;
-			}
+	while( cli->wait_state == GDB_CLIENT_IDLE
+	       && cli->in_start < cli->in_end )
+	{
+		uint8_t *start = cli->inbuf + cli->in_start;
+		uint8_t *end = cli->inbuf + cli->in_end;
+		uint8_t *hash;
+		uint8_t chk_hi, chk_lo;
+		uint32_t raw_len, len;
+
+		if( !cli->in_packet ) {
+			gdb_client_skip( cli );
+			continue;
+		}
 
-			cli->inbuf[ cli->inpos ] = b;
-			cli->inpos++;
+		/* Find the end of the packet, carrying on from where the
+		 * last search left off */
+		hash = memchr( cli->inbuf + cli->in_scan, '#', cli->in_end - cli->in_scan );
+
+		if( hash == NULL ) {
+			cli->in_scan = cli->in_end;
+
+			/* The packet fills the buffer */
+			if( cli->in_start <= 1 && cli->in_end == cli->in_size ) {
+				if( cli->in_size < GDB_CLIENT_INBUF_MAX ) {
+					cli->in_size *= 2;
+					cli->inbuf = g_realloc( cli->inbuf, cli->in_size );
+				} else {
+					g_warning( "Incoming packet too long to store -- discarding." );
+					cli->in_start = cli->in_end;
+					cli->in_packet = FALSE;
+				}
+			}
+			break;
 		}
-		break;
 
-	case GDB_REM_RECV_CHECKSUM:
-	{
-		/* Character from checksum */
-		uint8_t c = hex_dig_to_nibble(b);
+		cli->in_scan = hash - cli->inbuf;
+
+		/* Wait for the checksum */
+		if( end - hash < 3 )
+			break;
 
-		if( c == 0xff ) {
+		cli->in_start = hash + 3 - cli->inbuf;
+		cli->in_packet = FALSE;
+
+		chk_hi = hex_dig_to_nibble( hash[1] );
+		chk_lo = hex_dig_to_nibble( hash[2] );
+		if( chk_hi == 0xff || chk_lo == 0xff ) {
 			g_warning( "Invalid character received in checksum field" );
-			cli->recv_state = GDB_REM_RECV_IDLE;
-		} else {
-			cli->chk_recv |= c << (4 * (1-cli->chk_recv_pos));
-			cli->chk_recv_pos++;
-
-			if( cli->chk_recv_pos == 2 ) {
-				debug_frame_out( cli->inbuf, cli->inpos );
-				g_debug( "(checksum = %x)", cli->chk_recv );
-				if( gdb_client_checksum( cli->inbuf, cli->inpos ) == cli->chk_recv )
-					gdb_client_proc_frame( cli );
-
-				cli->recv_state = GDB_REM_RECV_IDLE;
-			}
+			if( !cli->no_ack )
+				gdb_client_tx_queue( cli, FALSE, (uint8_t*)"-", 1 );
+			continue;
 		}
-		break;		
+
+		/* The checksum covers the data as it was sent, escapes and all */
+		raw_len = hash - start;
+		if( gdb_client_checksum( start, raw_len ) != ((chk_hi << 4) | chk_lo) ) {
+			g_warning( "Incorrect checksum on incoming packet" );
+			if( !cli->no_ack )
+				gdb_client_tx_queue( cli, FALSE, (uint8_t*)"-", 1 );
+			continue;
+		}
+
+		len = gdb_client_unescape( start, raw_len );
+		gdb_client_proc_packet( cli, start, len );
 	}
 
-	default:
-		g_debug( "Ignoring incoming character '%c'", b );
+	/* Move what's left to the front of the buffer.
+	 * Not while a command's waiting though, as it may still be using
+	 * its packet's data. */
+	if( cli->in_start > 0 && cli->wait_state == GDB_CLIENT_IDLE ) {
+		uint32_t rem = cli->in_end - cli->in_start;
+
+		memmove( cli->inbuf, cli->inbuf + cli->in_start, rem );
+
+		if( cli->in_packet )
+			cli->in_scan -= cli->in_start;
+		cli->in_start = 0;
+		cli->in_end = rem;
 	}
 }
 
-static uint8_t gdb_client_checksum( uint8_t* data, uint16_t len )
+static void gdb_client_skip( GdbClient *cli )
 {
-	uint32_t i;
-	uint8_t c = 0;
+	uint8_t *p = cli->inbuf + cli->in_start;
+	uint8_t *end = cli->inbuf + cli->in_end;
 
-	for( i=0; i<len; i++ )
-		c += data[i];
+	for( ; p < end && *p != '$'; p++ )
+		if( *p == GDB_CLIENT_INTERRUPT )
+			cli->target_cb->interrupt( cli->target_cb->userdata );
 
-	return c;
+	if( p == end ) {
+		cli->in_start = cli->in_end;
+		return;
+	}
+
+	cli->in_start = cli->in_scan = p + 1 - cli->inbuf;
+	cli->in_packet = TRUE;
+}
+
+static uint32_t gdb_client_unescape( uint8_t *data, uint32_t len )
+{
+	uint8_t *in = data, *out = data, *end = data + len;
+
+	while( in < end )
+	{
+		uint8_t *esc = memchr( in, '}', end - in );
+		uint32_t run = (esc == NULL ? end : esc) - in;
+
+		/* Copy the run of plain data down */
+		if( out != in )
+			memmove( out, in, run );
+		out += run;
+		in += run;
+
+		if( esc == NULL || esc + 1 >= end )
+			break;
+
+		*(out++) = esc[1] ^ 0x20;
+		in = esc + 2;
+	}
+
+	return out - data;
 }
 
-static void gdb_client_proc_frame( GdbClient *cli )
+static uint8_t gdb_client_checksum( uint8_t* data, uint32_t len )
 {
-	gdb_client_frame_t *f;
+	uint32_t i;
+	uint8_t c = 0;
 
-	g_debug( "Frame added to incoming queue" );
-	/* Stick it on the incoming queue */
-	f = g_malloc( sizeof(gdb_client_frame_t) );
-	f->data = NULL;
-	f->len = cli->inpos;
-	if( cli->inpos > 0 )
-		f->data = g_memdup( cli->inbuf, cli->inpos );
+	for( i=0; i<len; i++ )
+		c += data[i];
 
-	g_queue_push_tail( cli->in_q, f );
-	gdb_client_proc_next_frame( cli );
+	return c;
 }
 
 static gboolean gdb_client_write_cb( GIOChannel *source,
@@ -258,101 +471,76 @@ static gboolean gdb_client_write_cb( GIOChannel *source,
 				     gpointer _cli )
 {
 	GdbClient *cli = (GdbClient*)_cli;
-	gdb_client_frame_t *frame = (gdb_client_frame_t*)g_queue_peek_tail( cli->out_q );
-	uint8_t tx;
-	GIOStatus s;
-	gsize w;
-	GError *err = NULL;
-	gboolean lose_frame = FALSE;
-
-	/* No more frames to transmit */
-	if( frame == NULL )
-		return FALSE;
+	int fd = g_io_channel_unix_get_fd( source );
 
-	switch( cli->tx_state ) {
-	case GDB_REM_TX_IDLE:
-		cli->opos = 0;
-
-		cli->tx_state = GDB_REM_TX_DATA;
-
-		if( frame->wrap ) {
-			tx = '$';
-			
-			if( frame->len == 0 )
-				/* There's no data, so skip to the checksum */
-				cli->tx_state = GDB_REM_TX_CHK_BOUNDARY;
-		}
-		else {
-			g_assert( frame->len > 0 );
-			tx = frame->data[0];
-			cli->opos++;
-
-			if( frame->len == 1 ) {
-				/* We have transmitted all the frame */
-				lose_frame = TRUE;
-				cli->tx_state = GDB_REM_TX_IDLE;
-			}
+	/* Hand as much of the queue as we can to the socket at once */
+	while( !g_queue_is_empty( cli->out_q ) )
+	{
+		struct iovec iov[GDB_CLIENT_TX_IOV_MAX];
+		struct msghdr msg;
+		GList *l;
+		int n;
+		ssize_t w;
+
+		for( l = cli->out_q->head, n = 0;
+		     l != NULL && n < GDB_CLIENT_TX_IOV_MAX;
+		     l = l->next, n++ )
+		{
+			gdb_client_frame_t *frame = (gdb_client_frame_t*)l->data;
+
+			iov[n].iov_base = frame->data;
+			iov[n].iov_len = frame->len;
 		}
-		break;
 
-	case GDB_REM_TX_DATA:
-		tx = frame->data[ cli->opos ];
-		
-		cli->opos++;
-		if( cli->opos == frame->len ) {
-			if( !frame->wrap ) {
-				lose_frame = TRUE;
-				cli->tx_state = GDB_REM_TX_IDLE;
-			} else
-				cli->tx_state = GDB_REM_TX_CHK_BOUNDARY;
-		}
-		break;
+		/* Resume part way through the current frame */
+		iov[0].iov_base = (uint8_t*)iov[0].iov_base + cli->opos;
+		iov[0].iov_len -= cli->opos;
 
-	case GDB_REM_TX_CHK_BOUNDARY:
-		tx = '#';
-		cli->o_chk_pos = 0;
-		cli->o_chk = gdb_client_checksum( frame->data, frame->len );
-		cli->tx_state = GDB_REM_TX_CHK;
-		break;
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
 
-	case GDB_REM_TX_CHK: {
-		const uint8_t lut[] = "0123456789ABCDEF";
+		/* Like writev, but a closed socket doesn't raise SIGPIPE */
+		w = sendmsg( fd, &msg, MSG_NOSIGNAL );
+
+		if( w < 0 ) {
+			if( errno == EAGAIN || errno == EINTR )
+				break;
 
-		tx = lut[ ( cli->o_chk >> (4*(1-cli->o_chk_pos)) ) & 0x0f ];
-		
-		cli->o_chk_pos++;
-		if( cli->o_chk_pos == 2 ) {
-			lose_frame = TRUE;
-			cli->tx_state = GDB_REM_TX_IDLE;
+			g_warning( "Failed to write to gdb: %m" );
+			cli->out_watch = 0;
+			gdb_client_disconnect( cli, TRUE );
+			return FALSE;
 		}
-		break;
-	}
 
-	default:
-		g_error( "Erroneous state in tx state machine" );
+		/* Remove the frames that have been completely written */
+		while( w > 0 )
+		{
+			gdb_client_frame_t *frame = g_queue_peek_head( cli->out_q );
+			uint32_t rem = frame->len - cli->opos;
 
-	}
+			if( w < rem ) {
+				cli->opos += w;
+				break;
+			}
 
-	if( lose_frame ) {
-		g_queue_pop_tail( cli->out_q );
+			w -= rem;
+			cli->opos = 0;
 
-		if( frame->data != NULL )
+			g_queue_pop_head( cli->out_q );
 			g_free( frame->data );
+			g_free( frame );
+		}
 
-		g_free( frame );
+		/* The socket's full */
+		if( cli->opos != 0 )
+			break;
 	}
 
-	s = g_io_channel_write_chars( source,
-				      (gchar*)&tx, 1,
-				      &w, &err );
-
-	if( s != G_IO_STATUS_NORMAL )
-		g_error( "Failed to write byte." );
-
-	g_debug( "Wrote '%c'", tx );
-
-	if( g_queue_is_empty( cli->out_q ) )
+	if( g_queue_is_empty( cli->out_q ) ) {
+		cli->out_watch = 0;
 		return FALSE;
+	}
 
 	return TRUE;
 }
@@ -360,57 +548,81 @@ static gboolean gdb_client_write_cb( GIOChannel *source,
 static void gdb_client_tx_queue( GdbClient *cli,
 				 gboolean wrap,
 				 uint8_t *data,
-				 uint16_t len )
+				 uint32_t len )
 {
 	gdb_client_frame_t *frame;
-	g_debug( "GdbClient: Adding frame to output queue" );
+	g_assert( len == 0 || data != NULL );
+
+	/* gdb's gone */
+	if( cli->sock == NULL )
+		return;
 
 	frame = g_malloc( sizeof(gdb_client_frame_t) );
 
-	frame->data = NULL;
-	if( len != 0 )
-		frame->data = g_memdup( data, len );
+	if( wrap ) {
+		const uint8_t lut[] = "0123456789ABCDEF";
+		uint8_t *o;
+		uint8_t chk = 0;
+		uint32_t i;
+
+		/* Enough for every byte to be escaped, plus the framing */
+		frame->data = o = g_malloc( 2 * len + 4 );
+
+		*(o++) = '$';
+
+		/* The checksum covers the escaped data */
+		for( i=0; i<len; i++ ) {
+			uint8_t b = data[i];
 
-	frame->len = len;
-	frame->wrap = wrap;
+			if( b == '$' || b == '#' || b == '}' || b == '*' ) {
+				*(o++) = '}';
+				chk += '}';
+				b ^= 0x20;
+			}
+
+			*(o++) = b;
+			chk += b;
+		}
+
+		*(o++) = '#';
+		*(o++) = lut[ chk >> 4 ];
+		*(o++) = lut[ chk & 0x0f ];
+
+		frame->len = o - frame->data;
+	} else {
+		g_assert( len > 0 );
+		frame->data = g_memdup( data, len );
+		frame->len = len;
+	}
 
 	/* If the frame output queue isn't empty, then the write callback
 	   is already configured */
-	if( g_queue_is_empty( cli->out_q ) ) {
-		GIOChannel *c = gnet_tcp_socket_get_io_channel( cli->sock );
-		g_io_add_watch( c, G_IO_OUT, gdb_client_write_cb, cli );
-	}
+	if( g_queue_is_empty( cli->out_q ) )
+		cli->out_watch = gdb_client_watch_add( cli, G_IO_OUT, gdb_client_write_cb );
 
 	/* Add to the queue */
-	g_queue_push_head( cli->out_q, frame );
+	g_queue_push_tail( cli->out_q, frame );
 }
 
-static void gdb_client_proc_next_frame( GdbClient *cli )
+static void gdb_client_proc_packet( GdbClient *cli, uint8_t *data, uint32_t len )
 {
-	gdb_client_frame_t *frame;
-
-	if( cli->wait_state != GDB_CLIENT_IDLE )
-		return;
-
-	frame = g_queue_peek_head(cli->in_q);
+	/* ACK */
+	if( !cli->no_ack )
+		gdb_client_tx_queue( cli, FALSE, (uint8_t*)"+", 1 );
 
-	/* No frame there */
-	if( frame == NULL )
+	if( len == 0 ) {
+		g_warning( "Ignoring zero length packet." );
 		return;
-
-	if( frame->len == 0 ) {
-		g_warning( "Ignoring zero length frame." );
-		goto free_frame;
 	}
 
-	/* ACK */
-	gdb_client_tx_queue( cli, FALSE, (uint8_t*)"+", 1 );
-
-	switch( cli->inbuf[0] ) {
+	switch( data[0] ) {
 	case '?':
 		/* gdb's asking why we halted */
-		/* Say that we haven't! */
-		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"T00", 3 );
+		cli->wait_state = GDB_CLIENT_STOP_QUERY;
+		if( cli->target_cb->stop_query != NULL )
+			cli->target_cb->stop_query( cli->target_cb->userdata );
+		else
+			cli->target_cb->read_registers( cli->target_cb->userdata );
 		break;
 
 	case 'g':
@@ -419,21 +631,351 @@ static void gdb_client_proc_next_frame( GdbClient *cli )
 		cli->target_cb->read_registers( cli->target_cb->userdata );
 		break;
 
+	case 'p':
+	case 'G':
+	case 'P':
+		gdb_client_proc_reg( cli, data, len );
+		break;
+
 	case 'c':
 		cli->wait_state = GDB_CLIENT_CONTINUE;
 		cli->target_cb->cont( cli->target_cb->userdata );
 		break;
 
+	case 's':
+		cli->wait_state = GDB_CLIENT_STEP;
+		cli->target_cb->step( cli->target_cb->userdata );
+		break;
+
+	case 'M':
+	case 'X':
+		gdb_client_proc_write( cli, data, len );
+		break;
+
+	case 'm':
+		gdb_client_proc_read( cli, data, len );
+		break;
+
+	case 'q':
+	case 'Q':
+		gdb_client_proc_query( cli, data, len );
+		break;
+
+	case 'D':
+		/* gdb's detaching.  It closes the connection once it's had
+		 * the reply, and the target's left as it is. */
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"OK", 2 );
+		break;
+
 	default:
 		/* We don't support that command */
 		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"", 0 );
 	}
+}
+
+static void gdb_client_proc_write( GdbClient *cli, uint8_t *data, uint32_t len )
+{
+	const uint8_t *p = data + 1, *end = data + len;
+	uint32_t addr, count;
+	uint8_t *payload;
+	uint32_t n;
+
+	/* Both are "addr,length:data" -- M's data is hex, X's is binary */
+	if( !gdb_client_parse_hex( &p, end, &addr )
+	    || p == end || *(p++) != ','
+	    || !gdb_client_parse_hex( &p, end, &count )
+	    || p == end || *(p++) != ':' ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+		return;
+	}
+
+	payload = data + (p - data);
+	n = end - p;
+
+	if( data[0] == 'M' ) {
+		int32_t r = gdb_client_unhex( payload, n );
+
+		if( r < 0 ) {
+			gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+			return;
+		}
+		n = r;
+	}
+
+	if( n != count ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+		return;
+	}
+
+	/* gdb probes for X support with an empty write */
+	if( count == 0 ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"OK", 2 );
+		return;
+	}
+
+	if( addr + count > 0x100000 || addr + count < addr ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E02", 3 );
+		return;
+	}
+
+	cli->wait_state = GDB_CLIENT_MEM_WRITE;
+	cli->target_cb->write_mem( addr, payload, count, cli->target_cb->userdata );
+}
+
+static void gdb_client_proc_reg( GdbClient *cli, uint8_t *data, uint32_t len )
+{
+	const uint8_t *p = data + 1, *end = data + len;
+	uint16_t regs[16];
+	uint32_t n;
+
+	if( data[0] == 'G' ) {
+		/* G followed by all the registers */
+		uint8_t i;
+
+		if( len != 1 + 16 * 4 ) {
+			gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+			return;
+		}
+
+		for( i=0; i<16; i++ )
+			if( !gdb_client_unhex_reg( data + 1 + i * 4, regs + i ) ) {
+				gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+				return;
+			}
+
+		cli->wait_state = GDB_CLIENT_REG_WRITE;
+		cli->target_cb->write_registers( regs, 0xffff, cli->target_cb->userdata );
+		return;
+	}
+
+	/* p n, or P n=rrrr */
+	if( !gdb_client_parse_hex( &p, end, &n ) ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+		return;
+	}
+
+	if( n >= 16 ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E02", 3 );
+		return;
+	}
+
+	if( data[0] == 'p' ) {
+		if( p != end ) {
+			gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+			return;
+		}
+
+		cli->reg_num = n;
+		cli->wait_state = GDB_CLIENT_REG_READ_ONE;
+		cli->target_cb->read_registers( cli->target_cb->userdata );
+		return;
+	}
+
+	if( end - p != 5 || *p != '='
+	    || !gdb_client_unhex_reg( (uint8_t*)p + 1, regs + n ) ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+		return;
+	}
+
+	cli->wait_state = GDB_CLIENT_REG_WRITE;
+	cli->target_cb->write_registers( regs, 1 << n, cli->target_cb->userdata );
+}
+
+static void gdb_client_stop_reply( GdbClient *cli, gdb_client_info_t *state )
+{
+	/* The PC, SP and SR, which gdb needs at every stop */
+	const uint8_t expedite[] = { 0, 1, 2 };
+	const char lut[] = "0123456789abcdef";
+	uint8_t buf[3 + sizeof(expedite) * 8];
+	uint8_t *p = buf;
+	uint8_t i;
+
+	*(p++) = 'T';
+	*(p++) = lut[ state->signal >> 4 ];
+	*(p++) = lut[ state->signal & 0x0f ];
+
+	/* nn:rrrr; for each register */
+	for( i=0; i<sizeof(expedite); i++ ) {
+		*(p++) = lut[ expedite[i] >> 4 ];
+		*(p++) = lut[ expedite[i] & 0x0f ];
+		*(p++) = ':';
+		gdb_client_hex_reg( p, state->reg[ expedite[i] ] );
+		p += 4;
+		*(p++) = ';';
+	}
+
+	gdb_client_tx_queue( cli, TRUE, buf, p - buf );
+}
+
+static void gdb_client_hex_reg( uint8_t *p, uint16_t val )
+{
+	const char lut[] = "0123456789abcdef";
+
+	p[0] = lut[ (val >> 4) & 0x0f ];
+	p[1] = lut[ val & 0x0f ];
+	p[2] = lut[ (val >> 12) & 0x0f ];
+	p[3] = lut[ (val >> 8) & 0x0f ];
+}
+
+static gboolean gdb_client_unhex_reg( uint8_t *p, uint16_t *val )
+{
+	uint8_t n[4];
+	uint8_t i;
+
+	for( i=0; i<4; i++ ) {
+		n[i] = hex_dig_to_nibble( p[i] );
+		if( n[i] == 0xff )
+			return FALSE;
+	}
+
+	*val = (n[0] << 4) | n[1] | (n[2] << 12) | (n[3] << 8);
+	return TRUE;
+}
+
+static void gdb_client_proc_read( GdbClient *cli, uint8_t *data, uint32_t len )
+{
+	const uint8_t *p = data + 1, *end = data + len;
+	uint32_t addr, count;
+
+	/* m addr,length */
+	if( !gdb_client_parse_hex( &p, end, &addr )
+	    || p == end || *(p++) != ','
+	    || !gdb_client_parse_hex( &p, end, &count )
+	    || p != end ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+		return;
+	}
+
+	if( addr >= 0x100000 ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E02", 3 );
+		return;
+	}
+
+	if( count == 0 ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"", 0 );
+		return;
+	}
 
-free_frame:
-	if( frame->data != NULL )
-		g_free( frame->data );
-	g_free( frame );
-	g_queue_pop_head( cli->in_q );
+	/* gdb may ask for less than it gets, but the reply has to fit
+	 * in the packet size that we gave it */
+	count = MIN( count, 0x100000 - addr );
+	count = MIN( count, (GDB_CLIENT_INBUF_MAX - 4) / 2 );
+
+	cli->wait_state = GDB_CLIENT_MEM_READ;
+	cli->target_cb->read_mem( addr, count, cli->target_cb->userdata );
+}
+
+static int32_t gdb_client_unhex( uint8_t *data, uint32_t len )
+{
+	uint32_t i;
+
+	if( len % 2 )
+		return -1;
+
+	for( i=0; i<len; i+=2 ) {
+		uint8_t hi = hex_dig_to_nibble( data[i] );
+		uint8_t lo = hex_dig_to_nibble( data[i+1] );
+
+		if( hi == 0xff || lo == 0xff )
+			return -1;
+
+		data[i/2] = (hi << 4) | lo;
+	}
+
+	return len / 2;
+}
+
+static void gdb_client_proc_query( GdbClient *cli, uint8_t *data, uint32_t len )
+{
+	if( gdb_client_has_prefix( data, len, "qSupported" ) ) {
+		gchar *r;
+
+		/* The receive buffer has to hold the framing too */
+		r = g_strdup_printf( "PacketSize=%x;QStartNoAckMode+;qXfer:features:read+",
+				     GDB_CLIENT_INBUF_MAX - 4 );
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)r, strlen(r) );
+		g_free( r );
+	}
+	else if( gdb_client_has_prefix( data, len, "QStartNoAckMode" ) ) {
+		/* This packet has been ACKed, and gdb ACKs the reply, but
+		 * nothing after that */
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"OK", 2 );
+		cli->no_ack = TRUE;
+	}
+	else if( gdb_client_has_prefix( data, len, "qXfer:features:read:" ) ) {
+		const uint16_t n = strlen( "qXfer:features:read:" );
+
+		gdb_client_xfer_features( cli, data + n, len - n );
+	}
+	else
+		/* We don't support that query */
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"", 0 );
+}
+
+static void gdb_client_xfer_features( GdbClient *cli, const uint8_t *args, uint32_t len )
+{
+	const uint8_t *p = args, *end = args + len;
+	const uint16_t xml_len = sizeof(target_xml) - 1;
+	uint32_t offset, length;
+	uint8_t *r;
+
+	/* Arguments are annex:offset,length */
+	if( !gdb_client_has_prefix( p, len, "target.xml:" ) ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E00", 3 );
+		return;
+	}
+	p += strlen( "target.xml:" );
+
+	if( !gdb_client_parse_hex( &p, end, &offset )
+	    || p == end || *(p++) != ','
+	    || !gdb_client_parse_hex( &p, end, &length ) ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"E01", 3 );
+		return;
+	}
+
+	if( offset >= xml_len ) {
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"l", 1 );
+		return;
+	}
+
+	if( length > xml_len - offset )
+		length = xml_len - offset;
+
+	/* 'l' marks the last chunk, 'm' says that there's more */
+	r = g_malloc( length + 1 );
+	r[0] = offset + length == xml_len ? 'l' : 'm';
+	memcpy( r + 1, target_xml + offset, length );
+
+	gdb_client_tx_queue( cli, TRUE, r, length + 1 );
+	g_free( r );
+}
+
+static gboolean gdb_client_has_prefix( const uint8_t *data, uint32_t len,
+				       const char *prefix )
+{
+	uint16_t n = strlen( prefix );
+
+	return len >= n && memcmp( data, prefix, n ) == 0;
+}
+
+static gboolean gdb_client_parse_hex( const uint8_t **p, const uint8_t *end,
+				      uint32_t *val )
+{
+	const uint8_t *s = *p;
+	uint32_t v = 0;
+
+	while( *p < end ) {
+		uint8_t n = hex_dig_to_nibble( **p );
+
+		if( n == 0xff )
+			break;
+
+		v = (v << 4) | n;
+		(*p)++;
+	}
+
+	*val = v;
+	return *p != s;
 }
 
 void gdb_client_command_complete( gdb_client_info_t *state, gpointer _cli )
@@ -443,17 +985,11 @@ void gdb_client_command_complete( gdb_client_info_t *state, gpointer _cli )
 	switch( cli->wait_state ) {
 	case GDB_CLIENT_REG_READ:
 	{
-		const char lut[] = "0123456789abcdef";
-		char buf[64];
-		char *p;
+		uint8_t buf[64];
 		uint8_t i;
 
-		for( i=0, p=buf; i<16; i++, p+=4 ) {
-			p[3] = lut[ state->reg[i] & 0x0f ];
-		        p[2] = lut[ (state->reg[i] >> 4) & 0x0f ];
-		        p[1] = lut[ (state->reg[i] >> 8) & 0x0f ];
-		        p[0] = lut[ (state->reg[i] >> 12) & 0x0f ];
-		}
+		for( i=0; i<16; i++ )
+			gdb_client_hex_reg( buf + i * 4, state->reg[i] );
 
 		gdb_client_tx_queue( cli, TRUE, buf, 64 );
 
@@ -461,15 +997,109 @@ void gdb_client_command_complete( gdb_client_info_t *state, gpointer _cli )
 		break;
 	}
 
+	case GDB_CLIENT_REG_READ_ONE:
+	{
+		uint8_t buf[4];
+
+		gdb_client_hex_reg( buf, state->reg[cli->reg_num] );
+		gdb_client_tx_queue( cli, TRUE, buf, 4 );
+
+		cli->wait_state = GDB_CLIENT_IDLE;
+		break;
+	}
+
+	case GDB_CLIENT_REG_WRITE:
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"OK", 2 );
+		cli->wait_state = GDB_CLIENT_IDLE;
+		break;
+
+	case GDB_CLIENT_STOP_QUERY:
 	case GDB_CLIENT_CONTINUE:
-		/* gdb doesn't need to know that the target is now running */
+	case GDB_CLIENT_STEP:
+		/* The target's halted */
+		gdb_client_stop_reply( cli, state );
 		cli->wait_state = GDB_CLIENT_IDLE;
 		break;
 
+	case GDB_CLIENT_MEM_WRITE:
+		gdb_client_tx_queue( cli, TRUE, (uint8_t*)"OK", 2 );
+		cli->wait_state = GDB_CLIENT_IDLE;
+		break;
+
+	case GDB_CLIENT_MEM_READ:
+	{
+		const char lut[] = "0123456789abcdef";
+		uint8_t *buf;
+		uint32_t i;
+		g_assert( state->mem != NULL || state->mem_len == 0 );
+
+		buf = g_malloc( 2 * state->mem_len + 1 );
+
+		for( i=0; i<state->mem_len; i++ ) {
+			buf[2*i] = lut[ state->mem[i] >> 4 ];
+			buf[2*i + 1] = lut[ state->mem[i] & 0x0f ];
+		}
+
+		gdb_client_tx_queue( cli, TRUE, buf, 2 * state->mem_len );
+		g_free( buf );
+
+		cli->wait_state = GDB_CLIENT_IDLE;
+		break;
+	}
 
 	default:
 		g_debug( "Ignoring command complete call from FetModule" );
+		return;
 	}
 
-	gdb_client_proc_next_frame( cli );
+	gdb_client_resume( cli );
+
+	/* This may free the client */
+	if( cli->target_cb->done != NULL )
+		cli->target_cb->done( cli->target_cb->userdata );
+}
+
+void gdb_client_command_running( gpointer _cli )
+{
+	GdbClient *cli = GDB_CLIENT(_cli);
+
+	if( cli->wait_state != GDB_CLIENT_CONTINUE ) {
+		g_debug( "Ignoring running call from FetModule" );
+		return;
+	}
+
+	if( cli->target_cb->running != NULL )
+		cli->target_cb->running( cli->target_cb->userdata );
+}
+
+void gdb_client_command_error( uint8_t err, gpointer _cli )
+{
+	GdbClient *cli = GDB_CLIENT(_cli);
+	char buf[4];
+
+	if( cli->wait_state == GDB_CLIENT_IDLE ) {
+		g_debug( "Ignoring command error call from FetModule" );
+		return;
+	}
+
+	g_snprintf( buf, sizeof(buf), "E%2.2x", err );
+	gdb_client_tx_queue( cli, TRUE, (uint8_t*)buf, 3 );
+
+	cli->wait_state = GDB_CLIENT_IDLE;
+
+	gdb_client_resume( cli );
+
+	/* This may free the client */
+	if( cli->target_cb->done != NULL )
+		cli->target_cb->done( cli->target_cb->userdata );
+}
+
+static void gdb_client_resume( GdbClient *cli )
+{
+	/* Carry on with any packets that arrived in the meantime */
+	gdb_client_proc_input( cli );
+
+	if( cli->in_watch == 0 && cli->sock != NULL
+	    && cli->in_end < cli->in_size )
+		cli->in_watch = gdb_client_watch_add( cli, G_IO_IN, gdb_client_incoming );
 }
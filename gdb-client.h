@@ -23,17 +23,31 @@ GType gdb_client_get_type( void );
 #define GDB_IS_CLIENT_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GDB_CLIENT_TYPE))
 #define GDB_CLIENT_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), GDB_CLIENT_TYPE, GdbClientClass))
 
-#define GDB_CLIENT_INBUF_LEN 1024
+/* Initial size of the receive buffer.  It grows to fit larger packets,
+ * up to GDB_CLIENT_INBUF_MAX, which is what's advertised to gdb. */
+#define GDB_CLIENT_INBUF_LEN 4096
+#define GDB_CLIENT_INBUF_MAX (128 * 1024)
+
+/* The maximum number of frames handed to the socket in one write */
+#define GDB_CLIENT_TX_IOV_MAX 16
+
+/* The signals reported to gdb when the target stops: at a breakpoint
+ * or after a step, because gdb interrupted it, or because the FET was
+ * lost while it ran */
+#define GDB_CLIENT_SIGTRAP 5
+#define GDB_CLIENT_SIGINT 2
+#define GDB_CLIENT_SIGLOST 29
+
+/* The byte gdb sends, outside of any packet, to interrupt the target */
+#define GDB_CLIENT_INTERRUPT 0x03
 
 typedef struct
 {
-	/* Whether to wrap the data with the frame header/footer */
-	gboolean wrap;
-
-	/* The frame's data */
+	/* The frame exactly as it goes on the wire: for packets, this
+	 * includes the '$', the escaped data, the '#' and the checksum */
 	uint8_t *data;
 	/* The data length */
-	uint16_t len;
+	uint32_t len;
 } gdb_client_frame_t;
 
 /* Collection of callbacks for talking to the client */
@@ -48,14 +62,64 @@ typedef struct {
 	/* Grab registers */
 	void (*read_registers) ( gpointer userdata );
 
+	/* Optional: gdb's asking why the target stopped.  If it's
+	 * running, it's to be stopped, and the command completed once it
+	 * has.  read_registers is used if this isn't given. */
+	void (*stop_query) ( gpointer userdata );
+
+	/* Set the registers in mask (bit n for register n) from regs.
+	 * These need not reach the target until it next runs. */
+	void (*write_registers) ( const uint16_t *regs, uint16_t mask,
+				  gpointer userdata );
+
 	/* Continue */
 	void (*cont) ( gpointer userdata );
+
+	/* Execute a single instruction */
+	void (*step) ( gpointer userdata );
+
+	/* Write len bytes of data into the target's memory at addr.
+	 * data remains valid until the command completes. */
+	void (*write_mem) ( uint32_t addr, const uint8_t *data, uint32_t len,
+			    gpointer userdata );
+
+	/* Read len bytes of the target's memory from addr.
+	 * The data is handed back through the mem field of
+	 * gdb_client_command_complete()'s state, and may be shorter than
+	 * was asked for. */
+	void (*read_mem) ( uint32_t addr, uint32_t len, gpointer userdata );
+
+	/* gdb wants the running target stopped.  The command that set
+	 * it running completes once it has. */
+	void (*interrupt) ( gpointer userdata );
+
+	/* Optional: called when the target has taken up a continue.  The
+	 * command isn't complete until the target halts, but the target's
+	 * free for other commands until then. */
+	void (*running) ( gpointer userdata );
+
+	/* Optional: called whenever the client has finished with a
+	 * command, once it's been completed or has failed */
+	void (*done) ( gpointer userdata );
+
+	/* Optional: called when gdb has disconnected.  The client can be
+	 * freed once any command it's waiting on has finished. */
+	void (*detach) ( gpointer userdata );
 } gdb_client_callbacks_t;
 
 /* Structure to hold information about the target */
 typedef struct {
 	/* Registers */
 	uint16_t reg[16];
+	/* Which of reg[] hold the target's values (bit n for register n),
+	 * and which of those have yet to be written back to it */
+	uint16_t reg_valid, reg_dirty;
+	/* Why the target last stopped -- one of the GDB_CLIENT_SIG* */
+	uint8_t signal;
+
+	/* The result of a memory read */
+	const uint8_t *mem;
+	uint32_t mem_len;
 } gdb_client_info_t;
 
 struct gdb_client_ts
@@ -64,71 +128,78 @@ struct gdb_client_ts
 
 	/* Socket that we're using */
 	GTcpSocket *sock;
-
-	uint8_t inbuf[GDB_CLIENT_INBUF_LEN];
-	uint16_t inpos;
-
-	/* The receiver state */
-	enum {
-		/* Idle */
-		GDB_REM_RECV_IDLE,
-
-		/* Receiving the packet data */
-		GDB_REM_RECV_DATA,
-
-		/* Receiving the frame checksum */
-		GDB_REM_RECV_CHECKSUM
-	} recv_state;
-
-	gboolean recv_escape_next;
-
-	/* The received checksum */
-	uint8_t chk_recv;
-	uint8_t chk_recv_pos;
-
-	/* Queue of incoming frames (incoming pushed on tail)
-	 * gdb_client_frame_t* */
-	GQueue *in_q;
+	/* The main context that the socket's watched from */
+	GMainContext *context;
+
+	/*** Receiver ***/
+	/* Data from the socket.  Packets are parsed where they lie.
+	 * The unprocessed data is between in_start and in_end. */
+	uint8_t *inbuf;
+	uint32_t in_size;
+	uint32_t in_start, in_end;
+	/* Whether in_start points at the beginning of a packet's data
+	 * (i.e. just after its '$') */
+	gboolean in_packet;
+	/* How far the search for the packet's '#' has got */
+	uint32_t in_scan;
+	/* The socket read watch, or 0 if reading is paused because the
+	 * buffer's full */
+	guint in_watch;
+	guint hup_watch;
 
 	/*** Transmitter ***/
 
-	/* Outgoing frame queue of gdb_client_frame_t* */
+	/* Outgoing frame queue of gdb_client_frame_t*.
+	 * Frames are added at the tail. */
 	GQueue *out_q;
+	/* How much of the frame at the head of out_q has been sent */
 	uint32_t opos;
+	/* The socket write watch, or 0 if there's nothing to send */
+	guint out_watch;
 
-	uint8_t o_chk;
-	uint8_t o_chk_pos;
-
-	/* The transmitter state */
-	enum {
-		/* Idle */
-		GDB_REM_TX_IDLE,
-
-		/* Transmitting data */
-		GDB_REM_TX_DATA,
-
-		GDB_REM_TX_CHK_BOUNDARY,
-		GDB_REM_TX_CHK
-
-	} tx_state;
+	/* Whether gdb has switched off packet acknowledgements */
+	gboolean no_ack;
 
 	gdb_client_callbacks_t *target_cb;
 	enum {
 		GDB_CLIENT_IDLE,
+		GDB_CLIENT_STOP_QUERY,
 		GDB_CLIENT_REG_READ,
-		GDB_CLIENT_CONTINUE
+		GDB_CLIENT_REG_READ_ONE,
+		GDB_CLIENT_REG_WRITE,
+		GDB_CLIENT_CONTINUE,
+		GDB_CLIENT_STEP,
+		GDB_CLIENT_MEM_WRITE,
+		GDB_CLIENT_MEM_READ
 	} wait_state;
 
+	/* The register that a 'p' packet asked for */
 	uint8_t reg_num;
 };
 
 /* Create a new client. 
  * Arguments:
- *  - sock: The socket that the client is connected through.
+ *  -    sock: The socket that the client is connected through.
+ *  - context: The main context to watch the socket from, or NULL for
+ *             the default one.  This should be the target's.
  * Returns: The GdbClient object. */
-GdbClient* gdb_client_new( GTcpSocket *sock, gdb_client_callbacks_t *cb );
+GdbClient* gdb_client_new( GTcpSocket *sock, gdb_client_callbacks_t *cb,
+			   GMainContext *context );
+
+/* Free a client.
+ * It must not be waiting for a command to complete, unless gdb has
+ * disconnected and the command is one that will never complete. */
+void gdb_client_free( GdbClient *cli );
 
 /* To be called by the client when it's ready */
 void gdb_client_command_complete( gdb_client_info_t *state, gpointer _cli );
 
+/* To be called by the client when the target has started running for
+ * a continue.  The command's completed later, when it halts. */
+void gdb_client_command_running( gpointer _cli );
+
+/* To be called by the client when a command has failed.
+ * err is passed to gdb as the error number. */
+void gdb_client_command_error( uint8_t err, gpointer _cli );
+
 #endif	/* __GDB_CLIENT_H */
@@ -1,16 +1,377 @@
 #include "gdb-remote.h"
 #include <gnet.h>
+#include <string.h>
 
 static void gdb_remote_instance_init( GTypeInstance *gti, gpointer g_class );
 
+/* Hand the target the next request, if it's free */
+static void gdb_remote_dispatch( GdbRemote *rem );
+
+/* Queue a request from a session */
+static void gdb_remote_request( gdb_remote_session_t *s, gdb_remote_req_t req );
+
+/* Returns TRUE if the session may change the target.
+ * Otherwise gdb's told that it can't. */
+static gboolean gdb_remote_check_control( gdb_remote_session_t *s );
+
+/* Tell the target that the client it was last given has gone */
+static void gdb_remote_backend_detach( GdbRemote *rem );
+
+/* Free a session */
+static void gdb_remote_session_free( gdb_remote_session_t *s );
+
+/*** Callbacks from the GdbClients ***/
+static void gdb_remote_init( gpointer gdbc, gpointer _s );
+static void gdb_remote_read_registers( gpointer _s );
+static void gdb_remote_stop_query( gpointer _s );
+static void gdb_remote_write_registers( const uint16_t *regs, uint16_t mask,
+					gpointer _s );
+static void gdb_remote_cont( gpointer _s );
+static void gdb_remote_step( gpointer _s );
+static void gdb_remote_write_mem( uint32_t addr, const uint8_t *data, uint32_t len,
+				  gpointer _s );
+static void gdb_remote_read_mem( uint32_t addr, uint32_t len, gpointer _s );
+static void gdb_remote_interrupt( gpointer _s );
+static void gdb_remote_running( gpointer _s );
+static void gdb_remote_done( gpointer _s );
+static void gdb_remote_detach( gpointer _s );
+
+/* A connection on its way to the target's main context */
+typedef struct {
+	GdbRemote *rem;
+	GTcpSocket *sock;
+} gdb_remote_accepted_t;
+
+/* Idle callback, from the target's main context: start a session for a
+ * connection */
+static gboolean gdb_remote_adopt( gpointer _acc );
+
 /* Callback for when a client connects */
 static void gdb_remote_accept( GTcpSocket *server,
 			       GTcpSocket *client,
 			       gpointer _rem )
 {
 	GdbRemote *rem = (GdbRemote*)_rem;
+	gdb_remote_accepted_t *acc;
+	GSource *src;
+
+	if( client == NULL ) {
+		g_warning( "Failed to accept a gdb connection" );
+		return;
+	}
+
+	/* Everything to do with the target happens in its own thread */
+	acc = g_slice_new( gdb_remote_accepted_t );
+	acc->rem = rem;
+	acc->sock = client;
+
+	src = g_idle_source_new();
+	g_source_set_callback( src, gdb_remote_adopt, acc, NULL );
+	g_source_attach( src, rem->context );
+	g_source_unref( src );
+}
+
+static gboolean gdb_remote_adopt( gpointer _acc )
+{
+	gdb_remote_accepted_t *acc = (gdb_remote_accepted_t*)_acc;
+	GdbRemote *rem = acc->rem;
+	GTcpSocket *client = acc->sock;
+	gdb_remote_session_t *s;
+
+	g_slice_free( gdb_remote_accepted_t, acc );
+
+	s = g_slice_new0( gdb_remote_session_t );
+	s->rem = rem;
+	s->controller = ( rem->sessions == NULL );
+
+	s->cb.userdata = s;
+	s->cb.init = gdb_remote_init;
+	s->cb.read_registers = gdb_remote_read_registers;
+	s->cb.stop_query = gdb_remote_stop_query;
+	s->cb.write_registers = gdb_remote_write_registers;
+	s->cb.cont = gdb_remote_cont;
+	s->cb.step = gdb_remote_step;
+	s->cb.write_mem = gdb_remote_write_mem;
+	s->cb.read_mem = gdb_remote_read_mem;
+	s->cb.interrupt = gdb_remote_interrupt;
+	s->cb.running = gdb_remote_running;
+	s->cb.done = gdb_remote_done;
+	s->cb.detach = gdb_remote_detach;
+
+	rem->sessions = g_list_append( rem->sessions, s );
+
+	s->client = gdb_client_new( client, &s->cb, rem->context );
+
+	g_debug( "New %s session.", s->controller ? "controlling" : "observer" );
+	return FALSE;
+}
+
+static void gdb_remote_init( gpointer gdbc, gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+
+	s->client = gdbc;
+}
+
+static void gdb_remote_read_registers( gpointer _s )
+{
+	gdb_remote_request( (gdb_remote_session_t*)_s, GDB_REMOTE_REQ_READ_REGISTERS );
+}
+
+static void gdb_remote_stop_query( gpointer _s )
+{
+	gdb_remote_request( (gdb_remote_session_t*)_s, GDB_REMOTE_REQ_STOP_QUERY );
+}
+
+static void gdb_remote_write_registers( const uint16_t *regs, uint16_t mask,
+					gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+
+	if( !gdb_remote_check_control( s ) )
+		return;
+
+	memcpy( s->regs, regs, sizeof(s->regs) );
+	s->mask = mask;
+	gdb_remote_request( s, GDB_REMOTE_REQ_WRITE_REGISTERS );
+}
+
+static void gdb_remote_cont( gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+
+	if( gdb_remote_check_control( s ) )
+		gdb_remote_request( s, GDB_REMOTE_REQ_CONT );
+}
+
+static void gdb_remote_step( gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+
+	if( gdb_remote_check_control( s ) )
+		gdb_remote_request( s, GDB_REMOTE_REQ_STEP );
+}
+
+static void gdb_remote_write_mem( uint32_t addr, const uint8_t *data, uint32_t len,
+				  gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+
+	if( !gdb_remote_check_control( s ) )
+		return;
+
+	s->addr = addr;
+	s->data = data;
+	s->len = len;
+	gdb_remote_request( s, GDB_REMOTE_REQ_WRITE_MEM );
+}
+
+static void gdb_remote_read_mem( uint32_t addr, uint32_t len, gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+
+	s->addr = addr;
+	s->len = len;
+	gdb_remote_request( s, GDB_REMOTE_REQ_READ_MEM );
+}
+
+static void gdb_remote_interrupt( gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+	GdbRemote *rem = s->rem;
+
+	/* Only the controller can have set the target running */
+	if( !s->controller || rem->client_cb.interrupt == NULL )
+		return;
 
-	rem->client = gdb_client_new( client, &rem->client_cb );
+	rem->client_cb.interrupt( rem->client_cb.userdata );
+}
+
+static void gdb_remote_running( gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+	GdbRemote *rem = s->rem;
+
+	if( rem->current != s )
+		return;
+
+	/* The stop reply comes from the target's halt, whenever that is.
+	 * The others needn't wait for it. */
+	rem->current = NULL;
+	rem->running = s;
+	gdb_remote_dispatch( rem );
+}
+
+static void gdb_remote_done( gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+	GdbRemote *rem = s->rem;
+	/* Whether the target's been told that the client's gone */
+	gboolean told = FALSE;
+
+	if( rem->running == s )
+		/* That was its stop reply */
+		rem->running = NULL;
+	else if( rem->current == s )
+		rem->current = NULL;
+	else {
+		gdb_remote_dispatch( rem );
+		return;
+	}
+
+	if( s->detached )
+		gdb_remote_session_free( s );
+
+	/* A controller that went while the target ran for it, and while
+	 * the target was busy with someone else */
+	if( rem->current == NULL && rem->running != NULL
+	    && rem->running->detached ) {
+		gdb_remote_session_t *gone = rem->running;
+
+		rem->running = NULL;
+		gdb_remote_backend_detach( rem );
+		told = TRUE;
+		gdb_remote_session_free( gone );
+	}
+
+	if( rem->sessions == NULL && rem->current == NULL ) {
+		/* Nobody's left: tidy up for the next gdb */
+		if( !told )
+			gdb_remote_backend_detach( rem );
+	} else
+		gdb_remote_dispatch( rem );
+}
+
+static void gdb_remote_detach( gpointer _s )
+{
+	gdb_remote_session_t *s = (gdb_remote_session_t*)_s;
+	GdbRemote *rem = s->rem;
+	/* Whether the target's been told that the client's gone */
+	gboolean told = FALSE;
+
+	g_debug( "%s session closed.", s->controller ? "Controlling" : "Observer" );
+
+	s->detached = TRUE;
+	rem->sessions = g_list_remove( rem->sessions, s );
+	g_queue_remove( rem->pending, s );
+
+	if( s->controller && rem->sessions != NULL ) {
+		gdb_remote_session_t *next = (gdb_remote_session_t*)rem->sessions->data;
+
+		next->controller = TRUE;
+		g_debug( "Passing control to the next session." );
+	}
+	s->controller = FALSE;
+
+	if( rem->current == s ) {
+		/* The target may still be working for it.  A continue could
+		 * go on for ever, so that's dropped; anything else finishes
+		 * soon enough, and the session's freed then. */
+		if( s->req != GDB_REMOTE_REQ_CONT )
+			return;
+
+		rem->current = NULL;
+		gdb_remote_backend_detach( rem );
+		told = TRUE;
+	} else if( rem->running == s ) {
+		/* Stop waiting for the target on its behalf.  That has to
+		 * wait if the target's busy with someone else's request,
+		 * and then it's done in gdb_remote_done(). */
+		if( rem->current != NULL )
+			return;
+
+		rem->running = NULL;
+		gdb_remote_backend_detach( rem );
+		told = TRUE;
+	}
+
+	gdb_remote_session_free( s );
+
+	if( rem->sessions == NULL && rem->current == NULL ) {
+		/* Nobody's left: tidy up for the next gdb */
+		if( !told )
+			gdb_remote_backend_detach( rem );
+	} else
+		gdb_remote_dispatch( rem );
+}
+
+static void gdb_remote_backend_detach( GdbRemote *rem )
+{
+	if( rem->client_cb.detach != NULL )
+		rem->client_cb.detach( rem->client_cb.userdata );
+}
+
+static void gdb_remote_request( gdb_remote_session_t *s, gdb_remote_req_t req )
+{
+	s->req = req;
+	g_queue_push_tail( s->rem->pending, s );
+
+	gdb_remote_dispatch( s->rem );
+}
+
+static gboolean gdb_remote_check_control( gdb_remote_session_t *s )
+{
+	if( s->controller )
+		return TRUE;
+
+	/* EPERM */
+	gdb_client_command_error( 0x01, s->client );
+	return FALSE;
+}
+
+static void gdb_remote_dispatch( GdbRemote *rem )
+{
+	gdb_client_callbacks_t *cb = &rem->client_cb;
+
+	/* Requests that complete straight away come back through here */
+	if( rem->dispatching )
+		return;
+	rem->dispatching = TRUE;
+
+	while( rem->current == NULL && !g_queue_is_empty( rem->pending ) ) {
+		gdb_remote_session_t *s = g_queue_pop_head( rem->pending );
+
+		rem->current = s;
+
+		/* Point the target's completions at this session's client */
+		cb->init( s->client, cb->userdata );
+
+		switch( s->req ) {
+		case GDB_REMOTE_REQ_READ_REGISTERS:
+			cb->read_registers( cb->userdata );
+			break;
+		case GDB_REMOTE_REQ_STOP_QUERY:
+			/* Only the controller may stop the target to answer */
+			if( s->controller && cb->stop_query != NULL )
+				cb->stop_query( cb->userdata );
+			else
+				cb->read_registers( cb->userdata );
+			break;
+		case GDB_REMOTE_REQ_WRITE_REGISTERS:
+			cb->write_registers( s->regs, s->mask, cb->userdata );
+			break;
+		case GDB_REMOTE_REQ_CONT:
+			cb->cont( cb->userdata );
+			break;
+		case GDB_REMOTE_REQ_STEP:
+			cb->step( cb->userdata );
+			break;
+		case GDB_REMOTE_REQ_WRITE_MEM:
+			cb->write_mem( s->addr, s->data, s->len, cb->userdata );
+			break;
+		case GDB_REMOTE_REQ_READ_MEM:
+			cb->read_mem( s->addr, s->len, cb->userdata );
+			break;
+		}
+	}
+
+	rem->dispatching = FALSE;
+}
+
+static void gdb_remote_session_free( gdb_remote_session_t *s )
+{
+	gdb_client_free( s->client );
+	g_slice_free( gdb_remote_session_t, s );
 }
 
 GType gdb_remote_get_type( void )
@@ -40,22 +401,30 @@ static void gdb_remote_instance_init( GTypeInstance *gti, gpointer g_class )
 	GdbRemote *rem = (GdbRemote*)gti;
 
 	rem->tcp = NULL;
-	rem->client = NULL;
+	rem->context = NULL;
+	rem->sessions = NULL;
+	rem->pending = g_queue_new();
+	rem->current = NULL;
+	rem->running = NULL;
+	rem->dispatching = FALSE;
 }
 
-GdbRemote* gdb_remote_listen( uint16_t port, gdb_client_callbacks_t *client_cb )
+GdbRemote* gdb_remote_listen( uint16_t port, gdb_client_callbacks_t *client_cb,
+			      GMainContext *context )
 {
 	GdbRemote *rem = NULL;
 
 	rem = g_object_new( GDB_REMOTE_TYPE, NULL  );
 
+	rem->client_cb = *client_cb;
+	if( context != NULL )
+		rem->context = g_main_context_ref( context );
+
 	rem->tcp = gnet_tcp_socket_server_new_with_port( port );
 	if( rem->tcp == NULL )
-		g_error( "Failed to listen on port %hhu", port );
+		g_error( "Failed to listen on port %hu", port );
 	
 	gnet_tcp_socket_server_accept_async( rem->tcp, gdb_remote_accept, rem );
 
-	rem->client_cb = *client_cb;
-
 	return rem;
 }
@@ -41,18 +41,80 @@ GType gdb_remote_get_type( void );
 #define GDB_IS_REMOTE_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GDB_REMOTE_TYPE))
 #define GDB_REMOTE_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), GDB_REMOTE_TYPE, GdbRemoteClass))
 
+/* What a session is waiting for the target to do */
+typedef enum {
+	GDB_REMOTE_REQ_READ_REGISTERS,
+	GDB_REMOTE_REQ_STOP_QUERY,
+	GDB_REMOTE_REQ_WRITE_REGISTERS,
+	GDB_REMOTE_REQ_CONT,
+	GDB_REMOTE_REQ_STEP,
+	GDB_REMOTE_REQ_WRITE_MEM,
+	GDB_REMOTE_REQ_READ_MEM
+} gdb_remote_req_t;
+
+/* A gdb connection */
+typedef struct
+{
+	GdbRemote *rem;
+	GdbClient *client;
+
+	/* The callbacks that the client's given, which lead back to the
+	 * GdbRemote */
+	gdb_client_callbacks_t cb;
+
+	/* Whether this session has run control.  The others can only look
+	 * at the target. */
+	gboolean controller;
+	/* Whether gdb has gone */
+	gboolean detached;
+
+	/* The request that's waiting for the target, and its arguments */
+	gdb_remote_req_t req;
+	uint32_t addr, len;
+	const uint8_t *data;
+	uint16_t regs[16];
+	uint16_t mask;
+} gdb_remote_session_t;
+
 struct gdb_remote_ts
 {
 	GObject parent;
 
 	GTcpSocket *tcp;
+	/* The target's main context.  The sessions are all run from it,
+	 * whichever thread accepted their connections. */
+	GMainContext *context;
 
-	/* We currently only support one client */
-	GdbClient *client;
+	/* The connected sessions, oldest first */
+	GList *sessions;
+
+	/* Sessions with a request for the target, in the order they made
+	 * them.  Each has at most one, so they take turns. */
+	GQueue *pending;
+	/* The session whose request the target's busy with, or NULL */
+	gdb_remote_session_t *current;
+	/* The session whose continue the target's carrying out, or NULL.
+	 * It gets its stop reply when the target halts; the others are
+	 * served until then. */
+	gdb_remote_session_t *running;
+	/* Whether gdb_remote_dispatch() is running */
+	gboolean dispatching;
+
+	/* The target's callbacks */
 	gdb_client_callbacks_t client_cb;
 };
 
-/* Start listening on the given port */
-GdbRemote* gdb_remote_listen( uint16_t port, gdb_client_callbacks_t *client_cb );
+/* Start listening on the given port.
+ * Any number of gdbs can connect.  The first to do so controls the
+ * target; the others can read its memory and registers, but not change
+ * them or set it running.  When the controller disconnects, the oldest
+ * of the others takes over.
+ * While the target runs, the others are still answered, though the
+ * target may refuse to read from it until it halts.
+ * Connections are accepted from the default main context, and then
+ * handed over to context (which may be NULL for the default one), from
+ * which the target's callbacks are all called. */
+GdbRemote* gdb_remote_listen( uint16_t port, gdb_client_callbacks_t *client_cb,
+			      GMainContext *context );
 
 #endif	/* __GDB_REMOTE_H */
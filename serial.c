@@ -31,6 +31,9 @@ static gboolean fd_set_nonblocking( int fd );
 
 static gboolean serial_conn_apply_settings( SerialConn *sc );
 
+/* Free a connection that couldn't be opened.  Returns NULL. */
+static SerialConn* serial_conn_abandon( SerialConn *sc );
+
 GType serial_conn_get_type( void )
 {
 	static GType type = 0;
@@ -78,15 +81,16 @@ SerialConn* serial_conn_open( char *fname, const serial_settings_t *settings )
 	sc->fd = open( fname, O_RDWR | O_NONBLOCK );
 	if( sc->fd < 0 ) {
 		fprintf( stderr, "Error: Failed to open serial port: %m\n" );
-		return NULL; 
+		return serial_conn_abandon( sc );
 	}
 
 	if( !fd_set_nonblocking( sc->fd ) )
-		return FALSE;
+		return serial_conn_abandon( sc );
 
 	sc->settings = *settings;
 
-	g_assert( serial_conn_apply_settings( sc ) );
+	if( !serial_conn_apply_settings( sc ) )
+		return serial_conn_abandon( sc );
 
 	/* Pass the file descriptor on to a GIOChannel   */
 	sc->channel = g_io_channel_unix_new( sc->fd );
@@ -96,8 +100,27 @@ SerialConn* serial_conn_open( char *fname, const serial_settings_t *settings )
 	return sc;
 }
 
+static SerialConn* serial_conn_abandon( SerialConn *sc )
+{
+	if( sc->fd >= 0 )
+		close( sc->fd );
+	sc->fd = -1;
+
+	g_object_unref( sc );
+	return NULL;
+}
+
 SerialConn* serial_conn_close( SerialConn* sc )
 {
+	g_assert( sc != NULL );
+
+	/* This closes the fd as well */
+	g_io_channel_shutdown( sc->channel, FALSE, NULL );
+	g_io_channel_unref( sc->channel );
+	sc->channel = NULL;
+	sc->fd = -1;
+
+	g_object_unref( sc );
 	return NULL;
 }
 
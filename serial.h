@@ -70,6 +70,8 @@ struct serial_ts
  * Returns handle to the connection. */
 SerialConn* serial_conn_open( char *fname, const serial_settings_t *settings );
 
+/* Close a serial port, and free the connection.
+ * Returns NULL. */
 SerialConn* serial_conn_close( SerialConn* sc );
 
 /* Get the IO channel  */